@@ -246,6 +246,32 @@ compile_dyninst (systemtap_session& s)
 }
 
 
+// Report how long kbuild took to compile each object, from the lines of
+// "OBJECT START END" (in ns) that the stap-cc-time script logged.  An
+// object may be compiled more than once, e.g. for genksyms.
+static void
+report_compile_times (const vector<string>& objnames,
+                      const string& log)
+{
+  map<string, unsigned long long> nsecs;
+  ifstream in (log.c_str());
+  string line;
+  while (getline (in, line))
+    {
+      istringstream words (line);
+      string obj;
+      unsigned long long start, end;
+      if (words >> obj >> start >> end && end >= start)
+        nsecs[obj] += end - start;
+    }
+
+  for (unsigned i=0; i<objnames.size(); i++)
+    if (nsecs.find (objnames[i]) != nsecs.end())
+      clog << _F("Pass 4: built %s in %llu real ms", objnames[i].c_str(),
+                 nsecs[objnames[i]] / 1000000) << endl;
+}
+
+
 int
 compile_pass (systemtap_session& s)
 {
@@ -499,6 +525,7 @@ compile_pass (systemtap_session& s)
   o << "obj-m := " << s.module_name << ".o" << endl;
 
   // print out all the auxiliary source (->object) file names
+  vector<string> objnames;
   o << s.module_name << "-y := ";
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
     {
@@ -509,6 +536,7 @@ compile_pass (systemtap_session& s)
       assert (objname != "" && objname[objname.size()-1] == 'c');
       objname[objname.size()-1] = 'o'; // now objname
       o << " " + objname;
+      objnames.push_back (objname);
     }
   // and once again, for the translated_source file.  It can't simply
   // be named MODULENAME.c, since kbuild doesn't allow a foo.ko file
@@ -521,6 +549,7 @@ compile_pass (systemtap_session& s)
     assert (objname != "" && objname[objname.size()-1] == 'c');
     objname[objname.size()-1] = 'o'; // now objname
     o << " " + objname;
+    objnames.push_back (objname);
   }
   // and once again, for the trailer type auxiliary outputs.
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
@@ -532,9 +561,63 @@ compile_pass (systemtap_session& s)
       assert (objname != "" && objname[objname.size()-1] == 'c');
       objname[objname.size()-1] = 'o'; // now objname
       o << " " + objname;
+      objnames.push_back (objname);
     }
   o << endl;
 
+  // The objects of self-contained auxiliary sources, like the tracepoint
+  // and --split-module symbol data files, are cached by what they say.
+  // Those compiled before are copied in from the cache, with a rule of
+  // their own so that kbuild doesn't compile them again, and the others
+  // go into the cache once the module is built.  A script that is
+  // edited still recompiles its main file, handlers and all.
+  vector<pair<string, string> > objects_to_cache;
+  unsigned cached_objects = 0;
+  if (s.use_cache)
+    for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
+      {
+        translator_output *aux = s.auxiliary_outputs[i];
+        if (! aux->cacheable_p) continue;
+        string cached = find_object_hash (s, aux->filename);
+        if (cached.empty()) continue;
+        string objpath = aux->filename.substr(0, aux->filename.size()-1) + "o";
+        if (!s.poison_cache && get_file_size(cached) > 0
+            && copy_file(cached, objpath, s.verbose > 2))
+          {
+            string objname = objpath.substr(objpath.rfind('/')+1);
+            o << "$(obj)/" << objname << ": ;" << endl;
+            if (s.verbose > 1)
+              clog << _("Pass 4: using cached ") << cached << endl;
+            cached_objects++;
+          }
+        else
+          objects_to_cache.push_back (make_pair (objpath, cached));
+      }
+  if (s.verbose && cached_objects)
+    clog << _F("Pass 4: took %u of %u objects from the cache", cached_objects,
+               cached_objects + (unsigned) objects_to_cache.size()) << endl;
+
+  // With -v, time the compilation of each object by running its
+  // compiler through a little script, see report_compile_times.
+  string cc_times = s.tmpdir + "/stap-cc-times";
+  if (s.verbose)
+    {
+      string cc_timer = s.tmpdir + "/stap-cc-time";
+      ofstream t (cc_timer.c_str());
+      t << "log=$1; obj=$2; shift 2" << endl;
+      t << "start=`date +%s%N`" << endl;
+      t << "\"$@\"" << endl;
+      t << "rc=$?" << endl;
+      t << "echo \"$obj $start `date +%s%N`\" >> \"$log\"" << endl;
+      t << "exit $rc" << endl;
+      t.close ();
+
+      // NB: private, so that the prerequisites don't inherit it
+      for (unsigned i=0; i<objnames.size(); i++)
+        o << "$(obj)/" << objnames[i] << ": private CC := /bin/sh " << cc_timer
+          << " " << cc_times << " " << objnames[i] << " $(CC)" << endl;
+    }
+
   // add all stapconf dependencies
   o << s.translated_source << ": $(STAPCONF_HEADER)" << endl;
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
@@ -561,6 +644,14 @@ compile_pass (systemtap_session& s)
   rc = run_make_cmd(s, make_cmd);
   if (rc)
     s.set_try_server ();
+  else
+    {
+      for (unsigned i=0; i<objects_to_cache.size(); i++)
+        copy_file (objects_to_cache[i].first, objects_to_cache[i].second,
+                   s.verbose > 2);
+      if (s.verbose)
+        report_compile_times (objnames, cc_times);
+    }
   return rc;
 }
 
@@ -782,6 +873,9 @@ make_run_command (systemtap_session& s, const string& remotedir,
   if (s.buffer_size)
     cmd.insert(cmd.end(), { "-b", lex_cast(s.buffer_size) });
 
+  if (s.defer_symbols)
+    cmd.push_back("-s");
+
   if (s.need_uprobes && !kernel_built_uprobes(s))
     {
       string opt_u = "-u";
@@ -59,5 +59,10 @@ struct option stap_long_options[] = {
   { "target-namespaces",           required_argument, NULL, LONG_OPT_TARGET_NAMESPACES },
   { "monitor",                     optional_argument, NULL, LONG_OPT_MONITOR },
   { "interactive",                 no_argument,       NULL, LONG_OPT_INTERACTIVE},
+  { "binary-trace",                no_argument,       NULL, LONG_OPT_BINARY_TRACE },
+  { "pass2-jobs",                  required_argument, NULL, LONG_OPT_PASS2_JOBS },
+  { "split-module",                required_argument, NULL, LONG_OPT_SPLIT_MODULE },
+  { "line-table-budget",           required_argument, NULL, LONG_OPT_LINE_TABLE_BUDGET },
+  { "defer-symbols",               no_argument,       NULL, LONG_OPT_DEFER_SYMBOLS },
   { NULL, 0, NULL, 0 }
 };
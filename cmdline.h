@@ -63,6 +63,11 @@ enum {
   LONG_OPT_TARGET_NAMESPACES,
   LONG_OPT_MONITOR,
   LONG_OPT_INTERACTIVE,
+  LONG_OPT_BINARY_TRACE,
+  LONG_OPT_PASS2_JOBS,
+  LONG_OPT_SPLIT_MODULE,
+  LONG_OPT_LINE_TABLE_BUDGET,
+  LONG_OPT_DEFER_SYMBOLS,
 };
 
 // NB: when adding new options, consider very carefully whether they
@@ -26,12 +26,16 @@
 
 #include <cstdlib>
 #include <algorithm>
+#include <atomic>
 #include <deque>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <set>
 #include <sstream>
 #include <stdexcept>
+#include <system_error>
+#include <thread>
 #include <vector>
 #include <cstdarg>
 #include <cassert>
@@ -50,6 +54,10 @@ extern "C" {
 #include <fnmatch.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include "loc2c.h"
 #define __STDC_FORMAT_MACROS
@@ -88,6 +96,529 @@ struct obstack_tracker
 };
 
 
+// Only DIEs that dwarf_offdie() finds again from their offset can be
+// referred to by it; those of type units or of a dwz alternate file
+// can't.
+static bool
+dwarf_die_offset (Dwarf* dw, Dwarf_Die* die, Dwarf_Off* off)
+{
+  Dwarf_Die found;
+  *off = dwarf_dieoffset(die);
+  return dwarf_offdie(dw, *off, &found) && found.addr == die->addr;
+}
+
+
+// A persistent index of what pass 2 otherwise learns by walking every
+// DIE of a CU: the functions that dwarf_getfuncs() finds, the inline
+// instances of each abstract origin, and the entry pcs of the
+// functions.  It lives in the cache directory, keyed by the module's
+// build-id, and refers to DIEs by their offsets, so a later run only
+// has to dwarf_offdie() the DIEs it actually looks at.
+//
+// The file is mapped read-only.  CUs that were resolved without the
+// index are collected and written back, merged with the old contents,
+// when the dwflpp goes away.  Everything is native-endian; the cache
+// hash already covers the stap binary that wrote it.
+struct dwarf_index
+{
+  enum { idx_functions = 1, idx_inlines = 2, idx_entry_pcs = 4 };
+
+  struct file_header
+  {
+    char magic[8];
+    uint32_t ncus, nfuncs, ninlines, npcs, strsize, unused;
+  };
+
+  struct file_cu
+  {
+    uint64_t cu_off;
+    uint32_t flags;
+    uint32_t func_start, func_count;
+    uint32_t inl_start, inl_count;
+    uint32_t pc_start, pc_count;
+    uint32_t unused;
+  };
+
+  struct file_func
+  {
+    uint64_t die_off;
+    uint32_t name;
+    uint32_t unused;
+  };
+
+  struct file_inline
+  {
+    uint64_t origin_off;
+    uint64_t inst_off;
+  };
+
+  struct cu_data
+  {
+    uint32_t flags;
+    vector<pair<string, Dwarf_Off> > funcs;
+    vector<pair<Dwarf_Off, Dwarf_Off> > inlines;
+    vector<uint64_t> entry_pcs;
+    cu_data(): flags(0) {}
+  };
+
+  systemtap_session& sess;
+  string path;
+  Dwarf* dw;
+  bool relocatable;
+
+  void* mapping;
+  size_t map_size;
+  const file_header* hdr;
+  const file_cu* cus;
+  const file_func* funcs;
+  const file_inline* inlines;
+  const uint64_t* pcs;
+  const char* strings;
+
+  map<Dwarf_Off, cu_data> added;
+
+  dwarf_index(systemtap_session& s, const string& path, Dwarf* dw,
+              bool relocatable);
+  ~dwarf_index();
+
+  // NB: the getters may leave a partial result when they fail.
+  bool get_functions (Dwarf_Die* cu, vector<Dwarf_Die>& v);
+  void put_functions (Dwarf_Die* cu, const vector<Dwarf_Die>& v);
+  bool get_inlines (Dwarf_Die* cu, inline_instances_t& v);
+  void put_inlines (Dwarf_Die* cu, const inline_instances_t& v);
+  bool get_entry_pcs (Dwarf_Die* cu, entry_pc_cache_t& v);
+  void put_entry_pcs (Dwarf_Die* cu, const entry_pc_cache_t& v);
+  bool has (Dwarf_Die* cu, uint32_t flag);
+
+private:
+  static const char file_magic[8];
+
+  void load();
+  void save();
+  bool die_offset (Dwarf_Die* die, Dwarf_Off* off);
+  bool get_die (Dwarf_Off off, Dwarf_Die* die);
+  const file_cu* find (Dwarf_Off cu_off, uint32_t flag);
+  void load_cu (const file_cu* c, cu_data& d);
+  cu_data* add (Dwarf_Die* cu);
+};
+
+const char dwarf_index::file_magic[8] = { 'S', 'T', 'A', 'P', 'D', 'W', 'X', '1' };
+
+
+dwarf_index::dwarf_index(systemtap_session& s, const string& path,
+                         Dwarf* dw, bool relocatable):
+  sess(s), path(path), dw(dw), relocatable(relocatable),
+  mapping(MAP_FAILED), map_size(0), hdr(NULL), cus(NULL), funcs(NULL),
+  inlines(NULL), pcs(NULL), strings(NULL)
+{
+  if (!sess.poison_cache)
+    load();
+}
+
+
+dwarf_index::~dwarf_index()
+{
+  if (!added.empty() && !pending_interrupts)
+    save();
+  if (mapping != MAP_FAILED)
+    munmap(mapping, map_size);
+}
+
+
+void
+dwarf_index::load()
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(file_header))
+    {
+      map_size = st.st_size;
+      mapping = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return;
+
+  // Check that the file is complete and self-consistent before
+  // trusting any of its offsets.
+  const file_header* h = (const file_header*) mapping;
+  const char* base = (const char*) mapping;
+  uint64_t size = sizeof(*h) + (uint64_t) h->ncus * sizeof(file_cu)
+    + (uint64_t) h->nfuncs * sizeof(file_func)
+    + (uint64_t) h->ninlines * sizeof(file_inline)
+    + (uint64_t) h->npcs * sizeof(uint64_t) + h->strsize;
+  bool ok = (memcmp(h->magic, file_magic, sizeof(file_magic)) == 0
+             && size == map_size && h->strsize > 0
+             && base[map_size - 1] == '\0');
+  if (ok)
+    {
+      cus = (const file_cu*) (h + 1);
+      funcs = (const file_func*) (cus + h->ncus);
+      inlines = (const file_inline*) (funcs + h->nfuncs);
+      pcs = (const uint64_t*) (inlines + h->ninlines);
+      strings = (const char*) (pcs + h->npcs);
+    }
+  for (uint32_t i = 0; ok && i < h->ncus; ++i)
+    {
+      const file_cu& c = cus[i];
+      ok = ((i == 0 || cus[i - 1].cu_off < c.cu_off)
+            && (uint64_t) c.func_start + c.func_count <= h->nfuncs
+            && (uint64_t) c.inl_start + c.inl_count <= h->ninlines
+            && (uint64_t) c.pc_start + c.pc_count <= h->npcs);
+    }
+  for (uint32_t i = 0; ok && i < h->nfuncs; ++i)
+    ok = funcs[i].name < h->strsize;
+
+  if (!ok)
+    {
+      if (sess.verbose > 1)
+        clog << _F("Pass 2: ignoring invalid DWARF index %s", path.c_str()) << endl;
+      munmap(mapping, map_size);
+      mapping = MAP_FAILED;
+      cus = NULL;
+      return;
+    }
+
+  hdr = h;
+  if (sess.verbose > 2)
+    clog << _F("Pass 2: using DWARF index %s (%u CUs)", path.c_str(), hdr->ncus) << endl;
+}
+
+
+void
+dwarf_index::save()
+{
+  // Merge the old contents with what this run added.
+  for (uint32_t i = 0; hdr && i < hdr->ncus; ++i)
+    if (added.find(cus[i].cu_off) == added.end())
+      load_cu(&cus[i], added[cus[i].cu_off]);
+
+  file_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, file_magic, sizeof(file_magic));
+
+  vector<file_cu> out_cus;
+  vector<file_func> out_funcs;
+  vector<file_inline> out_inlines;
+  vector<uint64_t> out_pcs;
+  string out_strings(1, '\0');
+  unordered_map<string, uint32_t> string_offsets;
+
+  for (auto it = added.begin(); it != added.end(); ++it)
+    {
+      const cu_data& d = it->second;
+      file_cu c;
+      memset(&c, 0, sizeof(c));
+      c.cu_off = it->first;
+      c.flags = d.flags;
+
+      c.func_start = out_funcs.size();
+      c.func_count = d.funcs.size();
+      for (auto f = d.funcs.begin(); f != d.funcs.end(); ++f)
+        {
+          auto s = string_offsets.insert(make_pair(f->first, out_strings.size()));
+          if (s.second)
+            out_strings.append(f->first.c_str(), f->first.size() + 1);
+          file_func ff = { f->second, s.first->second, 0 };
+          out_funcs.push_back(ff);
+        }
+
+      c.inl_start = out_inlines.size();
+      c.inl_count = d.inlines.size();
+      for (auto i = d.inlines.begin(); i != d.inlines.end(); ++i)
+        {
+          file_inline fi = { i->first, i->second };
+          out_inlines.push_back(fi);
+        }
+
+      c.pc_start = out_pcs.size();
+      c.pc_count = d.entry_pcs.size();
+      out_pcs.insert(out_pcs.end(), d.entry_pcs.begin(), d.entry_pcs.end());
+
+      out_cus.push_back(c);
+    }
+
+  h.ncus = out_cus.size();
+  h.nfuncs = out_funcs.size();
+  h.ninlines = out_inlines.size();
+  h.npcs = out_pcs.size();
+  h.strsize = out_strings.size();
+
+  // Write a private copy and rename it into place, so that concurrent
+  // runs only ever see a complete index.
+  string tmp = path + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0)
+    return;
+  close(fd);
+
+  ofstream o(tmp.c_str(), ios::binary | ios::trunc);
+  o.write((const char*) &h, sizeof(h));
+  o.write((const char*) out_cus.data(), out_cus.size() * sizeof(file_cu));
+  o.write((const char*) out_funcs.data(), out_funcs.size() * sizeof(file_func));
+  o.write((const char*) out_inlines.data(), out_inlines.size() * sizeof(file_inline));
+  o.write((const char*) out_pcs.data(), out_pcs.size() * sizeof(uint64_t));
+  o.write(out_strings.data(), out_strings.size());
+  o.close();
+
+  if (o.fail() || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+      if (sess.verbose > 1)
+        clog << _F("Pass 2: failed to save DWARF index %s", path.c_str()) << endl;
+      unlink(tmp.c_str());
+      return;
+    }
+
+  if (sess.verbose > 2)
+    clog << _F("Pass 2: saved DWARF index %s (%u CUs)", path.c_str(), h.ncus) << endl;
+}
+
+
+bool
+dwarf_index::die_offset (Dwarf_Die* die, Dwarf_Off* off)
+{
+  return dwarf_die_offset(dw, die, off);
+}
+
+
+bool
+dwarf_index::get_die (Dwarf_Off off, Dwarf_Die* die)
+{
+  return dwarf_offdie(dw, off, die) != NULL;
+}
+
+
+const dwarf_index::file_cu*
+dwarf_index::find (Dwarf_Off cu_off, uint32_t flag)
+{
+  if (!hdr)
+    return NULL;
+
+  const file_cu* begin = cus;
+  const file_cu* end = cus + hdr->ncus;
+  while (begin < end)
+    {
+      const file_cu* mid = begin + (end - begin) / 2;
+      if (mid->cu_off < cu_off)
+        begin = mid + 1;
+      else
+        end = mid;
+    }
+  if (begin == cus + hdr->ncus || begin->cu_off != cu_off
+      || !(begin->flags & flag))
+    return NULL;
+  return begin;
+}
+
+
+void
+dwarf_index::load_cu (const file_cu* c, cu_data& d)
+{
+  d.flags = c->flags;
+  for (uint32_t i = 0; i < c->func_count; ++i)
+    {
+      const file_func& f = funcs[c->func_start + i];
+      d.funcs.push_back(make_pair(string(strings + f.name), f.die_off));
+    }
+  for (uint32_t i = 0; i < c->inl_count; ++i)
+    {
+      const file_inline& fi = inlines[c->inl_start + i];
+      d.inlines.push_back(make_pair(fi.origin_off, fi.inst_off));
+    }
+  d.entry_pcs.assign(pcs + c->pc_start, pcs + c->pc_start + c->pc_count);
+}
+
+
+bool
+dwarf_index::has (Dwarf_Die* cu, uint32_t flag)
+{
+  Dwarf_Off cu_off;
+  if (!die_offset(cu, &cu_off))
+    return false;
+
+  auto it = added.find(cu_off);
+  if (it != added.end())
+    return it->second.flags & flag;
+  return find(cu_off, flag) != NULL;
+}
+
+
+dwarf_index::cu_data*
+dwarf_index::add (Dwarf_Die* cu)
+{
+  Dwarf_Off cu_off;
+  if (!die_offset(cu, &cu_off))
+    return NULL;
+
+  auto it = added.find(cu_off);
+  if (it == added.end())
+    {
+      it = added.insert(make_pair(cu_off, cu_data())).first;
+      const file_cu* c = find(cu_off, ~0U);
+      if (c)
+        load_cu(c, it->second);
+    }
+  return &it->second;
+}
+
+
+bool
+dwarf_index::get_functions (Dwarf_Die* cu, vector<Dwarf_Die>& v)
+{
+  Dwarf_Off cu_off;
+  if (!die_offset(cu, &cu_off))
+    return false;
+
+  Dwarf_Die die;
+  auto it = added.find(cu_off);
+  if (it != added.end())
+    {
+      if (!(it->second.flags & idx_functions))
+        return false;
+      for (auto f = it->second.funcs.begin(); f != it->second.funcs.end(); ++f)
+        if (!get_die(f->second, &die))
+          return false;
+        else
+          v.push_back(die);
+      return true;
+    }
+
+  const file_cu* c = find(cu_off, idx_functions);
+  if (!c)
+    return false;
+  for (uint32_t i = 0; i < c->func_count; ++i)
+    if (!get_die(funcs[c->func_start + i].die_off, &die))
+      return false;
+    else
+      v.push_back(die);
+  return true;
+}
+
+
+void
+dwarf_index::put_functions (Dwarf_Die* cu, const vector<Dwarf_Die>& v)
+{
+  cu_data d;
+  for (auto it = v.begin(); it != v.end(); ++it)
+    {
+      Dwarf_Off off = 0;
+      Dwarf_Die die = *it;
+      if (!die_offset(&die, &off))
+        return;
+      d.funcs.push_back(make_pair(string(dwarf_diename(&die)), off));
+    }
+
+  cu_data* p = add(cu);
+  if (p)
+    {
+      p->funcs.swap(d.funcs);
+      p->flags |= idx_functions;
+    }
+}
+
+
+bool
+dwarf_index::get_inlines (Dwarf_Die* cu, inline_instances_t& v)
+{
+  Dwarf_Off cu_off;
+  if (!die_offset(cu, &cu_off))
+    return false;
+
+  Dwarf_Die origin, inst;
+
+  auto it = added.find(cu_off);
+  if (it != added.end())
+    {
+      if (!(it->second.flags & idx_inlines))
+        return false;
+      for (auto i = it->second.inlines.begin(); i != it->second.inlines.end(); ++i)
+        if (!get_die(i->first, &origin) || !get_die(i->second, &inst))
+          return false;
+        else
+          v.push_back(make_pair(origin, inst));
+      return true;
+    }
+
+  const file_cu* c = find(cu_off, idx_inlines);
+  if (!c)
+    return false;
+  for (uint32_t i = 0; i < c->inl_count; ++i)
+    {
+      const file_inline& fi = inlines[c->inl_start + i];
+      if (!get_die(fi.origin_off, &origin) || !get_die(fi.inst_off, &inst))
+        return false;
+      v.push_back(make_pair(origin, inst));
+    }
+  return true;
+}
+
+
+void
+dwarf_index::put_inlines (Dwarf_Die* cu, const inline_instances_t& v)
+{
+  cu_data d;
+  for (auto it = v.begin(); it != v.end(); ++it)
+    {
+      Dwarf_Off origin = 0, inst = 0;
+      Dwarf_Die origin_die = it->first, inst_die = it->second;
+      if (!die_offset(&origin_die, &origin) || !die_offset(&inst_die, &inst))
+        return;
+      d.inlines.push_back(make_pair(origin, inst));
+    }
+
+  cu_data* p = add(cu);
+  if (p)
+    {
+      p->inlines.swap(d.inlines);
+      p->flags |= idx_inlines;
+    }
+}
+
+
+bool
+dwarf_index::get_entry_pcs (Dwarf_Die* cu, entry_pc_cache_t& v)
+{
+  Dwarf_Off cu_off;
+  if (!die_offset(cu, &cu_off))
+    return false;
+
+  auto it = added.find(cu_off);
+  if (it != added.end())
+    {
+      if (!(it->second.flags & idx_entry_pcs))
+        return false;
+      v.insert(it->second.entry_pcs.begin(), it->second.entry_pcs.end());
+      return true;
+    }
+
+  const file_cu* c = find(cu_off, idx_entry_pcs);
+  if (!c)
+    return false;
+  v.insert(pcs + c->pc_start, pcs + c->pc_start + c->pc_count);
+  return true;
+}
+
+
+void
+dwarf_index::put_entry_pcs (Dwarf_Die* cu, const entry_pc_cache_t& v)
+{
+  // The addresses of a relocatable module depend on where libdwfl
+  // placed its sections in this session.
+  if (relocatable)
+    return;
+
+  cu_data* p = add(cu);
+  if (p)
+    {
+      p->entry_pcs.assign(v.begin(), v.end());
+      p->flags |= idx_entry_pcs;
+    }
+}
+
+
 dwflpp::dwflpp(systemtap_session & session, const string& name, bool kernel_p):
   sess(session), module(NULL), module_bias(0), mod_info(NULL),
   module_start(0), module_end(0), cu(NULL), dwfl(NULL),
@@ -131,6 +662,11 @@ dwflpp::~dwflpp()
 
   delete_map(cu_entry_pc_cache);
 
+  delete_map(cu_scan_cache);
+
+  // NB: this writes back what the indexes learned
+  delete_map(dwarf_index_cache);
+
   if (dwfl)
     dwfl_end(dwfl);
   // NB: don't "delete mod_info;", as that may be shared
@@ -498,6 +1034,276 @@ dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
 }
 
 
+static int
+scan_cus_collect (Dwarf_Die* cu, vector<Dwarf_Die>* cus)
+{
+  cus->push_back(*cu);
+  return DWARF_CB_OK;
+}
+
+
+static int
+scan_cus_function (Dwarf_Die* func, vector<Dwarf_Die>* funcs)
+{
+  if (dwarf_diename(func))
+    funcs->push_back(*func);
+  return DWARF_CB_OK;
+}
+
+
+// libdw handles must not be shared between threads, so each task of
+// the work gets its own, opened on the module's Elf (which dwfl has
+// already relocated) before any thread starts.  The workers return DIE
+// offsets, which dwarf_offdie() turns back into DIEs of module_dwarf.
+cu_scan_work::~cu_scan_work()
+{
+  for (auto it = tasks.begin(); it != tasks.end(); ++it)
+    dwarf_end(it->dw);
+}
+
+
+// Not worth a thread for fewer CUs than this.
+static const size_t scan_min_cus_per_task = 16;
+
+
+// Scan the CUs of the current module in parallel for what iterating
+// over their functions is going to need: the functions, the inline
+// instances if INLINES, and the source files matching FILE_PATTERN if
+// it isn't empty, in which case only the CUs with such files are
+// scanned for the rest.  cache_cu_functions(),
+// iterate_over_inline_instances() and collect_srcfiles_matching() pick
+// up the results; anything a worker couldn't do is left to them.
+void
+dwflpp::scan_cus (const string& file_pattern, bool inlines)
+{
+  cu_scan_work work(file_pattern, inlines);
+  scan_cus_prepare (work);
+  scan_cus_run (work);
+}
+
+
+// Add what is still unknown about the CUs of the current module to WORK,
+// so that scan_cus_run() can scan several modules at once.
+void
+dwflpp::scan_cus_prepare (cu_scan_work& work)
+{
+  if (sess.pass2_jobs < 2 || !module)
+    return;
+
+  // NB: the query reports missing debuginfo, if it cares.
+  get_module_dwarf(false, false);
+  Elf* elf = module_dwarf ? dwarf_getelf (module_dwarf) : NULL;
+  if (!elf)
+    return;
+
+#if _ELFUTILS_PREREQ (0, 159)
+  // With dwz, inline origins and partial units may be in the alt file,
+  // which the workers' own handles don't have, and whose offsets mean
+  // nothing in this one.  Leave such modules to the serial path.
+  if (dwarf_getalt (module_dwarf))
+    return;
+#endif
+
+  vector<Dwarf_Die> cus;
+  iterate_over_cus (scan_cus_collect, &cus, false);
+
+  dwarf_index* index = get_dwarf_index();
+  size_t begin = work.cus.size();
+  for (auto it = cus.begin(); it != cus.end(); ++it)
+    {
+      Dwarf_Die* cu = &*it;
+      auto r = cu_scan_cache.find(cu->addr);
+      cu_scan_result* known = (r != cu_scan_cache.end()) ? r->second : NULL;
+
+      unsigned needs = 0;
+      if (!work.file_pattern.empty())
+        {
+          if (!known || known->srcfile_pattern != work.file_pattern)
+            needs |= cu_scan_work::scan_srcfiles;
+          else if (known->srcfiles.empty())
+            continue;
+        }
+      if (cu_function_cache.find(cu->addr) == cu_function_cache.end()
+          && !(known && known->have_functions)
+          && !(index && index->has(cu, dwarf_index::idx_functions)))
+        needs |= cu_scan_work::scan_functions;
+      if (work.inlines
+          && cu_inl_function_cache_done.find(cu->addr) == cu_inl_function_cache_done.end()
+          && !(known && known->have_inlines)
+          && !(index && index->has(cu, dwarf_index::idx_inlines)))
+        needs |= cu_scan_work::scan_inlines;
+
+      if (needs)
+        {
+          work.cus.push_back(cu->addr);
+          work.offsets.push_back(dwarf_dieoffset(cu));
+          work.needs.push_back(needs);
+        }
+    }
+
+  // Split the module into runs for up to four tasks per thread.
+  size_t n = work.cus.size() - begin;
+  if (n == 0)
+    return;
+  size_t ntasks = max((size_t) 1, min((size_t) sess.pass2_jobs * 4,
+                                      n / scan_min_cus_per_task));
+  for (size_t t = 0; t < ntasks; ++t)
+    {
+      // NB: made here, since that reads the Elf.
+      Dwarf* dw = dwarf_begin_elf (elf, DWARF_C_READ, NULL);
+      if (!dw)
+        break;
+      cu_scan_work::task task = { dw, begin + n * t / ntasks,
+                                  begin + n * (t + 1) / ntasks };
+      work.tasks.push_back(task);
+    }
+  work.modules++;
+}
+
+
+void
+dwflpp::scan_cus_run (cu_scan_work& work)
+{
+  size_t jobs = min((size_t) sess.pass2_jobs, work.tasks.size());
+  if (jobs < 2 || work.cus.size() < 2 * scan_min_cus_per_task)
+    return;
+
+  struct timeval tv_before, tv_after;
+  gettimeofday (&tv_before, NULL);
+
+  vector<cu_scan_result> results(work.cus.size());
+  atomic<size_t> next(0);
+  const string& pattern = work.file_pattern;
+  string prefixed_pattern = string("*/") + pattern; // PR 5049
+
+  auto scan_cu = [&](Dwarf* dw, size_t i)
+    {
+      cu_scan_result& r = results[i];
+      Dwarf_Die cu;
+      if (!dwarf_offdie (dw, work.offsets[i], &cu))
+        return;
+
+      if (work.needs[i] & cu_scan_work::scan_srcfiles)
+        {
+          Dwarf_Files *srcfiles;
+          size_t nfiles;
+          if (dwarf_getsrcfiles (&cu, &srcfiles, &nfiles) != 0)
+            return;
+          r.srcfile_pattern = pattern;
+          for (size_t f = 0; f < nfiles; ++f)
+            {
+              const char* fname = dwarf_filesrc (srcfiles, f, NULL, NULL);
+              if (fname && (fnmatch (pattern.c_str(), fname, 0) == 0 ||
+                            fnmatch (prefixed_pattern.c_str(), fname, 0) == 0))
+                r.srcfiles.push_back(fname);
+            }
+          if (r.srcfiles.empty())
+            return;
+        }
+
+      if (work.needs[i] & cu_scan_work::scan_functions)
+        {
+          vector<Dwarf_Die> funcs;
+          dwarf_getfuncs (&cu, (int (*)(Dwarf_Die*, void*))scan_cus_function,
+                          &funcs, 0);
+          r.have_functions = true;
+          for (auto f = funcs.begin(); f != funcs.end(); ++f)
+            {
+              Dwarf_Off off = 0;
+              if (!dwarf_die_offset (dw, &*f, &off))
+                {
+                  r.have_functions = false;
+                  break;
+                }
+              r.functions.push_back(off);
+            }
+          if (!r.have_functions)
+            r.functions.clear();
+        }
+
+      if (work.needs[i] & cu_scan_work::scan_inlines)
+        {
+          inline_instances_t found;
+          cache_inline_instances (&cu, found);
+          r.have_inlines = true;
+          for (auto f = found.begin(); f != found.end(); ++f)
+            {
+              Dwarf_Off origin = 0, inst = 0;
+              if (!dwarf_die_offset (dw, &f->first, &origin)
+                  || !dwarf_die_offset (dw, &f->second, &inst))
+                {
+                  r.have_inlines = false;
+                  break;
+                }
+              r.inlines.push_back(make_pair(origin, inst));
+            }
+          if (!r.have_inlines)
+            r.inlines.clear();
+        }
+    };
+
+  auto worker = [&]()
+    {
+      for (size_t t = next++; t < work.tasks.size(); t = next++)
+        for (size_t i = work.tasks[t].begin;
+             i < work.tasks[t].end && !pending_interrupts; ++i)
+          scan_cu (work.tasks[t].dw, i);
+    };
+
+  vector<thread> threads;
+  for (size_t j = 0; j < jobs; ++j)
+    try
+      {
+        threads.push_back(thread(worker));
+      }
+    catch (const system_error&)
+      {
+        break;
+      }
+  if (threads.empty())
+    worker();
+  for (size_t j = 0; j < threads.size(); ++j)
+    threads[j].join();
+
+  assert_no_interrupts();
+
+  // Merge in the order of the CUs, whichever thread did them.
+  size_t nfuncs = 0, ninlines = 0;
+  for (size_t i = 0; i < results.size(); ++i)
+    {
+      cu_scan_result& r = results[i];
+      cu_scan_result*& known = cu_scan_cache[work.cus[i]];
+      if (!known)
+        known = new cu_scan_result;
+      if (!r.srcfile_pattern.empty())
+        {
+          known->srcfile_pattern.swap(r.srcfile_pattern);
+          known->srcfiles.swap(r.srcfiles);
+        }
+      if (r.have_functions)
+        {
+          known->have_functions = true;
+          known->functions.swap(r.functions);
+          nfuncs += known->functions.size();
+        }
+      if (r.have_inlines)
+        {
+          known->have_inlines = true;
+          known->inlines.swap(r.inlines);
+          ninlines += known->inlines.size();
+        }
+    }
+
+  gettimeofday (&tv_after, NULL);
+  if (sess.verbose > 2)
+    clog << _F("Pass 2: scanned %zu CUs of %zu module(s) with %zu threads, found "
+               "%zu functions and %zu inline instances in %ld real ms",
+               results.size(), work.modules, threads.size() ?: 1, nfuncs, ninlines,
+               (long) ((tv_after.tv_sec - tv_before.tv_sec) * 1000
+                       + (tv_after.tv_usec - tv_before.tv_usec) / 1000)) << endl;
+}
+
+
 bool
 dwflpp::func_is_inline()
 {
@@ -537,18 +1343,13 @@ dwflpp::func_is_exported()
 }
 
 void
-dwflpp::cache_inline_instances (Dwarf_Die* die)
+dwflpp::cache_inline_instances (Dwarf_Die* die, inline_instances_t& found)
 {
   // If this is an inline instance, link it back to its origin
   Dwarf_Die origin;
   if (dwarf_tag(die) == DW_TAG_inlined_subroutine &&
       dwarf_attr_die(die, DW_AT_abstract_origin, &origin))
-    {
-      vector<Dwarf_Die>*& v = cu_inl_function_cache[origin.addr];
-      if (!v)
-        v = new vector<Dwarf_Die>;
-      v->push_back(*die);
-    }
+    found.push_back(make_pair(origin, *die));
 
   // Recurse through other scopes that may contain inlines
   Dwarf_Die child, import;
@@ -567,13 +1368,13 @@ dwflpp::cache_inline_instances (Dwarf_Die* die)
           case DW_TAG_entry_point:
           case DW_TAG_inlined_subroutine:
           case DW_TAG_subprogram:
-            cache_inline_instances(&child);
+            cache_inline_instances(&child, found);
             break;
 
           // imported dies should be followed
           case DW_TAG_imported_unit:
             if (dwarf_attr_die(&child, DW_AT_import, &import))
-              cache_inline_instances(&import);
+              cache_inline_instances(&import, found);
             break;
 
           // nothing to do for other tags
@@ -593,7 +1394,39 @@ dwflpp::iterate_over_inline_instances<void>(int (*callback)(Dwarf_Die*, void*),
   assert (func_is_inline ());
 
   if (cu_inl_function_cache_done.insert(cu->addr).second)
-    cache_inline_instances(cu);
+    {
+      inline_instances_t found;
+      dwarf_index* index = get_dwarf_index();
+      if (!index || !index->get_inlines(cu, found))
+        {
+          found.clear();
+          auto r = cu_scan_cache.find(cu->addr);
+          if (r != cu_scan_cache.end() && r->second->have_inlines)
+            {
+              // found by scan_cus()
+              const auto& offsets = r->second->inlines;
+              found.resize(offsets.size());
+              for (size_t i = 0; i < offsets.size(); ++i)
+                {
+                  dwarf_offdie (module_dwarf, offsets[i].first, &found[i].first);
+                  dwarf_offdie (module_dwarf, offsets[i].second, &found[i].second);
+                }
+            }
+          else
+            cache_inline_instances(cu, found);
+          if (index)
+            index->put_inlines(cu, found);
+        }
+
+      // link each instance back to its origin
+      for (auto i = found.begin(); i != found.end(); ++i)
+        {
+          vector<Dwarf_Die>*& v = cu_inl_function_cache[i->first.addr];
+          if (!v)
+            v = new vector<Dwarf_Die>;
+          v->push_back(i->second);
+        }
+    }
 
   vector<Dwarf_Die>* v = cu_inl_function_cache[function->addr];
   if (!v)
@@ -958,27 +1791,83 @@ dwflpp::declaration_resolve(Dwarf_Die *type)
 
 
 int
-dwflpp::cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v)
+dwflpp::cu_function_caching_callback (Dwarf_Die* func, vector<Dwarf_Die> *v)
 {
-  const char *name = dwarf_diename(func);
-  if (!name)
-    return DWARF_CB_OK;
-
-  v->insert(make_pair(name, *func));
+  if (dwarf_diename(func))
+    v->push_back(*func);
   return DWARF_CB_OK;
 }
 
 
+void
+dwflpp::cache_cu_functions (Dwarf_Die* cu, cu_function_cache_t *v)
+{
+  vector<Dwarf_Die> funcs;
+  dwarf_index* index = get_dwarf_index();
+  if (!index || !index->get_functions(cu, funcs))
+    {
+      funcs.clear();
+      auto r = cu_scan_cache.find(cu->addr);
+      if (r != cu_scan_cache.end() && r->second->have_functions)
+        {
+          // found by scan_cus()
+          const vector<Dwarf_Off>& offsets = r->second->functions;
+          funcs.resize(offsets.size());
+          for (size_t i = 0; i < offsets.size(); ++i)
+            dwarf_offdie (module_dwarf, offsets[i], &funcs[i]);
+        }
+      else
+        // need to cast callback to func which accepts void*
+        dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
+                        &funcs, 0);
+      if (index)
+        index->put_functions(cu, funcs);
+    }
+
+  for (auto it = funcs.begin(); it != funcs.end(); ++it)
+    v->insert(make_pair(dwarf_diename(&*it), *it));
+}
+
+
 int
-dwflpp::mod_function_caching_callback (Dwarf_Die* cu, cu_function_cache_t *v)
+dwflpp::mod_function_caching_callback (Dwarf_Die* cu,
+                                       pair<dwflpp*, cu_function_cache_t*> *data)
 {
-  // need to cast callback to func which accepts void*
-  dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                  v, 0);
+  data->first->cache_cu_functions (cu, data->second);
   return DWARF_CB_OK;
 }
 
 
+dwarf_index*
+dwflpp::get_dwarf_index()
+{
+  if (!sess.use_cache || !module || !module_dwarf)
+    return NULL;
+
+  auto it = dwarf_index_cache.find(module_dwarf);
+  if (it != dwarf_index_cache.end())
+    return it->second;
+
+  dwarf_index*& index = dwarf_index_cache[module_dwarf];
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id(module, &bits, &vaddr);
+  if (bits_length > 0)
+    {
+      string path = find_dwarf_index_hash(sess, hex_dump(bits, bits_length));
+      if (!path.empty())
+        {
+          GElf_Ehdr ehdr_mem;
+          Elf* elf = dwarf_getelf(module_dwarf);
+          GElf_Ehdr* em = elf ? gelf_getehdr (elf, &ehdr_mem) : NULL;
+          index = new dwarf_index(sess, path, module_dwarf,
+                                  !em || em->e_type == ET_REL);
+        }
+    }
+  return index;
+}
+
+
 template<> int
 dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
                                      void *data, const string& function)
@@ -992,9 +1881,7 @@ dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
     {
       v = new cu_function_cache_t;
       cu_function_cache[cu->addr] = v;
-      // need to cast callback to func which accepts void*
-      dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                      v, 0);
+      cache_cu_functions (cu, v);
       if (sess.verbose > 4)
         clog << _F("function cache %s:%s size %zu", module_name.c_str(),
                    cu_name().c_str(), v->size()) << endl;
@@ -1080,7 +1967,9 @@ dwflpp::iterate_single_function<void>(int (*callback)(Dwarf_Die*, void*),
     {
       v = new cu_function_cache_t;
       mod_function_cache[module_dwarf] = v;
-      iterate_over_cus (mod_function_caching_callback, v, false);
+      scan_cus ("", false);
+      pair<dwflpp*, cu_function_cache_t*> data (this, v);
+      iterate_over_cus (mod_function_caching_callback, &data, false);
       if (sess.verbose > 4)
         clog << _F("module function cache %s size %zu", module_name.c_str(),
                    v->size()) << endl;
@@ -2263,6 +3152,20 @@ dwflpp::collect_srcfiles_matching (string const & pattern,
   size_t nfiles;
   Dwarf_Files *srcfiles;
 
+  auto r = cu_scan_cache.find(cu->addr);
+  if (r != cu_scan_cache.end() && r->second->srcfile_pattern == pattern)
+    {
+      // matched by scan_cus()
+      const vector<string>& srcfiles = r->second->srcfiles;
+      for (auto it = srcfiles.begin(); it != srcfiles.end(); ++it)
+        {
+          filtered_srcfiles.insert (*it);
+          if (sess.verbose>2)
+            clog << _F("selected source file '%s'\n", it->c_str());
+        }
+      return;
+    }
+
   // PR 5049: implicit * in front of given path pattern.
   // NB: fnmatch() is used without FNM_PATHNAME.
   string prefixed_pattern = string("*/") + pattern;
@@ -4690,12 +5593,19 @@ dwflpp::check_cu_entry_pc (Dwarf_Die *cu, Dwarf_Addr pc)
   auto& entry_pcs = cu_entry_pc_cache[cu->addr];
   if (!entry_pcs)
     {
-      save_and_restore<Dwarf_Die*> saved_cu(&this->cu, cu);
       entry_pcs = new entry_pc_cache_t;
-      pair<dwflpp&, entry_pc_cache_t&> data (*this, *entry_pcs);
-      int rc = iterate_over_functions (cu_entry_pc_caching_callback, &data, "*");
-      if (rc != DWARF_CB_OK)
-        return false;
+      dwarf_index* index = get_dwarf_index();
+      if (!index || !index->get_entry_pcs(cu, *entry_pcs))
+        {
+          entry_pcs->clear();
+          save_and_restore<Dwarf_Die*> saved_cu(&this->cu, cu);
+          pair<dwflpp&, entry_pc_cache_t&> data (*this, *entry_pcs);
+          int rc = iterate_over_functions (cu_entry_pc_caching_callback, &data, "*");
+          if (rc != DWARF_CB_OK)
+            return false;
+          if (index)
+            index->put_entry_pcs(cu, *entry_pcs);
+        }
     }
 
   return entry_pcs->count(pc) != 0;
@@ -45,6 +45,7 @@ struct inline_instance_info;
 struct symbol_table;
 struct base_query;
 struct external_function_query;
+struct dwarf_index;
 
 enum lineno_t { ABSOLUTE, RELATIVE, WILDCARD, ENUMERATED };
 enum info_status { info_unknown, info_present, info_absent };
@@ -74,6 +75,48 @@ typedef std::unordered_map<Dwarf*, cu_function_cache_t*> mod_function_cache_t;
 // inline function die -> instance die[]
 typedef std::unordered_map<void*, std::vector<Dwarf_Die>*> cu_inl_function_cache_t;
 
+// (abstract origin die, inline instance die)[]
+typedef std::vector<std::pair<Dwarf_Die, Dwarf_Die> > inline_instances_t;
+
+// What a worker thread of dwflpp::scan_cus found in a CU, by DIE offset
+struct cu_scan_result
+{
+  bool have_functions, have_inlines;
+  std::vector<Dwarf_Off> functions;
+  std::vector<std::pair<Dwarf_Off, Dwarf_Off> > inlines; // (origin, instance)
+  std::string srcfile_pattern;
+  std::vector<std::string> srcfiles; // those matching srcfile_pattern
+  cu_scan_result(): have_functions(false), have_inlines(false) {}
+};
+
+// cu die -> scan result
+typedef std::unordered_map<void*, cu_scan_result*> cu_scan_cache_t;
+
+// The CUs that dwflpp::scan_cus_run hands to its worker threads, as
+// runs of CUs of one module, each with a libdw handle of its own
+struct cu_scan_work
+{
+  enum { scan_srcfiles = 1, scan_functions = 2, scan_inlines = 4 };
+
+  struct task
+  {
+    Dwarf* dw;
+    size_t begin, end;
+  };
+
+  std::string file_pattern;
+  bool inlines;
+  std::vector<task> tasks;
+  std::vector<void*> cus;
+  std::vector<Dwarf_Off> offsets;
+  std::vector<unsigned> needs;
+  size_t modules;
+
+  cu_scan_work(const std::string& file_pattern, bool inlines):
+    file_pattern(file_pattern), inlines(inlines), modules(0) {}
+  ~cu_scan_work();
+};
+
 // die -> parent die
 typedef std::unordered_map<void*, Dwarf_Die> cu_die_parent_cache_t;
 
@@ -255,6 +298,10 @@ struct dwflpp
                                   (void*)data);
     }
 
+  void scan_cus(const std::string& file_pattern, bool inlines);
+  void scan_cus_prepare(cu_scan_work& work);
+  void scan_cus_run(cu_scan_work& work);
+
   template<typename T>
   void iterate_over_cus(int (* callback)(Dwarf_Die*, T*),
                         T *data,
@@ -509,7 +556,14 @@ private:
 
   std::set<void*> cu_inl_function_cache_done; // CUs that are already cached
   cu_inl_function_cache_t cu_inl_function_cache;
-  void cache_inline_instances (Dwarf_Die* die);
+  static void cache_inline_instances (Dwarf_Die* die, inline_instances_t& found);
+
+  cu_scan_cache_t cu_scan_cache;
+
+  // On-disk index of the caches above, see dwarf_index in dwflpp.cxx
+  std::unordered_map<Dwarf*, dwarf_index*> dwarf_index_cache;
+  dwarf_index* get_dwarf_index();
+  void cache_cu_functions (Dwarf_Die* cu, cu_function_cache_t *v);
 
   mod_cu_die_parent_cache_t cu_die_parent_cache;
   void cache_die_parents(cu_die_parent_cache_t* parents, Dwarf_Die* die);
@@ -573,8 +627,9 @@ private:
                                       (void*)data);
     }
 
-  static int mod_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v);
-  static int cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v);
+  static int mod_function_caching_callback (Dwarf_Die* cu,
+                                            std::pair<dwflpp*, cu_function_cache_t*> *data);
+  static int cu_function_caching_callback (Dwarf_Die* func, std::vector<Dwarf_Die> *v);
 
   lines_t* get_cu_lines_sorted_by_lineno(const char *srcfile);
 
@@ -20,6 +20,7 @@
 
 extern "C" {
 #include <sys/utsname.h>
+#include <sys/time.h>
 #include <fnmatch.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -471,7 +472,26 @@ match_node::find_and_build (systemtap_session& s,
       for (unsigned k=0; k<ends.size(); k++) 
         {
           derived_probe_builder *b = ends[k];
+
+          // Alias expansion derives probes through other builders,
+          // which count for themselves.
+          if (b->is_alias())
+            {
+              b->build (s, p, loc, param_map, results);
+              continue;
+            }
+
+          struct timeval tv_before, tv_after;
+          unsigned before = results.size();
+          gettimeofday (&tv_before, NULL);
           b->build (s, p, loc, param_map, results);
+          gettimeofday (&tv_after, NULL);
+
+          builder_stats& bs = s.builder_times[b->name()];
+          bs.calls++;
+          bs.probes += results.size() - before;
+          bs.usecs += ((tv_after.tv_sec - tv_before.tv_sec) * 1000000
+                       + tv_after.tv_usec - tv_before.tv_usec);
         }
 
       // Collect names of builders attempted for error reporting
@@ -691,6 +711,12 @@ match_node::suggest_functors(systemtap_session& s, string functor)
         ftor.erase(ftor.find('('));
       functors.insert(ftor);
     }
+
+  // At the root, so do the aliases of the tapsets not parsed yet.
+  if (this == s.pattern_root && s.tapset_index)
+    for (library_index::symbol_map::const_iterator it = s.tapset_index->aliases.begin();
+         it != s.tapset_index->aliases.end(); ++it)
+      functors.insert(it->first);
   return levenshtein_suggest(functor, functors, 5); // print top 5
 }
 
@@ -1019,6 +1045,8 @@ derive_probes (systemtap_session& s,
 
           try
 	    {
+	      if (!loc->components.empty())
+	        s.load_library_aliases (loc->components[0]->functor.to_string());
 	      s.pattern_root->find_and_build (s, p, loc, 0, dps, builders); // <-- actual derivation!
 	    }
           catch (const semantic_error& e)
@@ -1701,6 +1729,37 @@ public:
 	       << endl;
 	session.need_lines = true;
       }
+
+    if (session.defer_symbols
+        && c->code.find("_stp_print_binary") != string::npos)
+      no_deferred_symbols (c->tok);
+  }
+
+  void visit_print_format (print_format* e)
+  {
+    functioncall_traversing_visitor::visit_print_format (e);
+    if (!session.defer_symbols || !e->print_to_stream)
+      return;
+
+    bool raw = e->print_char;
+    for (unsigned i = 0; i < e->components.size(); ++i)
+      {
+        print_format::conversion_type t = e->components[i].type;
+        if (t == print_format::conv_binary || t == print_format::conv_char
+            || t == print_format::conv_memory)
+          raw = true;
+      }
+    if (raw)
+      no_deferred_symbols (e->tok);
+  }
+
+  // stapio finds the deferred symbol records by their marker in the
+  // output, so output that may hold any bytes at all could fake one.
+  void no_deferred_symbols (const token* tok)
+  {
+    session.print_warning (_("--defer-symbols is turned off, since the script "
+                             "prints raw bytes"), tok);
+    session.defer_symbols = false;
   }
 };
 
@@ -2000,6 +2059,9 @@ void add_global_var_display (systemtap_session& s)
 		{tapset_global = true; break;}
 	    }
 	}
+      if (s.tapset_index && l->name.starts_with("__global_")
+          && s.tapset_index->globals.count(l->unmangled_name.to_string()))
+        tapset_global = true;
       if (tapset_global)
 	continue;
 
@@ -2785,6 +2847,7 @@ symresolution_info::find_var (interned_string name, int arity, const token* tok)
   }
 
   // search library globals
+  session.load_library_globals (name.to_string());
   for (unsigned i=0; i<session.library_files.size(); i++)
     {
       stapfile* f = session.library_files[i];
@@ -2830,6 +2893,7 @@ symresolution_info::find_functions (const string& name, unsigned arity, const to
     }
 
   // functions scanned by the parser are overloaded
+  session.load_library_functions (name);
   unsigned alternatives = session.overload_count[name];
   for (unsigned alt = 0; alt < alternatives; alt++)
     {
@@ -2924,6 +2988,12 @@ symresolution_info::collect_functions(void)
         funcs.insert(f->functions[j]->unmangled_name);
     }
 
+  // and those of tapsets not parsed yet
+  if (session.tapset_index)
+    for (library_index::symbol_map::const_iterator it = session.tapset_index->functions.begin();
+         it != session.tapset_index->functions.end(); ++it)
+      funcs.insert(it->first);
+
   return funcs;
 }
 
@@ -5267,6 +5337,369 @@ void semantic_pass_opt7(systemtap_session& s)
     }
 }
 
+// ------------------------------------------------------------------------
+// function inlining
+
+// A script function call is cheap to write but not to run: the actual
+// arguments get copied into the callee's frame in the context, and the
+// callee has a prologue and an epilogue of its own.  Many functions,
+// like pid() and other tapset helpers, are just "return EXPR".  Calls
+// of those get replaced by a copy of EXPR with the actual arguments in
+// place of the formal ones, when that is cheap enough and doesn't change
+// what gets evaluated in which order.  This runs after type resolution,
+// so that the copy has just the type of the call.
+
+// The largest expression (in nodes, see inline_cost_visitor) that gets
+// inlined into more than one call site.
+static const unsigned inline_cost_max = 12;
+
+// What it costs to keep a call in an inlined expression.
+static const unsigned inline_call_cost = 4;
+
+// Measures an expression, and counts its uses of the formal arguments,
+// and how many of those are only evaluated under a condition.
+struct inline_cost_visitor: public traversing_visitor
+{
+  map<vardecl*, unsigned> uses;
+  map<vardecl*, unsigned> conditional_uses;
+  unsigned cost;
+  unsigned conditional;
+  inline_cost_visitor(): cost(0), conditional(0) {}
+
+  void visit_literal_string (literal_string*) { cost++; }
+  void visit_literal_number (literal_number*) { cost++; }
+  void visit_embedded_expr (embedded_expr*) { cost++; }
+  void visit_symbol (symbol* e)
+    {
+      cost++;
+      if (uses.find(e->referent) != uses.end())
+        {
+          uses[e->referent]++;
+          if (conditional)
+            conditional_uses[e->referent]++;
+        }
+    }
+  void visit_functioncall (functioncall* e)
+    {
+      cost += inline_call_cost;
+      traversing_visitor::visit_functioncall (e);
+    }
+  void visit_binary_expression (binary_expression* e)
+    { cost++; traversing_visitor::visit_binary_expression (e); }
+  void visit_unary_expression (unary_expression* e)
+    { cost++; traversing_visitor::visit_unary_expression (e); }
+  void visit_comparison (comparison* e)
+    { cost++; traversing_visitor::visit_comparison (e); }
+  void visit_concatenation (concatenation* e)
+    { cost++; traversing_visitor::visit_concatenation (e); }
+  void visit_logical_or_expr (logical_or_expr* e)
+    {
+      cost++;
+      e->left->visit (this);
+      conditional++;
+      e->right->visit (this);
+      conditional--;
+    }
+  void visit_logical_and_expr (logical_and_expr* e)
+    {
+      cost++;
+      e->left->visit (this);
+      conditional++;
+      e->right->visit (this);
+      conditional--;
+    }
+  void visit_ternary_expression (ternary_expression* e)
+    {
+      cost++;
+      e->cond->visit (this);
+      conditional++;
+      e->truevalue->visit (this);
+      e->falsevalue->visit (this);
+      conditional--;
+    }
+  void visit_arrayindex (arrayindex* e)
+    { cost++; traversing_visitor::visit_arrayindex (e); }
+  void visit_print_format (print_format* e)
+    { cost += inline_call_cost; traversing_visitor::visit_print_format (e); }
+};
+
+// An inlinable function: its expression, and what the call sites need
+// to know about it.
+struct inline_candidate
+{
+  expression* value;
+  map<vardecl*, unsigned> uses; // per formal argument
+  map<vardecl*, unsigned> conditional_uses; // under ?:, && or ||
+  unsigned cost;
+  bool pure;
+  bool stateless; // reads nothing but its formal arguments
+};
+
+// Copies an inlined expression, with copies of the actual arguments for
+// the formal ones.  Unlike deep_copy_visitor, it keeps the referents,
+// since the types are resolved already.
+struct inline_copy_visitor: public deep_copy_visitor
+{
+  map<vardecl*, expression*> actuals;
+
+  void visit_symbol (symbol* e)
+    {
+      map<vardecl*, expression*>::const_iterator it = actuals.find (e->referent);
+      if (it != actuals.end())
+        {
+          inline_copy_visitor v; // the actuals belong to the caller
+          provide (v.require (it->second));
+        }
+      else
+        update_visitor::visit_symbol (new symbol(*e));
+    }
+
+  void visit_functioncall (functioncall* e)
+    {
+      update_visitor::visit_functioncall (new functioncall(*e));
+    }
+};
+
+struct function_inliner: public update_visitor
+{
+  systemtap_session& session;
+  map<functiondecl*, inline_candidate>& candidates;
+  const set<vardecl*>& globals;
+  functiondecl* current_function;
+  set<vardecl*> focal_vars; // the globals, and the caller's locals
+  map<functiondecl*, unsigned> inlined;
+
+  function_inliner (systemtap_session& s,
+                    map<functiondecl*, inline_candidate>& c,
+                    const set<vardecl*>& g):
+    session(s), candidates(c), globals(g), current_function(0) {}
+
+  void set_scope (const vector<vardecl*>& locals,
+                  const vector<vardecl*>& formals)
+    {
+      focal_vars = globals;
+      focal_vars.insert (locals.begin(), locals.end());
+      focal_vars.insert (formals.begin(), formals.end());
+    }
+
+  // Whether an actual argument may be evaluated any number of times,
+  // at any point: a literal, or a scalar local of the caller.
+  bool trivial_p (expression* e)
+    {
+      symbol* sym;
+      if (dynamic_cast<literal*>(e))
+        return true;
+      return (e->is_symbol (sym) && sym->referent
+              && sym->referent->arity == 0
+              && globals.find (sym->referent) == globals.end());
+    }
+
+  bool side_effects_ok (const inline_candidate& c, functioncall* e, unsigned i);
+  void visit_functioncall (functioncall* e);
+};
+
+// Whether the I'th actual argument of E may be evaluated in place of
+// its formal one: when it has no side-effects, or when the expression
+// reads no other state, and the other arguments aren't written by it.
+bool
+function_inliner::side_effects_ok (const inline_candidate& c,
+                                   functioncall* e, unsigned i)
+{
+  varuse_collecting_visitor vut (session);
+  e->args[i]->visit (& vut);
+  if (vut.side_effect_free_wrt (focal_vars))
+    return true;
+  if (!c.stateless)
+    return false;
+
+  for (unsigned j = 0; j < e->args.size(); j++)
+    {
+      symbol* sym;
+      if (j != i && e->args[j]->is_symbol (sym)
+          && vut.written.count (sym->referent))
+        return false;
+    }
+  return true;
+}
+
+void
+function_inliner::visit_functioncall (functioncall* e)
+{
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    replace (e->args[i]);
+
+  functiondecl* fd = e->referents.size() == 1 ? e->referents[0] : NULL;
+  map<functiondecl*, inline_candidate>::iterator it = candidates.find (fd);
+  if (fd == NULL || fd == current_function || it == candidates.end()
+      || e->type != fd->type)
+    {
+      provide (e);
+      return;
+    }
+  inline_candidate& c = it->second;
+
+  // Each actual argument is evaluated once before the call.  The copy
+  // may only differ in that for trivial ones, or for a single other one
+  // that the expression always evaluates once.  That one's side-effects
+  // then happen where it is used, so nothing else the expression reads
+  // may depend on them.  Other calls stay as they are.
+  unsigned nontrivial = 0;
+  for (unsigned i = 0; i < e->args.size(); i++)
+    if (!trivial_p (e->args[i]))
+      {
+        vardecl* formal = fd->formal_args[i];
+        if (c.uses[formal] != 1 || c.conditional_uses[formal] != 0
+            || !side_effects_ok (c, e, i))
+          {
+            provide (e);
+            return;
+          }
+        nontrivial++;
+      }
+  if (nontrivial > 1 || (nontrivial && !c.pure))
+    {
+      provide (e);
+      return;
+    }
+
+  inline_copy_visitor v;
+  for (unsigned i = 0; i < e->args.size(); i++)
+    v.actuals[fd->formal_args[i]] = e->args[i];
+  expression* n = v.require (c.value);
+  inlined[fd]++;
+  provide (n);
+}
+
+// Counts the call sites of each function.
+struct functioncall_counter: public traversing_visitor
+{
+  map<functiondecl*, unsigned> calls;
+  void visit_functioncall (functioncall* e)
+    {
+      for (unsigned i = 0; i < e->referents.size(); i++)
+        calls[e->referents[i]]++;
+      traversing_visitor::visit_functioncall (e);
+    }
+};
+
+// Finds the functions worth inlining, as they are now.
+static void
+find_inline_candidates (systemtap_session& s, const set<vardecl*>& globals,
+                        map<functiondecl*, inline_candidate>& candidates)
+{
+  functioncall_counter fcc;
+  for (unsigned i=0; i<s.probes.size(); i++)
+    s.probes[i]->body->visit (& fcc);
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); it++)
+    it->second->body->visit (& fcc);
+
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); it++)
+    {
+      functiondecl* fd = it->second;
+      if (fd->has_next || !fd->locals.empty())
+        continue;
+
+      // { return EXPR }
+      block* b = dynamic_cast<block*>(fd->body);
+      statement* st = (b && b->statements.size() == 1) ? b->statements[0] : fd->body;
+      return_statement* rs = dynamic_cast<return_statement*>(st);
+      if (!rs || !rs->value || rs->value->type != fd->type)
+        continue;
+
+      inline_candidate c;
+      c.value = rs->value;
+
+      inline_cost_visitor icv;
+      for (unsigned i = 0; i < fd->formal_args.size(); i++)
+        icv.uses[fd->formal_args[i]] = 0;
+      c.value->visit (& icv);
+      c.uses = icv.uses;
+      c.conditional_uses = icv.conditional_uses;
+      c.cost = icv.cost;
+      if (c.cost > inline_cost_max && fcc.calls[fd] > 1)
+        continue;
+
+      // It mustn't assign to its formal arguments, nor call itself.
+      varuse_collecting_visitor vut (s);
+      c.value->visit (& vut);
+      bool writes_formal = false;
+      for (unsigned i = 0; i < fd->formal_args.size(); i++)
+        if (vut.written.count (fd->formal_args[i]))
+          writes_formal = true;
+      if (writes_formal || vut.seen.count (fd))
+        continue;
+      c.pure = vut.side_effect_free_wrt (globals);
+      c.stateless = !vut.embedded_seen;
+      for (set<vardecl*>::iterator it = vut.read.begin(); it != vut.read.end(); ++it)
+        if (find (fd->formal_args.begin(), fd->formal_args.end(), *it)
+            == fd->formal_args.end())
+          c.stateless = false;
+
+      // Inlining into the function bodies may change the expression,
+      // so the call sites copy it as it is now.
+      inline_copy_visitor v;
+      c.value = v.require (c.value);
+      candidates[fd] = c;
+    }
+}
+
+
+static void
+semantic_pass_inline (systemtap_session& s)
+{
+  set<vardecl*> globals (s.globals.begin(), s.globals.end());
+  map<functiondecl*, unsigned> inlined;
+
+  // Calls within the inlined expressions get inlined by the next round.
+  for (unsigned round = 0; round < 4; round++)
+    {
+      map<functiondecl*, inline_candidate> candidates;
+      find_inline_candidates (s, globals, candidates);
+      if (candidates.empty())
+        break;
+
+      function_inliner fi (s, candidates, globals);
+      for (unsigned i=0; i<s.probes.size(); i++)
+        {
+          fi.set_scope (s.probes[i]->locals, vector<vardecl*>());
+          fi.replace (s.probes[i]->body);
+        }
+      for (map<string,functiondecl*>::iterator it = s.functions.begin();
+           it != s.functions.end(); it++)
+        {
+          fi.current_function = it->second;
+          fi.set_scope (it->second->locals, it->second->formal_args);
+          fi.replace (it->second->body);
+        }
+      if (fi.inlined.empty())
+        break;
+      for (map<functiondecl*, unsigned>::iterator it = fi.inlined.begin();
+           it != fi.inlined.end(); it++)
+        inlined[it->first] += it->second;
+    }
+
+  // Do away with the functions that are no longer called at all.
+  functioncall_traversing_visitor ftv;
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      s.probes[i]->body->visit (& ftv);
+      if (s.probes[i]->sole_location()->condition)
+        s.probes[i]->sole_location()->condition->visit (& ftv);
+    }
+  for (map<functiondecl*, unsigned>::iterator it = inlined.begin();
+       it != inlined.end(); it++)
+    {
+      functiondecl* fd = it->first;
+      if (s.verbose > 2)
+        clog << _F("Inlined %u call(s) of function '%s'", it->second,
+                   fd->unmangled_name.to_string().c_str()) << endl;
+      if (ftv.seen.find (fd) == ftv.seen.end())
+        s.functions.erase (fd->name);
+    }
+}
+
 static int
 semantic_pass_optimize1 (systemtap_session& s)
 {
@@ -5339,6 +5772,9 @@ semantic_pass_optimize2 (systemtap_session& s)
   // it below.
   save_and_restore<bool> suppress_warnings(& s.suppress_warnings);
 
+  if (!s.unoptimized)
+    semantic_pass_inline (s);
+
   bool relaxed_p = false;
   unsigned iterations = 0;
   while (! relaxed_p)
@@ -5685,6 +6121,13 @@ semantic_pass_types (systemtap_session& s)
             {
               throw SEMANTIC_ERROR(_("wrapping not supported for scalars"), gd->tok);
             }
+          if (gd->percpu)
+            {
+              if (gd->arity == 0)
+                throw SEMANTIC_ERROR(_("percpu not supported for scalars"), gd->tok);
+              if (gd->type != pe_unknown && gd->type != pe_long)
+                throw SEMANTIC_ERROR(_("percpu arrays must hold long values"), gd->tok);
+            }
         }
 
       if (ti.num_newly_resolved == 0) // converged
@@ -19,32 +19,178 @@
 #include "hash.h"
 #include "util.h"
 
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <cerrno>
+#include <ctime>
+#include <map>
 
 extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdint.h>
 #include "mdfour.h"
 }
 
 using namespace std;
 
 
+// A streaming MurmurHash3 (x64, 128 bits).  The cache keys only need to
+// avoid accidental collisions, which it does at a fraction of the cost
+// of MD4.  SYSTEMTAP_HASH=md4 selects MD4 again, see hash_md4_p.
+struct murmur3
+{
+  uint64_t h1, h2;
+  uint64_t totalN;
+  unsigned char tail[16];
+  unsigned tail_len;
+};
+
+static inline uint64_t
+rotl64 (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+get64 (const unsigned char *p)
+{
+  uint64_t x = 0;
+  for (int i = 7; i >= 0; i--)
+    x = (x << 8) | p[i];
+  return x;
+}
+
+static inline uint64_t
+fmix64 (uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static const uint64_t murmur3_c1 = 0x87c37b91114253d5ULL;
+static const uint64_t murmur3_c2 = 0x4cf5ad432745937fULL;
+
+static void
+murmur3_begin (struct murmur3 *m)
+{
+  m->h1 = m->h2 = 0;
+  m->totalN = 0;
+  m->tail_len = 0;
+}
+
+static void
+murmur3_block (struct murmur3 *m, const unsigned char *in)
+{
+  uint64_t k1 = get64 (in), k2 = get64 (in + 8);
+
+  k1 *= murmur3_c1; k1 = rotl64 (k1, 31); k1 *= murmur3_c2; m->h1 ^= k1;
+  m->h1 = rotl64 (m->h1, 27); m->h1 += m->h2; m->h1 = m->h1 * 5 + 0x52dce729;
+
+  k2 *= murmur3_c2; k2 = rotl64 (k2, 33); k2 *= murmur3_c1; m->h2 ^= k2;
+  m->h2 = rotl64 (m->h2, 31); m->h2 += m->h1; m->h2 = m->h2 * 5 + 0x38495ab5;
+}
+
+static void
+murmur3_update (struct murmur3 *m, const unsigned char *in, size_t n)
+{
+  m->totalN += n;
+
+  if (m->tail_len)
+    {
+      size_t len = min ((size_t) (16 - m->tail_len), n);
+      memcpy (m->tail + m->tail_len, in, len);
+      m->tail_len += len;
+      in += len;
+      n -= len;
+      if (m->tail_len < 16)
+        return;
+      murmur3_block (m, m->tail);
+      m->tail_len = 0;
+    }
+
+  for (; n >= 16; in += 16, n -= 16)
+    murmur3_block (m, in);
+
+  memcpy (m->tail, in, n);
+  m->tail_len = n;
+}
+
+static void
+murmur3_result (struct murmur3 *m, unsigned char *out)
+{
+  uint64_t k1 = 0, k2 = 0;
+  const unsigned char *tail = m->tail;
+
+  for (unsigned i = m->tail_len; i > 8; i--)
+    k2 = (k2 << 8) | tail[i - 1];
+  for (unsigned i = min (m->tail_len, 8u); i > 0; i--)
+    k1 = (k1 << 8) | tail[i - 1];
+
+  if (m->tail_len > 8)
+    {
+      k2 *= murmur3_c2; k2 = rotl64 (k2, 33); k2 *= murmur3_c1; m->h2 ^= k2;
+    }
+  if (m->tail_len > 0)
+    {
+      k1 *= murmur3_c1; k1 = rotl64 (k1, 31); k1 *= murmur3_c2; m->h1 ^= k1;
+    }
+
+  uint64_t h1 = m->h1 ^ m->totalN, h2 = m->h2 ^ m->totalN;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64 (h1);
+  h2 = fmix64 (h2);
+  h1 += h2;
+  h2 += h1;
+
+  for (int i = 0; i < 8; i++)
+    {
+      out[i] = h1 >> (8 * i);
+      out[8 + i] = h2 >> (8 * i);
+    }
+}
+
+
+// Whether to key the cache with MD4 like older versions of systemtap,
+// for whoever would rather have a cryptographic hash there.
+static bool
+hash_md4_p ()
+{
+  static int md4 = -1;
+  if (md4 < 0)
+    {
+      const char *e = getenv ("SYSTEMTAP_HASH");
+      md4 = (e && strcmp (e, "md4") == 0);
+    }
+  return md4;
+}
+
+
 class stap_hash
 {
 private:
+  bool md4_p;
   struct mdfour md4;
+  struct murmur3 mm3;
   std::ostringstream parm_stream;
 
+  void update(const unsigned char *buffer, size_t size);
+
 public:
   stap_hash() { start(); }
-  stap_hash(const stap_hash &base) { md4 = base.md4; parm_stream << base.parm_stream.str(); }
+  stap_hash(const stap_hash &base)
+    : md4_p(base.md4_p), md4(base.md4), mm3(base.mm3)
+  { parm_stream << base.parm_stream.str(); }
 
   void start();
 
@@ -54,16 +200,51 @@ public:
   void add(const std:: string& d, const std::string& s) { add(d, (const unsigned char *)s.c_str(), s.length()); }
 
   void add_path(const std::string& description, const std::string& path);
+  void add_contents(const std::string& description, const std::string& path);
+  void add_data(const std::string& description, const std::string& path);
 
   void result(std::string& r);
   std::string get_parms() { return parm_stream.str(); }
 };
 
 
+// The digests of the files that add_contents read before, by path, with
+// what stat said about them then.  It is kept in the cache directory
+// (see load_contents_memo) so that, e.g., the tapset hash doesn't read
+// all the tapsets on every run.
+struct contents_memo_entry
+{
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+  string digest;
+};
+
+static map<string, contents_memo_entry> contents_memo;
+static string contents_memo_path;
+static bool contents_memo_dirty;
+
+
 void
 stap_hash::start()
 {
-  mdfour_begin(&md4);
+  md4_p = hash_md4_p();
+  if (md4_p)
+    mdfour_begin(&md4);
+  else
+    murmur3_begin(&mm3);
+}
+
+
+void
+stap_hash::update(const unsigned char *buffer, size_t size)
+{
+  if (md4_p)
+    mdfour_update(&md4, buffer, size);
+  else
+    murmur3_update(&mm3, buffer, size);
 }
 
 
@@ -71,7 +252,7 @@ void
 stap_hash::add(const std::string& description, const unsigned char *buffer, size_t size)
 {
   parm_stream << description << buffer << endl;
-  mdfour_update(&md4, buffer, size);
+  update(buffer, size);
 }
 
 
@@ -79,7 +260,7 @@ template <typename T> void
 stap_hash::add(const std::string& d, const T& x)
 {
   parm_stream << d << x << endl;
-  mdfour_update(&md4, (const unsigned char *)&x, sizeof(x));
+  update((const unsigned char *)&x, sizeof(x));
 }
 
 
@@ -98,20 +279,95 @@ stap_hash::add_path(const std::string& description, const std::string& path)
 }
 
 
+void
+stap_hash::add_contents(const std::string& description, const std::string& path)
+{
+  // Like add_path, but for what is in the file rather than its timestamp.
+  // The file is summed up on its own, or the sum comes from the memo if
+  // the file looks just the same as when it was summed up.
+  add(description + "Path: ", path);
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    {
+      add_data(description, path);
+      return;
+    }
+
+  map<string, contents_memo_entry>::const_iterator it = contents_memo.find(path);
+  if (it != contents_memo.end()
+      && it->second.dev == st.st_dev && it->second.ino == st.st_ino
+      && it->second.size == st.st_size && it->second.mtime == st.st_mtime
+      && it->second.mtime_nsec == st.st_mtim.tv_nsec)
+    {
+      add(description + "Digest: ", it->second.digest);
+      return;
+    }
+
+  stap_hash h;
+  h.add_data(description, path);
+  string digest;
+  h.result(digest);
+  add(description + "Digest: ", digest);
+
+  // A file written within the last second could change again without
+  // its timestamp showing it, so only remember older ones.
+  if (!contents_memo_path.empty() && st.st_mtime < time(NULL) - 1)
+    {
+      contents_memo_entry& e = contents_memo[path];
+      e.dev = st.st_dev;
+      e.ino = st.st_ino;
+      e.size = st.st_size;
+      e.mtime = st.st_mtime;
+      e.mtime_nsec = st.st_mtim.tv_nsec;
+      e.digest = digest;
+      contents_memo_dirty = true;
+    }
+}
+
+
+void
+stap_hash::add_data(const std::string& description, const std::string& path)
+{
+  // Like add_contents, but wherever the file happens to be.
+  off_t size = 0;
+  ifstream file(path.c_str(), ios::in | ios::binary);
+  char buffer[64 * 1024];
+  while (file)
+    {
+      file.read(buffer, sizeof(buffer));
+      size_t n = file.gcount();
+      update((const unsigned char *)buffer, n);
+      size += n;
+    }
+  add(description + "Size: ", file.eof() ? size : (off_t) -1);
+}
+
+
 void
 stap_hash::result(string& r)
 {
   ostringstream rstream;
   unsigned char sum[16];
+  unsigned total;
 
-  mdfour_update(&md4, NULL, 0);
-  mdfour_result(&md4, sum);
+  if (md4_p)
+    {
+      mdfour_update(&md4, NULL, 0);
+      mdfour_result(&md4, sum);
+      total = md4.totalN;
+    }
+  else
+    {
+      murmur3_result(&mm3, sum);
+      total = mm3.totalN;
+    }
 
   for (int i=0; i<16; i++)
     {
       rstream << hex << setfill('0') << setw(2) << (unsigned)sum[i];
     }
-  rstream << "_" << setw(0) << dec << (unsigned)md4.totalN;
+  rstream << "_" << setw(0) << dec << total;
   r = rstream.str();
 }
 
@@ -130,6 +386,61 @@ void create_hash_log(const string &type_str, const string &parms, const string &
   log_file.close();
 }
 
+static void
+load_contents_memo (systemtap_session& s)
+{
+  if (!contents_memo_path.empty())
+    return;
+
+  contents_memo_path = s.cache_path
+    + (hash_md4_p() ? "/contents_md4.memo" : "/contents.memo");
+  if (s.poison_cache)
+    return;
+
+  // Each line is "DIGEST DEV INO SIZE MTIME NSEC PATH".
+  ifstream in(contents_memo_path.c_str());
+  contents_memo_entry e;
+  string path;
+  while (in >> e.digest >> e.dev >> e.ino >> e.size >> e.mtime >> e.mtime_nsec
+         && in.get() == ' ' && getline(in, path))
+    contents_memo[path] = e;
+}
+
+
+static void
+save_contents_memo (systemtap_session& s)
+{
+  if (!contents_memo_dirty)
+    return;
+  contents_memo_dirty = false;
+
+  // Write it all anew, and rename it into place for concurrent runs.
+  string tmp = contents_memo_path + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0)
+    return;
+  close(fd);
+
+  ofstream out(tmp.c_str());
+  for (map<string, contents_memo_entry>::const_iterator it = contents_memo.begin();
+       it != contents_memo.end(); ++it)
+    {
+      const contents_memo_entry& e = it->second;
+      out << e.digest << " " << e.dev << " " << e.ino << " " << e.size
+          << " " << e.mtime << " " << e.mtime_nsec << " " << it->first << endl;
+    }
+  out.close();
+
+  if (!out || rename(tmp.c_str(), contents_memo_path.c_str()) != 0)
+    {
+      if (s.verbose > 1)
+        clog << _F("Failed to save %s: %s", contents_memo_path.c_str(),
+                   strerror(errno)) << endl;
+      unlink(tmp.c_str());
+    }
+}
+
+
 static const stap_hash&
 get_base_hash (systemtap_session& s)
 {
@@ -229,6 +540,9 @@ find_script_hash (systemtap_session& s, const string& script)
   h.add("Compatible (--compatible): ", s.compatible);
   h.add("Error suppression (--suppress-handler-errors): ", s.suppress_handler_errors);
   h.add("Suppress Time Limits (--suppress-time-limits): ", s.suppress_time_limits);
+  h.add("Binary Trace (--binary-trace): ", s.binary_trace);
+  h.add("Line Table Budget (--line-table-budget): ", s.line_table_budget);
+  h.add("Defer Symbols (--defer-symbols): ", s.defer_symbols);
   h.add("Prologue Searching (--prologue-searching[=WHEN]): ", int(s.prologue_searching_mode));
 
   for (unsigned i = 0; i < s.c_macros.size(); i++)
@@ -387,4 +701,83 @@ find_uprobes_hash (systemtap_session& s)
   return hashdir + "/uprobes_" + result;
 }
 
+
+string
+find_dwarf_index_hash (systemtap_session& s, const string& build_id)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The index only depends on the debuginfo, which the build-id
+  // identifies, and on the layout that this stap writes.
+  h.add("DWARF Index Build ID: ", build_id);
+
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("dwarf_index_hash"), h.get_parms(), result,
+                  hashdir + "/dwarfidx_" + result + "_hash.log");
+  return hashdir + "/dwarfidx_" + result + ".idx";
+}
+
+
+string
+find_tapset_hash (systemtap_session& s,
+                  const vector<pair<string, unsigned> >& files)
+{
+  stap_hash h(get_base_hash(s));
+
+  // Hash what the preprocessor conditionals of the tapsets may test.
+  h.add("Runtime Mode: ", int(s.runtime_mode));
+  h.add("Privilege (--privilege): ", s.privilege);
+  h.add("Guru Mode (-g): ", s.guru_mode);
+  h.add("Compatible (--compatible): ", s.compatible);
+  for (unsigned i = 0; i < s.args.size(); i++)
+    h.add("Script Argument: ", s.args[i]);
+
+  // Hash the tapset files in the order they get parsed, and how.
+  load_contents_memo(s);
+  for (unsigned i = 0; i < files.size(); i++)
+    {
+      h.add("Tapset Parse Flags: ", files[i].second);
+      h.add_contents("Tapset ", files[i].first);
+    }
+  save_contents_memo(s);
+
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("tapset_hash"), h.get_parms(), result,
+                  hashdir + "/tapsets_" + result + "_hash.log");
+  return hashdir + "/tapsets_" + result;
+}
+
+string
+find_object_hash (systemtap_session& s, const string& source)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The object of a self-contained auxiliary source only depends on
+  // what it says and on the flags that compile_pass gives it.
+  for (unsigned i = 0; i < s.kernel_extra_cflags.size(); i++)
+    h.add("Kernel Extra Cflags: ", s.kernel_extra_cflags[i]);
+  for (unsigned i = 0; i < s.c_macros.size(); i++)
+    h.add("Macros: ", s.c_macros[i]);
+  for (unsigned i = 0; i < s.kbuildflags.size(); i++)
+    h.add("Kbuildflags: ", s.kbuildflags[i]);
+  h.add_data("Source ", source);
+
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("object_hash"), h.get_parms(), result,
+                  hashdir + "/object_" + result + "_hash.log");
+  return hashdir + "/object_" + result + ".o";
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -1,5 +1,6 @@
 #include <string>
 #include <vector>
+#include <utility>
 
 // Grabbed from linux/module.h kernel include.
 #define MODULE_NAME_LEN (64 - sizeof(unsigned long))
@@ -10,5 +11,10 @@ std::string find_tracequery_hash (systemtap_session& s,
                                   const std::string& header);
 std::string find_typequery_hash (systemtap_session& s, const std::string& name);
 std::string find_uprobes_hash (systemtap_session& s);
+std::string find_dwarf_index_hash (systemtap_session& s,
+                                   const std::string& build_id);
+std::string find_object_hash (systemtap_session& s, const std::string& source);
+std::string find_tapset_hash (systemtap_session& s,
+                              const std::vector<std::pair<std::string, unsigned> >& files);
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -362,6 +362,15 @@ run_sdt_benchmark(systemtap_session& s)
 static set<string> files;
 static string path_dir;
 
+// A directory that pass 1 looked for tapset files in, for -vv
+struct tapset_search
+{
+  string dir;
+  size_t found;
+  size_t begin, end; // what it added to the files to parse
+  bool macros;
+};
+
 static int collect_stp(const char* fpath, const struct stat*,
                        int typeflag, struct FTW* ftwbuf)
 {
@@ -551,10 +560,14 @@ passes_0_4 (systemtap_session &s)
 	    version_suffixes.insert(version_suffixes.begin() + i/2,
 				    runtime_prefix + version_suffixes[i]);
 
-      // First, parse .stpm files on the include path. We need to have the
-      // resulting macro definitions available for parsing library files,
-      // but since .stpm files can consist only of '@define' constructs,
-      // we can parse each one without reference to the others.
+      // First, gather the .stpm files on the include path. We need to have
+      // the resulting macro definitions available for parsing library
+      // files, but since .stpm files can consist only of '@define'
+      // constructs, we can parse each one without reference to the others.
+      // Then gather the library files, which get parsed in the same order.
+      vector<pair<string, unsigned> > tapset_files; // path, parse flags
+      vector<tapset_search> searches;
+
       set<pair<dev_t, ino_t> > seen_library_macro_files;
       set<string> seen_library_macro_files_names;
 
@@ -570,7 +583,7 @@ passes_0_4 (systemtap_session &s)
               path_dir = s.include_path[i] + "/PATH";
               (void) nftw(dir.c_str(), collect_stpm, 1, flags);
 
-	      unsigned prev_s_library_files = s.library_files.size();
+	      tapset_search search = { dir, files.size(), tapset_files.size(), 0, true };
 
 	      for (auto it = files.begin(); it != files.end(); ++it)
 	        {
@@ -617,26 +630,14 @@ passes_0_4 (systemtap_session &s)
 		      seen_library_macro_files_names.insert (tail_part);
 		    }
 
-		  if (s.verbose>2)
-		    clog << _F("Processing tapset \"%s\"", it->c_str()) << endl;
-
-		  stapfile* f = parse_library_macros (s, *it);
-		  if (f == 0)
-		    s.print_warning(_F("macro tapset \"%s\" has errors, and will be skipped.", it->c_str()));
-		  else
-		    s.library_files.push_back (f);
+		  tapset_files.push_back (make_pair (*it, 0u));
 		}
 
-	      unsigned next_s_library_files = s.library_files.size();
-	      if (s.verbose>1 && !files.empty())
-		  //TRANSLATORS: Searching through directories, 'processed' means 'examined so far'
-		clog << _F("Searched for library macro files: \"%s\", found: %zu, processed: %u",
-			   dir.c_str(), files.size(),
-			   (next_s_library_files-prev_s_library_files)) << endl;
+	      search.end = tapset_files.size();
+	      searches.push_back (search);
 	    }
 	}
 
-      // Next, gather and parse the library files.
       set<pair<dev_t, ino_t> > seen_library_files;
       set<string> seen_library_files_names;
 
@@ -652,7 +653,7 @@ passes_0_4 (systemtap_session &s)
               path_dir = s.include_path[i] + "/PATH";
               (void) nftw(dir.c_str(), collect_stp, 1, flags);
 
-	      unsigned prev_s_library_files = s.library_files.size();
+	      tapset_search search = { dir, files.size(), tapset_files.size(), 0, false };
 
               for (auto it = files.begin(); it != files.end(); ++it)
 	        {
@@ -709,33 +710,178 @@ passes_0_4 (systemtap_session &s)
 		      seen_library_files_names.insert (tail_part);
 		    }
 
-		  if (s.verbose>2)
-		    clog << _F("Processing tapset \"%s\"", it->c_str()) << endl;
-
-		  // NB: we don't need to restrict privilege only for
-		  // /usr/share/systemtap, i.e., excluding
-		  // user-specified $XDG_DATA_DIRS.  That's because
-		  // stapdev gets root-equivalent privileges anyway;
-		  // stapsys and stapusr use a remote compilation with
-		  // a trusted environment, where client-side
-		  // $XDG_DATA_DIRS are not passed.
-
-		  stapfile* f = parse (s, *it, tapset_flags);
-		  if (f == 0)
-		    s.print_warning(_F("tapset \"%s\" has errors, and will be skipped", it->c_str()));
-		  else
-		    s.library_files.push_back (f);
+		  tapset_files.push_back (make_pair (*it, tapset_flags));
 		}
 
-	      unsigned next_s_library_files = s.library_files.size();
-	      if (s.verbose>1 && !files.empty())
-		  //TRANSLATORS: Searching through directories, 'processed' means 'examined so far'
-		clog << _F("Searched: \"%s\", found: %zu, processed: %u",
-			   dir.c_str(), files.size(),
-			   (next_s_library_files-prev_s_library_files)) << endl;
+	      search.end = tapset_files.size();
+	      searches.push_back (search);
 	    }
 	}
 
+      // The parsed tapsets only change along with the tapset files and
+      // the few things that their preprocessor conditionals test, so
+      // they are saved in the cache and loaded from there next time.
+      // So is an index of what each tapset defines.
+      string tapset_cache_path, tapset_index_path;
+      if (s.use_cache)
+        {
+          string base = find_tapset_hash (s, tapset_files);
+          if (!base.empty())
+            {
+              tapset_cache_path = base + ".ast";
+              tapset_index_path = base + ".idx";
+            }
+        }
+
+      library_cache* cache = 0;
+      if (!tapset_cache_path.empty() && !s.poison_cache)
+        {
+          cache = new library_cache;
+          if (!cache->open (tapset_cache_path))
+            {
+              delete cache;
+              cache = 0;
+            }
+        }
+
+      // With the index, only the macro files get loaded here, and pass 2
+      // loads the tapsets that the script turns out to need from the
+      // cache.  That won't do for -p1 and the listing modes, which show
+      // all tapsets.  Without the cache, everything is parsed, so that
+      // it gets saved again.
+      library_index* index = 0;
+      if (cache && !tapset_index_path.empty()
+          && s.last_pass > 1 && !s.interactive_mode
+          && (s.dump_mode == systemtap_session::dump_none
+              || s.dump_mode == systemtap_session::dump_matched_probes
+              || s.dump_mode == systemtap_session::dump_matched_probes_vars))
+        {
+          index = new library_index;
+          if (index->load (tapset_index_path))
+            {
+              if (s.verbose>1)
+                clog << _F("Pass 1: using tapset index %s", tapset_index_path.c_str()) << endl;
+              s.tapset_index = index;
+            }
+          else
+            {
+              delete index;
+              index = 0;
+            }
+        }
+
+      vector<bool> parsed (tapset_files.size(), false);
+      bool clean = false;
+      if (cache && index)
+        {
+          if (s.verbose>1)
+            clog << _F("Pass 1: using cached %s", tapset_cache_path.c_str()) << endl;
+          cache->load_macros (s);
+          for (unsigned i=0; i<tapset_files.size(); i++)
+            parsed[i] = endswith (tapset_files[i].first, ".stpm");
+          s.tapset_cache = cache;
+          cache = 0;
+        }
+      else if (cache && cache->load_all (s))
+        {
+          if (s.verbose>1)
+            clog << _F("Pass 1: using cached %s", tapset_cache_path.c_str()) << endl;
+          parsed.assign (tapset_files.size(), true);
+          clean = true;
+        }
+      else
+        {
+          size_t errors = s.seen_errors.size();
+          size_t warnings = s.seen_warnings.size();
+          bool all_parsed = true;
+
+          for (unsigned i=0; i<tapset_files.size(); i++)
+            {
+              const string& path = tapset_files[i].first;
+              assert_no_interrupts();
+
+              if (s.verbose>2)
+                clog << _F("Processing tapset \"%s\"", path.c_str()) << endl;
+
+              stapfile* f;
+              if (endswith (path, ".stpm"))
+                {
+                  f = parse_library_macros (s, path);
+                  if (f == 0)
+                    s.print_warning(_F("macro tapset \"%s\" has errors, and will be skipped.", path.c_str()));
+                }
+              else
+                {
+                  // NB: we don't need to restrict privilege only for
+                  // /usr/share/systemtap, i.e., excluding
+                  // user-specified $XDG_DATA_DIRS.  That's because
+                  // stapdev gets root-equivalent privileges anyway;
+                  // stapsys and stapusr use a remote compilation with
+                  // a trusted environment, where client-side
+                  // $XDG_DATA_DIRS are not passed.
+
+                  f = parse (s, path, tapset_files[i].second);
+                  if (f == 0)
+                    s.print_warning(_F("tapset \"%s\" has errors, and will be skipped", path.c_str()));
+                }
+
+              if (f == 0)
+                all_parsed = false;
+              else
+                {
+                  s.library_files.push_back (f);
+                  parsed[i] = true;
+                }
+            }
+
+          // Only a clean parse is worth saving, since loading it again
+          // would not repeat any of the diagnostics.
+          clean = (all_parsed && errors == s.seen_errors.size()
+                   && warnings == s.seen_warnings.size());
+          if (!tapset_cache_path.empty() && clean)
+            {
+              if (save_library_files (s, tapset_cache_path))
+                {
+                  if (s.verbose>1)
+                    clog << _F("Pass 1: saved parsed tapsets to %s", tapset_cache_path.c_str()) << endl;
+                }
+              else if (s.verbose>1)
+                clog << _F("Pass 1: failed to save parsed tapsets to %s", tapset_cache_path.c_str()) << endl;
+            }
+        }
+      delete cache;
+
+      if (!index && !tapset_index_path.empty() && clean
+          && (s.poison_cache || access (tapset_index_path.c_str(), F_OK) != 0))
+        {
+          library_index new_index;
+          new_index.build (tapset_files, s.library_files);
+          if (new_index.save (tapset_index_path))
+            {
+              if (s.verbose>1)
+                clog << _F("Pass 1: saved tapset index to %s", tapset_index_path.c_str()) << endl;
+            }
+          else if (s.verbose>1)
+            clog << _F("Pass 1: failed to save tapset index to %s", tapset_index_path.c_str()) << endl;
+        }
+
+      for (unsigned i=0; i<searches.size(); i++)
+        {
+          const tapset_search& search = searches[i];
+          if (s.verbose>1 && search.found)
+            {
+              unsigned processed = count (parsed.begin() + search.begin,
+                                          parsed.begin() + search.end, true);
+              //TRANSLATORS: Searching through directories, 'processed' means 'examined so far'
+              if (search.macros)
+                clog << _F("Searched for library macro files: \"%s\", found: %zu, processed: %u",
+                           search.dir.c_str(), search.found, processed) << endl;
+              else
+                clog << _F("Searched: \"%s\", found: %zu, processed: %u",
+                           search.dir.c_str(), search.found, processed) << endl;
+            }
+        }
+
       if (s.num_errors())
 	rc ++;
 
@@ -941,6 +1087,25 @@ passes_0_4 (systemtap_session &s)
          << getmemusage()
          << TIMESPRINT
          << endl;
+
+    for (map<string, builder_stats>::const_iterator it = s.builder_times.begin();
+         it != s.builder_times.end(); ++it)
+      clog << _F("Pass 2: %s: %u calls, %u probes in %lu real ms",
+                 it->first.c_str(), it->second.calls, it->second.probes,
+                 it->second.usecs / 1000) << endl;
+
+    if (s.tapset_index)
+      {
+        const vector<library_index::file>& files = s.tapset_index->files;
+        unsigned n = 0, cached = 0;
+        for (unsigned i = 0; i < files.size(); ++i)
+          {
+            n += files[i].parsed;
+            cached += files[i].cached;
+          }
+        clog << _F("Pass 2: loaded %u of %zu library scripts on demand, %u from the cache",
+                   n, files.size(), cached) << endl;
+      }
   }
 
   missing_rpm_list_print(s, "-debuginfo");
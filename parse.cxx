@@ -29,9 +29,15 @@
 #include <cctype>
 #include <iterator>
 #include <unordered_set>
+#include <unordered_map>
+#include <map>
 
 extern "C" {
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 }
 
 using namespace std;
@@ -2282,6 +2288,20 @@ parser::do_parse_global (vector <vardecl*>& globals, vector<probe*>&,
       if (! (t->type == tok_identifier))
         throw PARSE_ERROR (_("expected identifier"));
 
+      // "percpu" is only a qualifier when another identifier follows,
+      // so that existing globals named percpu keep working.
+      bool percpu = false;
+      if (t->content == "percpu")
+        {
+          const token* t2 = peek ();
+          if (t2 && t2->type == tok_identifier)
+            {
+              percpu = true;
+              delete t;
+              t = next ();
+            }
+        }
+
       string gname = "__global_" + string(t->content);
       string pname = "__private_" + detox_path(fname) + string(t->content);
       string name = priv ? pname : gname;
@@ -2299,6 +2319,7 @@ parser::do_parse_global (vector <vardecl*>& globals, vector<probe*>&,
       d->name = name;
       d->tok = t;
       d->systemtap_v_conditional = systemtap_v_seen;
+      d->percpu = percpu;
       globals.push_back (d);
 
       t = peek ();
@@ -4258,4 +4279,1819 @@ parser::parse_target_symbol_components (target_symbol* e)
     throw PARSE_ERROR(_("-> and [ are not accepted for a pretty-printing variable"));
 }
 
+// ------------------------------------------------------------------------
+// The pass-1 tapset cache.
+//
+// What parsing the tapsets leaves in the session -- the library files
+// and the library macros -- is saved in a binary form, which is loaded
+// instead of parsing them again.  Every string, token and tree node is
+// written once, at its first reference, and by index thereafter: a
+// reference is 0 for null, the index+1 of something already read, or
+// the next index, followed by the definition.  A cache file is only
+// ever read by the stap that wrote it (see find_tapset_hash), so the
+// numbers are in host order.
+//
+// The file is split into sections: first the macro files and macros,
+// which any tapset may refer to, then each other tapset on its own.  A
+// tapset's section only refers back to the macro section, so that with
+// the tapset index, pass 2 can load just the tapsets it needs.  The
+// header lists where each section is:
+//
+//   magic, count, macro offset+size, count * (name, offset+size)
+//
+// and the magic is repeated at the very end.
+
+namespace {
+
+enum parse_cache_kind
+  {
+    // tokens and declarations
+    pck_token = 1, pck_stapfile, pck_probe, pck_probe_alias, pck_probe_point,
+    pck_component, pck_vardecl, pck_vardecl_builtin, pck_functiondecl,
+    pck_macrodecl,
+
+    // statements
+    pck_block, pck_try_block, pck_embeddedcode, pck_null_statement,
+    pck_expr_statement, pck_if_statement, pck_for_loop, pck_foreach_loop,
+    pck_return_statement, pck_delete_statement, pck_next_statement,
+    pck_break_statement, pck_continue_statement,
+
+    // expressions
+    pck_literal_string, pck_literal_number, pck_embedded_expr,
+    pck_binary_expression, pck_unary_expression, pck_pre_crement,
+    pck_post_crement, pck_logical_or_expr, pck_logical_and_expr,
+    pck_array_in, pck_regex_query, pck_comparison, pck_concatenation,
+    pck_ternary_expression, pck_assignment, pck_symbol, pck_target_symbol,
+    pck_arrayindex, pck_functioncall, pck_print_format, pck_stat_op,
+    pck_hist_op, pck_cast_op, pck_autocast_op, pck_atvar_op, pck_defined_op,
+    pck_entry_op, pck_perf_op,
+  };
+
+const char parse_cache_magic[8] = { 'S', 'T', 'A', 'P', 'A', 'S', 'T', '2' };
+
+}
+
+
+struct parse_cache_writer: public visitor
+{
+  string out;
+  unordered_map<interned_string, uint32_t> strings;
+  unordered_map<const void*, uint32_t> objects;
+
+  parse_cache_writer () {}
+
+  // Start a new section that may refer to what BASE wrote.
+  explicit parse_cache_writer (const parse_cache_writer& base):
+    strings (base.strings), objects (base.objects) {}
+
+  void put (const void* p, size_t n) { out.append ((const char*) p, n); }
+  void put_u8 (uint8_t x) { put (&x, sizeof x); }
+  void put_u32 (uint32_t x) { put (&x, sizeof x); }
+  void put_i64 (int64_t x) { put (&x, sizeof x); }
+
+  void put_str (interned_string s);
+  void put_str (const string& s) { put_str (interned_string (s)); }
+  bool put_ref (const void* p, parse_cache_kind k);
+
+  void put_token (const token* t);
+  void put_file (stapfile* f);
+  void put_probe (probe* p);
+  void put_probe_point (probe_point* pp);
+  void put_symboldecl (symboldecl* d);
+  void put_vardecl (vardecl* v);
+  void put_functiondecl (functiondecl* fd);
+  void put_macrodecl (macrodecl* m);
+  void put_stmt (statement* s) { if (s) s->visit (this); else put_u32 (0); }
+  void put_expr (expression* e) { if (e) e->visit (this); else put_u32 (0); }
+  template <typename T> void put_nodes (const vector<T*>& v);
+
+  bool put_expression (expression* e, parse_cache_kind k);
+  bool put_statement (statement* s, parse_cache_kind k);
+  void put_binary (binary_expression* e, parse_cache_kind k);
+  void put_unary (unary_expression* e, parse_cache_kind k);
+  void put_expr_statement (expr_statement* s, parse_cache_kind k);
+  bool put_target_symbol (target_symbol* e, parse_cache_kind k);
+
+  void visit_block (block *s);
+  void visit_try_block (try_block *s);
+  void visit_embeddedcode (embeddedcode *s);
+  void visit_null_statement (null_statement *s);
+  void visit_expr_statement (expr_statement *s);
+  void visit_if_statement (if_statement* s);
+  void visit_for_loop (for_loop* s);
+  void visit_foreach_loop (foreach_loop* s);
+  void visit_return_statement (return_statement* s);
+  void visit_delete_statement (delete_statement* s);
+  void visit_next_statement (next_statement* s);
+  void visit_break_statement (break_statement* s);
+  void visit_continue_statement (continue_statement* s);
+  void visit_literal_string (literal_string* e);
+  void visit_literal_number (literal_number* e);
+  void visit_embedded_expr (embedded_expr* e);
+  void visit_binary_expression (binary_expression* e);
+  void visit_unary_expression (unary_expression* e);
+  void visit_pre_crement (pre_crement* e);
+  void visit_post_crement (post_crement* e);
+  void visit_logical_or_expr (logical_or_expr* e);
+  void visit_logical_and_expr (logical_and_expr* e);
+  void visit_array_in (array_in* e);
+  void visit_regex_query (regex_query* e);
+  void visit_comparison (comparison* e);
+  void visit_concatenation (concatenation* e);
+  void visit_ternary_expression (ternary_expression* e);
+  void visit_assignment (assignment* e);
+  void visit_symbol (symbol* e);
+  void visit_target_symbol (target_symbol* e);
+  void visit_arrayindex (arrayindex* e);
+  void visit_functioncall (functioncall* e);
+  void visit_print_format (print_format* e);
+  void visit_stat_op (stat_op* e);
+  void visit_hist_op (hist_op* e);
+  void visit_cast_op (cast_op* e);
+  void visit_autocast_op (autocast_op* e);
+  void visit_atvar_op (atvar_op* e);
+  void visit_defined_op (defined_op* e);
+  void visit_entry_op (entry_op* e);
+  void visit_perf_op (perf_op* e);
+};
+
+
+void
+parse_cache_writer::put_str (interned_string s)
+{
+  auto it = strings.find (s);
+  if (it != strings.end ())
+    {
+      put_u32 (it->second);
+      return;
+    }
+  uint32_t id = strings.size () + 1;
+  strings[s] = id;
+  put_u32 (id);
+  put_u32 (s.size ());
+  put (s.data (), s.size ());
+}
+
+
+// Write the reference to P, and true if its definition has to follow.
+bool
+parse_cache_writer::put_ref (const void* p, parse_cache_kind k)
+{
+  if (!p)
+    {
+      put_u32 (0);
+      return false;
+    }
+  auto it = objects.find (p);
+  if (it != objects.end ())
+    {
+      put_u32 (it->second);
+      return false;
+    }
+  uint32_t id = objects.size () + 1;
+  objects[p] = id;
+  put_u32 (id);
+  put_u8 (k);
+  return true;
+}
+
+
+void
+parse_cache_writer::put_token (const token* t)
+{
+  if (!put_ref (t, pck_token))
+    return;
+  put_file (t->location.file);
+  put_u32 (t->location.line);
+  put_u32 (t->location.column);
+  put_str (t->content);
+  put_token (t->chain);
+  put_u8 (t->type);
+  put_u8 (t->junk_type);
+}
+
+
+void
+parse_cache_writer::put_file (stapfile* f)
+{
+  if (!put_ref (f, pck_stapfile))
+    return;
+  put_str (f->name);
+  put_str (f->file_contents);
+  put_u8 (f->privileged);
+  put_u8 (f->synthetic);
+  put_u32 (f->probes.size ());
+  for (unsigned i = 0; i < f->probes.size (); ++i)
+    put_probe (f->probes[i]);
+  put_u32 (f->aliases.size ());
+  for (unsigned i = 0; i < f->aliases.size (); ++i)
+    put_probe (f->aliases[i]);
+  put_u32 (f->functions.size ());
+  for (unsigned i = 0; i < f->functions.size (); ++i)
+    put_functiondecl (f->functions[i]);
+  put_u32 (f->globals.size ());
+  for (unsigned i = 0; i < f->globals.size (); ++i)
+    put_vardecl (f->globals[i]);
+  put_nodes (f->embeds);
+}
+
+
+void
+parse_cache_writer::put_probe (probe* p)
+{
+  probe_alias* a = dynamic_cast<probe_alias*> (p);
+  if (!put_ref (p, a ? pck_probe_alias : pck_probe))
+    return;
+  if (a)
+    {
+      put_u32 (a->alias_names.size ());
+      for (unsigned i = 0; i < a->alias_names.size (); ++i)
+        put_probe_point (a->alias_names[i]);
+      put_u8 (a->epilogue_style);
+    }
+  put_u32 (p->locations.size ());
+  for (unsigned i = 0; i < p->locations.size (); ++i)
+    put_probe_point (p->locations[i]);
+  put_stmt (p->body);
+  put_probe (p->base);
+  put_token (p->tok);
+  put_token (p->systemtap_v_conditional);
+  put_u32 (p->locals.size ());
+  for (unsigned i = 0; i < p->locals.size (); ++i)
+    put_vardecl (p->locals[i]);
+  put_u32 (p->unused_locals.size ());
+  for (unsigned i = 0; i < p->unused_locals.size (); ++i)
+    put_vardecl (p->unused_locals[i]);
+  put_u8 (p->privileged);
+  put_u8 (p->synthetic);
+}
+
+
+void
+parse_cache_writer::put_probe_point (probe_point* pp)
+{
+  if (!put_ref (pp, pck_probe_point))
+    return;
+  put_u32 (pp->components.size ());
+  for (unsigned i = 0; i < pp->components.size (); ++i)
+    {
+      probe_point::component* c = pp->components[i];
+      if (!put_ref (c, pck_component))
+        continue;
+      put_str (c->functor);
+      put_expr (c->arg);
+      put_u8 (c->from_glob);
+      put_token (c->tok);
+    }
+  put_u8 (pp->optional);
+  put_u8 (pp->sufficient);
+  put_u8 (pp->well_formed);
+  put_expr (pp->condition);
+  put_str (pp->auto_path);
+}
+
+
+void
+parse_cache_writer::put_symboldecl (symboldecl* d)
+{
+  put_token (d->tok);
+  put_token (d->systemtap_v_conditional);
+  put_str (d->name);
+  put_str (d->unmangled_name);
+  put_u8 (d->type);
+}
+
+
+void
+parse_cache_writer::put_vardecl (vardecl* v)
+{
+  bool builtin = dynamic_cast<vardecl_builtin*> (v);
+  if (!put_ref (v, builtin ? pck_vardecl_builtin : pck_vardecl))
+    return;
+  put_symboldecl (v);
+  put_token (v->arity_tok);
+  put_u32 (v->arity);
+  put_u32 (v->maxsize);
+  put_u32 (v->index_types.size ());
+  for (unsigned i = 0; i < v->index_types.size (); ++i)
+    put_u8 (v->index_types[i]);
+  put_expr (v->init);
+  put_u8 (v->synthetic);
+  put_u8 (v->wrap);
+  put_u8 (v->percpu);
+  put_u8 (v->char_ptr_arg);
+}
+
+
+void
+parse_cache_writer::put_functiondecl (functiondecl* fd)
+{
+  if (!put_ref (fd, pck_functiondecl))
+    return;
+  put_symboldecl (fd);
+  put_u32 (fd->formal_args.size ());
+  for (unsigned i = 0; i < fd->formal_args.size (); ++i)
+    put_vardecl (fd->formal_args[i]);
+  put_u32 (fd->locals.size ());
+  for (unsigned i = 0; i < fd->locals.size (); ++i)
+    put_vardecl (fd->locals[i]);
+  put_u32 (fd->unused_locals.size ());
+  for (unsigned i = 0; i < fd->unused_locals.size (); ++i)
+    put_vardecl (fd->unused_locals[i]);
+  put_stmt (fd->body);
+  put_u8 (fd->synthetic);
+  put_u8 (fd->mangle_oldstyle);
+  put_u8 (fd->has_next);
+  put_i64 (fd->priority);
+}
+
+
+void
+parse_cache_writer::put_macrodecl (macrodecl* m)
+{
+  if (!put_ref (m, pck_macrodecl))
+    return;
+  put_token (m->tok);
+  put_str (m->name);
+  put_u32 (m->formal_args.size ());
+  for (unsigned i = 0; i < m->formal_args.size (); ++i)
+    put_str (m->formal_args[i]);
+  put_u32 (m->body.size ());
+  for (unsigned i = 0; i < m->body.size (); ++i)
+    put_token (m->body[i]);
+  put_u8 (m->context);
+}
+
+
+template <typename T> void
+parse_cache_writer::put_nodes (const vector<T*>& v)
+{
+  put_u32 (v.size ());
+  for (unsigned i = 0; i < v.size (); ++i)
+    if (v[i])
+      v[i]->visit (this);
+    else
+      put_u32 (0);
+}
+
+
+// Write the reference to E, and its common part if it is new.
+bool
+parse_cache_writer::put_expression (expression* e, parse_cache_kind k)
+{
+  if (!put_ref (e, k))
+    return false;
+  put_u8 (e->type);
+  put_token (e->tok);
+  return true;
+}
+
+
+bool
+parse_cache_writer::put_statement (statement* s, parse_cache_kind k)
+{
+  if (!put_ref (s, k))
+    return false;
+  put_token (s->tok);
+  return true;
+}
+
+
+void
+parse_cache_writer::put_binary (binary_expression* e, parse_cache_kind k)
+{
+  if (!put_expression (e, k))
+    return;
+  put_expr (e->left);
+  put_str (e->op);
+  put_expr (e->right);
+}
+
+
+void
+parse_cache_writer::put_unary (unary_expression* e, parse_cache_kind k)
+{
+  if (!put_expression (e, k))
+    return;
+  put_str (e->op);
+  put_expr (e->operand);
+}
+
+
+void
+parse_cache_writer::put_expr_statement (expr_statement* s, parse_cache_kind k)
+{
+  if (!put_statement (s, k))
+    return;
+  put_expr (s->value);
+}
+
+
+bool
+parse_cache_writer::put_target_symbol (target_symbol* e, parse_cache_kind k)
+{
+  if (!put_expression (e, k))
+    return false;
+  put_str (e->name);
+  put_u8 (e->addressof);
+  put_u32 (e->components.size ());
+  for (unsigned i = 0; i < e->components.size (); ++i)
+    {
+      const target_symbol::component& c = e->components[i];
+      put_token (c.tok);
+      put_u8 (c.type);
+      put_str (c.member);
+      put_i64 (c.num_index);
+      put_expr (c.expr_index);
+    }
+  return true;
+}
+
+
+void
+parse_cache_writer::visit_block (block *s)
+{
+  if (put_statement (s, pck_block))
+    put_nodes (s->statements);
+}
+
+void
+parse_cache_writer::visit_try_block (try_block *s)
+{
+  if (!put_statement (s, pck_try_block))
+    return;
+  put_stmt (s->try_block);
+  put_stmt (s->catch_block);
+  put_expr (s->catch_error_var);
+}
+
+void
+parse_cache_writer::visit_embeddedcode (embeddedcode *s)
+{
+  if (put_statement (s, pck_embeddedcode))
+    put_str (s->code);
+}
+
+void
+parse_cache_writer::visit_null_statement (null_statement *s)
+{
+  put_statement (s, pck_null_statement);
+}
+
+void
+parse_cache_writer::visit_expr_statement (expr_statement *s)
+{
+  put_expr_statement (s, pck_expr_statement);
+}
+
+void
+parse_cache_writer::visit_if_statement (if_statement* s)
+{
+  if (!put_statement (s, pck_if_statement))
+    return;
+  put_expr (s->condition);
+  put_stmt (s->thenblock);
+  put_stmt (s->elseblock);
+}
+
+void
+parse_cache_writer::visit_for_loop (for_loop* s)
+{
+  if (!put_statement (s, pck_for_loop))
+    return;
+  put_stmt (s->init);
+  put_expr (s->cond);
+  put_stmt (s->incr);
+  put_stmt (s->block);
+}
+
+void
+parse_cache_writer::visit_foreach_loop (foreach_loop* s)
+{
+  if (!put_statement (s, pck_foreach_loop))
+    return;
+  put_nodes (s->indexes);
+  put_nodes (s->array_slice);
+  put_expr (s->base);
+  put_u32 (s->sort_direction);
+  put_u32 (s->sort_column);
+  put_u8 (s->sort_aggr);
+  put_expr (s->value);
+  put_expr (s->limit);
+  put_stmt (s->block);
+}
+
+void
+parse_cache_writer::visit_return_statement (return_statement* s)
+{
+  put_expr_statement (s, pck_return_statement);
+}
+
+void
+parse_cache_writer::visit_delete_statement (delete_statement* s)
+{
+  put_expr_statement (s, pck_delete_statement);
+}
+
+void
+parse_cache_writer::visit_next_statement (next_statement* s)
+{
+  put_statement (s, pck_next_statement);
+}
+
+void
+parse_cache_writer::visit_break_statement (break_statement* s)
+{
+  put_statement (s, pck_break_statement);
+}
+
+void
+parse_cache_writer::visit_continue_statement (continue_statement* s)
+{
+  put_statement (s, pck_continue_statement);
+}
+
+void
+parse_cache_writer::visit_literal_string (literal_string* e)
+{
+  if (put_expression (e, pck_literal_string))
+    put_str (e->value);
+}
+
+void
+parse_cache_writer::visit_literal_number (literal_number* e)
+{
+  if (!put_expression (e, pck_literal_number))
+    return;
+  put_i64 (e->value);
+  put_u8 (e->print_hex);
+}
+
+void
+parse_cache_writer::visit_embedded_expr (embedded_expr* e)
+{
+  if (put_expression (e, pck_embedded_expr))
+    put_str (e->code);
+}
+
+void
+parse_cache_writer::visit_binary_expression (binary_expression* e)
+{
+  put_binary (e, pck_binary_expression);
+}
+
+void
+parse_cache_writer::visit_unary_expression (unary_expression* e)
+{
+  put_unary (e, pck_unary_expression);
+}
+
+void
+parse_cache_writer::visit_pre_crement (pre_crement* e)
+{
+  put_unary (e, pck_pre_crement);
+}
+
+void
+parse_cache_writer::visit_post_crement (post_crement* e)
+{
+  put_unary (e, pck_post_crement);
+}
+
+void
+parse_cache_writer::visit_logical_or_expr (logical_or_expr* e)
+{
+  put_binary (e, pck_logical_or_expr);
+}
+
+void
+parse_cache_writer::visit_logical_and_expr (logical_and_expr* e)
+{
+  put_binary (e, pck_logical_and_expr);
+}
+
+void
+parse_cache_writer::visit_array_in (array_in* e)
+{
+  if (put_expression (e, pck_array_in))
+    put_expr (e->operand);
+}
+
+void
+parse_cache_writer::visit_regex_query (regex_query* e)
+{
+  if (!put_expression (e, pck_regex_query))
+    return;
+  put_expr (e->left);
+  put_str (e->op);
+  put_expr (e->right);
+}
+
+void
+parse_cache_writer::visit_comparison (comparison* e)
+{
+  put_binary (e, pck_comparison);
+}
+
+void
+parse_cache_writer::visit_concatenation (concatenation* e)
+{
+  put_binary (e, pck_concatenation);
+}
+
+void
+parse_cache_writer::visit_ternary_expression (ternary_expression* e)
+{
+  if (!put_expression (e, pck_ternary_expression))
+    return;
+  put_expr (e->cond);
+  put_expr (e->truevalue);
+  put_expr (e->falsevalue);
+}
+
+void
+parse_cache_writer::visit_assignment (assignment* e)
+{
+  put_binary (e, pck_assignment);
+}
+
+void
+parse_cache_writer::visit_symbol (symbol* e)
+{
+  // NB: referents are resolved in pass 2.
+  if (put_expression (e, pck_symbol))
+    put_str (e->name);
+}
+
+void
+parse_cache_writer::visit_target_symbol (target_symbol* e)
+{
+  put_target_symbol (e, pck_target_symbol);
+}
+
+void
+parse_cache_writer::visit_arrayindex (arrayindex* e)
+{
+  if (!put_expression (e, pck_arrayindex))
+    return;
+  put_nodes (e->indexes);
+  put_expr (e->base);
+}
+
+void
+parse_cache_writer::visit_functioncall (functioncall* e)
+{
+  if (!put_expression (e, pck_functioncall))
+    return;
+  put_str (e->function);
+  put_nodes (e->args);
+}
+
+void
+parse_cache_writer::visit_print_format (print_format* e)
+{
+  if (!put_expression (e, pck_print_format))
+    return;
+  put_str (e->print_format_type);
+  put_u8 (e->print_to_stream);
+  put_u8 (e->print_with_format);
+  put_u8 (e->print_with_delim);
+  put_u8 (e->print_with_newline);
+  put_u8 (e->print_char);
+  put_str (e->raw_components);
+  put_u32 (e->components.size ());
+  for (unsigned i = 0; i < e->components.size (); ++i)
+    {
+      const print_format::format_component& c = e->components[i];
+      put_u32 (c.base);
+      put_u32 (c.width);
+      put_u32 (c.precision);
+      put_u8 (c.flags);
+      put_u8 (c.widthtype);
+      put_u8 (c.prectype);
+      put_u8 (c.type);
+      put_str (c.literal_string);
+    }
+  put_str (e->delimiter);
+  put_nodes (e->args);
+  put_expr (e->hist);
+}
+
+void
+parse_cache_writer::visit_stat_op (stat_op* e)
+{
+  if (!put_expression (e, pck_stat_op))
+    return;
+  put_u8 (e->ctype);
+  put_expr (e->stat);
+  put_u32 (e->params.size ());
+  for (unsigned i = 0; i < e->params.size (); ++i)
+    put_i64 (e->params[i]);
+}
+
+void
+parse_cache_writer::visit_hist_op (hist_op* e)
+{
+  if (!put_expression (e, pck_hist_op))
+    return;
+  put_u8 (e->htype);
+  put_expr (e->stat);
+  put_u32 (e->params.size ());
+  for (unsigned i = 0; i < e->params.size (); ++i)
+    put_i64 (e->params[i]);
+}
+
+void
+parse_cache_writer::visit_cast_op (cast_op* e)
+{
+  if (!put_target_symbol (e, pck_cast_op))
+    return;
+  put_expr (e->operand);
+  put_str (e->type_name);
+  put_str (e->module);
+}
+
+void
+parse_cache_writer::visit_autocast_op (autocast_op* e)
+{
+  if (put_target_symbol (e, pck_autocast_op))
+    put_expr (e->operand);
+}
+
+void
+parse_cache_writer::visit_atvar_op (atvar_op* e)
+{
+  if (!put_target_symbol (e, pck_atvar_op))
+    return;
+  put_str (e->target_name);
+  put_str (e->cu_name);
+  put_str (e->module);
+}
+
+void
+parse_cache_writer::visit_defined_op (defined_op* e)
+{
+  if (put_expression (e, pck_defined_op))
+    put_expr (e->operand);
+}
+
+void
+parse_cache_writer::visit_entry_op (entry_op* e)
+{
+  if (put_expression (e, pck_entry_op))
+    put_expr (e->operand);
+}
+
+void
+parse_cache_writer::visit_perf_op (perf_op* e)
+{
+  if (put_expression (e, pck_perf_op))
+    put_expr (e->operand);
+}
+
+
+struct parse_cache_reader
+{
+  struct corrupt {};
+
+  const char* p;
+  const char* end;
+  vector<interned_string> strings;
+  vector<pair<uint8_t, void*> > objects;
+
+  parse_cache_reader (const char* p, const char* end): p (p), end (end) {}
+
+  void get (void* x, size_t n)
+    {
+      if ((size_t) (end - p) < n)
+        throw corrupt ();
+      memcpy (x, p, n);
+      p += n;
+    }
+  uint8_t get_u8 () { uint8_t x; get (&x, sizeof x); return x; }
+  uint32_t get_u32 () { uint32_t x; get (&x, sizeof x); return x; }
+  int64_t get_i64 () { int64_t x; get (&x, sizeof x); return x; }
+  bool get_bool () { return get_u8 () != 0; }
+  template <typename E> E get_enum (unsigned max)
+    {
+      unsigned x = get_u8 ();
+      if (x > max)
+        throw corrupt ();
+      return (E) x;
+    }
+
+  interned_string get_str ();
+  string get_string () { return string (get_str ()); }
+  void* get_ref (uint8_t& kind, bool& fresh);
+
+  const token* get_token ();
+  stapfile* get_file ();
+  probe* get_probe ();
+  probe_point* get_probe_point ();
+  void get_symboldecl (symboldecl* d);
+  vardecl* get_vardecl ();
+  functiondecl* get_functiondecl ();
+  macrodecl* get_macrodecl ();
+
+  statement* get_stmt ();
+  expression* get_expr ();
+  template <typename T> T* get_stmt_as ();
+  template <typename T> T* get_expr_as ();
+  template <typename T> void get_nodes (vector<T*>& v, T* (parse_cache_reader::*get_one) ());
+  template <typename T> void get_count (vector<T>& v);
+  void get_target_symbol (target_symbol* e);
+};
+
+
+interned_string
+parse_cache_reader::get_str ()
+{
+  uint32_t id = get_u32 ();
+  if (id > 0 && id <= strings.size ())
+    return strings[id - 1];
+  if (id != strings.size () + 1)
+    throw corrupt ();
+  uint32_t n = get_u32 ();
+  if ((size_t) (end - p) < n)
+    throw corrupt ();
+  strings.push_back (interned_string (string (p, n)));
+  p += n;
+  return strings.back ();
+}
+
+
+// Read a reference.  For a new object, return null with FRESH set and
+// its KIND, for the caller to create and register it.
+void*
+parse_cache_reader::get_ref (uint8_t& kind, bool& fresh)
+{
+  uint32_t id = get_u32 ();
+  fresh = false;
+  if (id == 0)
+    {
+      kind = 0;
+      return 0;
+    }
+  if (id <= objects.size ())
+    {
+      kind = objects[id - 1].first;
+      return objects[id - 1].second;
+    }
+  if (id != objects.size () + 1)
+    throw corrupt ();
+  kind = get_u8 ();
+  fresh = true;
+  return 0;
+}
+
+
+const token*
+parse_cache_reader::get_token ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && kind != pck_token)
+    throw corrupt ();
+  if (!fresh)
+    return (const token*) x;
+
+  token* t = new token;
+  objects.push_back (make_pair (kind, (void*) t));
+  t->location.file = get_file ();
+  t->location.line = get_u32 ();
+  t->location.column = get_u32 ();
+  t->content = get_str ();
+  t->chain = get_token ();
+  t->type = get_enum<token_type> (tok_keyword);
+  t->junk_type = get_enum<token_junk_type> (tok_junk_unclosed_embedded);
+  return t;
+}
+
+
+stapfile*
+parse_cache_reader::get_file ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && kind != pck_stapfile)
+    throw corrupt ();
+  if (!fresh)
+    return (stapfile*) x;
+
+  stapfile* f = new stapfile;
+  objects.push_back (make_pair (kind, (void*) f));
+  f->name = get_string ();
+  f->file_contents = get_str ();
+  f->privileged = get_bool ();
+  f->synthetic = get_bool ();
+  for (uint32_t n = get_u32 (); n > 0; --n)
+    {
+      probe* p = get_probe ();
+      if (!p || p->get_alias ())
+        throw corrupt ();
+      f->probes.push_back (p);
+    }
+  for (uint32_t n = get_u32 (); n > 0; --n)
+    {
+      probe_alias* a = dynamic_cast<probe_alias*> (get_probe ());
+      if (!a)
+        throw corrupt ();
+      f->aliases.push_back (a);
+    }
+  get_nodes (f->functions, &parse_cache_reader::get_functiondecl);
+  get_nodes (f->globals, &parse_cache_reader::get_vardecl);
+  get_nodes (f->embeds, &parse_cache_reader::get_stmt_as<embeddedcode>);
+  return f;
+}
+
+
+probe*
+parse_cache_reader::get_probe ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && kind != pck_probe && kind != pck_probe_alias)
+    throw corrupt ();
+  if (!fresh)
+    return (probe*) x;
+
+  probe* p;
+  if (kind == pck_probe_alias)
+    {
+      probe_alias* a = new probe_alias (vector<probe_point*> ());
+      objects.push_back (make_pair (kind, (void*) (probe*) a));
+      get_nodes (a->alias_names, &parse_cache_reader::get_probe_point);
+      a->epilogue_style = get_bool ();
+      p = a;
+    }
+  else
+    {
+      p = new probe;
+      objects.push_back (make_pair (kind, (void*) p));
+    }
+  get_nodes (p->locations, &parse_cache_reader::get_probe_point);
+  p->body = get_stmt ();
+  p->base = get_probe ();
+  p->tok = get_token ();
+  p->systemtap_v_conditional = get_token ();
+  get_nodes (p->locals, &parse_cache_reader::get_vardecl);
+  get_nodes (p->unused_locals, &parse_cache_reader::get_vardecl);
+  p->privileged = get_bool ();
+  p->synthetic = get_bool ();
+  return p;
+}
+
+
+probe_point*
+parse_cache_reader::get_probe_point ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && kind != pck_probe_point)
+    throw corrupt ();
+  if (!fresh)
+    return (probe_point*) x;
+
+  probe_point* pp = new probe_point;
+  objects.push_back (make_pair (kind, (void*) pp));
+  for (uint32_t n = get_u32 (); n > 0; --n)
+    {
+      void* y = get_ref (kind, fresh);
+      if (kind != pck_component)
+        throw corrupt ();
+      probe_point::component* c = (probe_point::component*) y;
+      if (fresh)
+        {
+          c = new probe_point::component;
+          objects.push_back (make_pair (kind, (void*) c));
+          c->functor = get_str ();
+          c->arg = get_expr_as<literal> ();
+          c->from_glob = get_bool ();
+          c->tok = get_token ();
+        }
+      pp->components.push_back (c);
+    }
+  pp->optional = get_bool ();
+  pp->sufficient = get_bool ();
+  pp->well_formed = get_bool ();
+  pp->condition = get_expr ();
+  pp->auto_path = get_string ();
+  return pp;
+}
+
+
+void
+parse_cache_reader::get_symboldecl (symboldecl* d)
+{
+  d->tok = get_token ();
+  d->systemtap_v_conditional = get_token ();
+  d->name = get_str ();
+  d->unmangled_name = get_str ();
+  d->type = get_enum<exp_type> (pe_stats);
+}
+
+
+vardecl*
+parse_cache_reader::get_vardecl ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && kind != pck_vardecl && kind != pck_vardecl_builtin)
+    throw corrupt ();
+  if (!fresh)
+    return (vardecl*) x;
+
+  vardecl* v = (kind == pck_vardecl_builtin) ? new vardecl_builtin : new vardecl;
+  objects.push_back (make_pair (kind, (void*) v));
+  get_symboldecl (v);
+  v->arity_tok = get_token ();
+  v->arity = (int) get_u32 ();
+  v->maxsize = (int) get_u32 ();
+  for (uint32_t n = get_u32 (); n > 0; --n)
+    v->index_types.push_back (get_enum<exp_type> (pe_stats));
+  v->init = get_expr_as<literal> ();
+  v->synthetic = get_bool ();
+  v->wrap = get_bool ();
+  v->percpu = get_bool ();
+  v->char_ptr_arg = get_bool ();
+  return v;
+}
+
+
+functiondecl*
+parse_cache_reader::get_functiondecl ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && kind != pck_functiondecl)
+    throw corrupt ();
+  if (!fresh)
+    return (functiondecl*) x;
+
+  functiondecl* fd = new functiondecl;
+  objects.push_back (make_pair (kind, (void*) fd));
+  get_symboldecl (fd);
+  get_nodes (fd->formal_args, &parse_cache_reader::get_vardecl);
+  get_nodes (fd->locals, &parse_cache_reader::get_vardecl);
+  get_nodes (fd->unused_locals, &parse_cache_reader::get_vardecl);
+  fd->body = get_stmt ();
+  fd->synthetic = get_bool ();
+  fd->mangle_oldstyle = get_bool ();
+  fd->has_next = get_bool ();
+  fd->priority = get_i64 ();
+  return fd;
+}
+
+
+macrodecl*
+parse_cache_reader::get_macrodecl ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && kind != pck_macrodecl)
+    throw corrupt ();
+  if (!fresh)
+    return (macrodecl*) x;
+
+  macrodecl* m = new macrodecl;
+  objects.push_back (make_pair (kind, (void*) m));
+  m->tok = get_token ();
+  m->name = get_string ();
+  for (uint32_t n = get_u32 (); n > 0; --n)
+    m->formal_args.push_back (get_string ());
+  for (uint32_t n = get_u32 (); n > 0; --n)
+    m->body.push_back (get_token ());
+  m->context = get_enum<macro_ctx> (ctx_local);
+  return m;
+}
+
+
+template <typename T> void
+parse_cache_reader::get_nodes (vector<T*>& v, T* (parse_cache_reader::*get_one) ())
+{
+  uint32_t n = get_u32 ();
+  if (n > (size_t) (end - p))
+    throw corrupt ();
+  v.reserve (n);
+  while (n-- > 0)
+    v.push_back ((this->*get_one) ());
+}
+
+
+template <typename T> T*
+parse_cache_reader::get_stmt_as ()
+{
+  statement* s = get_stmt ();
+  T* t = dynamic_cast<T*> (s);
+  if (s && !t)
+    throw corrupt ();
+  return t;
+}
+
+
+template <typename T> T*
+parse_cache_reader::get_expr_as ()
+{
+  expression* e = get_expr ();
+  T* t = dynamic_cast<T*> (e);
+  if (e && !t)
+    throw corrupt ();
+  return t;
+}
+
+
+statement*
+parse_cache_reader::get_stmt ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && (kind < pck_block || kind > pck_continue_statement))
+    throw corrupt ();
+  if (!fresh)
+    return (statement*) x;
+
+  statement* s;
+  switch (kind)
+    {
+    case pck_block: s = new block; break;
+    case pck_try_block: s = new try_block; break;
+    case pck_embeddedcode: s = new embeddedcode; break;
+    case pck_null_statement: s = new null_statement (0); break;
+    case pck_expr_statement: s = new expr_statement; break;
+    case pck_if_statement: s = new if_statement; break;
+    case pck_for_loop: s = new for_loop; break;
+    case pck_foreach_loop: s = new foreach_loop; break;
+    case pck_return_statement: s = new return_statement; break;
+    case pck_delete_statement: s = new delete_statement; break;
+    case pck_next_statement: s = new next_statement; break;
+    case pck_break_statement: s = new break_statement; break;
+    default: s = new continue_statement; break;
+    }
+  objects.push_back (make_pair (kind, (void*) s));
+  s->tok = get_token ();
+
+  switch (kind)
+    {
+    case pck_block:
+      get_nodes (static_cast<block*> (s)->statements, &parse_cache_reader::get_stmt);
+      break;
+    case pck_try_block:
+      {
+        try_block* t = static_cast<try_block*> (s);
+        t->try_block = get_stmt ();
+        t->catch_block = get_stmt ();
+        t->catch_error_var = get_expr_as<symbol> ();
+      }
+      break;
+    case pck_embeddedcode:
+      static_cast<embeddedcode*> (s)->code = get_str ();
+      break;
+    case pck_expr_statement:
+    case pck_return_statement:
+    case pck_delete_statement:
+      static_cast<expr_statement*> (s)->value = get_expr ();
+      break;
+    case pck_if_statement:
+      {
+        if_statement* i = static_cast<if_statement*> (s);
+        i->condition = get_expr ();
+        i->thenblock = get_stmt ();
+        i->elseblock = get_stmt ();
+      }
+      break;
+    case pck_for_loop:
+      {
+        for_loop* f = static_cast<for_loop*> (s);
+        f->init = get_stmt_as<expr_statement> ();
+        f->cond = get_expr ();
+        f->incr = get_stmt_as<expr_statement> ();
+        f->block = get_stmt ();
+      }
+      break;
+    case pck_foreach_loop:
+      {
+        foreach_loop* f = static_cast<foreach_loop*> (s);
+        get_nodes (f->indexes, &parse_cache_reader::get_expr_as<symbol>);
+        get_nodes (f->array_slice, &parse_cache_reader::get_expr);
+        f->base = get_expr_as<indexable> ();
+        f->sort_direction = (int) get_u32 ();
+        f->sort_column = get_u32 ();
+        f->sort_aggr = get_enum<stat_component_type> (sc_variance);
+        f->value = get_expr_as<symbol> ();
+        f->limit = get_expr ();
+        f->block = get_stmt ();
+      }
+      break;
+    }
+  return s;
+}
+
+
+void
+parse_cache_reader::get_target_symbol (target_symbol* e)
+{
+  e->name = get_str ();
+  e->addressof = get_bool ();
+  for (uint32_t n = get_u32 (); n > 0; --n)
+    {
+      const token* t = get_token ();
+      target_symbol::component c (t, (int64_t) 0);
+      c.type = get_enum<target_symbol::component_type> (target_symbol::comp_pretty_print);
+      c.member = get_string ();
+      c.num_index = get_i64 ();
+      c.expr_index = get_expr ();
+      e->components.push_back (c);
+    }
+}
+
+
+expression*
+parse_cache_reader::get_expr ()
+{
+  uint8_t kind;
+  bool fresh;
+  void* x = get_ref (kind, fresh);
+  if (kind != 0 && (kind < pck_literal_string || kind > pck_perf_op))
+    throw corrupt ();
+  if (!fresh)
+    return (expression*) x;
+
+  expression* e;
+  switch (kind)
+    {
+    case pck_literal_string: e = new literal_string (""); break;
+    case pck_literal_number: e = new literal_number (0); break;
+    case pck_embedded_expr: e = new embedded_expr; break;
+    case pck_binary_expression: e = new binary_expression; break;
+    case pck_unary_expression: e = new unary_expression; break;
+    case pck_pre_crement: e = new pre_crement; break;
+    case pck_post_crement: e = new post_crement; break;
+    case pck_logical_or_expr: e = new logical_or_expr; break;
+    case pck_logical_and_expr: e = new logical_and_expr; break;
+    case pck_array_in: e = new array_in; break;
+    case pck_regex_query: e = new regex_query; break;
+    case pck_comparison: e = new comparison; break;
+    case pck_concatenation: e = new concatenation; break;
+    case pck_ternary_expression: e = new ternary_expression; break;
+    case pck_assignment: e = new assignment; break;
+    case pck_symbol: e = new symbol; break;
+    case pck_target_symbol: e = new target_symbol; break;
+    case pck_arrayindex: e = new arrayindex; break;
+    case pck_functioncall: e = new functioncall; break;
+    case pck_print_format:
+      e = new print_format (false, false, false, false, false, interned_string ());
+      break;
+    case pck_stat_op: e = new stat_op; break;
+    case pck_hist_op: e = new hist_op; break;
+    case pck_cast_op: e = new cast_op; break;
+    case pck_autocast_op: e = new autocast_op; break;
+    case pck_atvar_op: e = new atvar_op; break;
+    case pck_defined_op: e = new defined_op; break;
+    case pck_entry_op: e = new entry_op; break;
+    default: e = new perf_op; break;
+    }
+  objects.push_back (make_pair (kind, (void*) e));
+  e->type = get_enum<exp_type> (pe_stats);
+  e->tok = get_token ();
+
+  switch (kind)
+    {
+    case pck_literal_string:
+      static_cast<literal_string*> (e)->value = get_str ();
+      break;
+    case pck_literal_number:
+      static_cast<literal_number*> (e)->value = get_i64 ();
+      static_cast<literal_number*> (e)->print_hex = get_bool ();
+      break;
+    case pck_embedded_expr:
+      static_cast<embedded_expr*> (e)->code = get_str ();
+      break;
+    case pck_binary_expression:
+    case pck_logical_or_expr:
+    case pck_logical_and_expr:
+    case pck_comparison:
+    case pck_concatenation:
+    case pck_assignment:
+      {
+        binary_expression* b = static_cast<binary_expression*> (e);
+        b->left = get_expr ();
+        b->op = get_str ();
+        b->right = get_expr ();
+      }
+      break;
+    case pck_unary_expression:
+    case pck_pre_crement:
+    case pck_post_crement:
+      {
+        unary_expression* u = static_cast<unary_expression*> (e);
+        u->op = get_str ();
+        u->operand = get_expr ();
+      }
+      break;
+    case pck_array_in:
+      static_cast<array_in*> (e)->operand = get_expr_as<arrayindex> ();
+      break;
+    case pck_regex_query:
+      {
+        regex_query* r = static_cast<regex_query*> (e);
+        r->left = get_expr ();
+        r->op = get_str ();
+        r->right = get_expr_as<literal_string> ();
+      }
+      break;
+    case pck_ternary_expression:
+      {
+        ternary_expression* t = static_cast<ternary_expression*> (e);
+        t->cond = get_expr ();
+        t->truevalue = get_expr ();
+        t->falsevalue = get_expr ();
+      }
+      break;
+    case pck_symbol:
+      static_cast<symbol*> (e)->name = get_str ();
+      break;
+    case pck_target_symbol:
+      get_target_symbol (static_cast<target_symbol*> (e));
+      break;
+    case pck_arrayindex:
+      get_nodes (static_cast<arrayindex*> (e)->indexes, &parse_cache_reader::get_expr);
+      static_cast<arrayindex*> (e)->base = get_expr_as<indexable> ();
+      break;
+    case pck_functioncall:
+      static_cast<functioncall*> (e)->function = get_str ();
+      get_nodes (static_cast<functioncall*> (e)->args, &parse_cache_reader::get_expr);
+      break;
+    case pck_print_format:
+      {
+        print_format* f = static_cast<print_format*> (e);
+        f->print_format_type = get_str ();
+        f->print_to_stream = get_bool ();
+        f->print_with_format = get_bool ();
+        f->print_with_delim = get_bool ();
+        f->print_with_newline = get_bool ();
+        f->print_char = get_bool ();
+        f->raw_components = get_string ();
+        for (uint32_t n = get_u32 (); n > 0; --n)
+          {
+            print_format::format_component c;
+            c.base = get_u32 ();
+            c.width = get_u32 ();
+            c.precision = get_u32 ();
+            c.flags = get_u8 ();
+            c.widthtype = get_enum<print_format::width_type> (print_format::width_dynamic);
+            c.prectype = get_enum<print_format::precision_type> (print_format::prec_dynamic);
+            c.type = get_enum<print_format::conversion_type> (print_format::conv_binary);
+            c.literal_string = get_str ();
+            f->components.push_back (c);
+          }
+        f->delimiter = get_str ();
+        get_nodes (f->args, &parse_cache_reader::get_expr);
+        f->hist = get_expr_as<hist_op> ();
+      }
+      break;
+    case pck_stat_op:
+      {
+        stat_op* s = static_cast<stat_op*> (e);
+        s->ctype = get_enum<stat_component_type> (sc_variance);
+        s->stat = get_expr ();
+        for (uint32_t n = get_u32 (); n > 0; --n)
+          s->params.push_back (get_i64 ());
+      }
+      break;
+    case pck_hist_op:
+      {
+        hist_op* h = static_cast<hist_op*> (e);
+        h->htype = get_enum<histogram_type> (hist_log);
+        h->stat = get_expr ();
+        for (uint32_t n = get_u32 (); n > 0; --n)
+          h->params.push_back (get_i64 ());
+      }
+      break;
+    case pck_cast_op:
+      {
+        cast_op* c = static_cast<cast_op*> (e);
+        get_target_symbol (c);
+        c->operand = get_expr ();
+        c->type_name = get_str ();
+        c->module = get_str ();
+      }
+      break;
+    case pck_autocast_op:
+      get_target_symbol (static_cast<autocast_op*> (e));
+      static_cast<autocast_op*> (e)->operand = get_expr ();
+      break;
+    case pck_atvar_op:
+      {
+        atvar_op* a = static_cast<atvar_op*> (e);
+        get_target_symbol (a);
+        a->target_name = get_str ();
+        a->cu_name = get_str ();
+        a->module = get_str ();
+      }
+      break;
+    case pck_defined_op:
+      static_cast<defined_op*> (e)->operand = get_expr ();
+      break;
+    case pck_entry_op:
+      static_cast<entry_op*> (e)->operand = get_expr ();
+      break;
+    case pck_perf_op:
+      static_cast<perf_op*> (e)->operand = get_expr_as<literal_string> ();
+      break;
+    }
+  return e;
+}
+
+
+bool
+save_library_files (systemtap_session& s, const string& path)
+{
+  vector<stapfile*> macro_files, files;
+  for (unsigned i = 0; i < s.library_files.size (); ++i)
+    if (endswith (s.library_files[i]->name, ".stpm"))
+      macro_files.push_back (s.library_files[i]);
+    else
+      files.push_back (s.library_files[i]);
+
+  parse_cache_writer base;
+  base.put_u32 (macro_files.size ());
+  for (unsigned i = 0; i < macro_files.size (); ++i)
+    base.put_file (macro_files[i]);
+  base.put_u32 (s.library_macros.size ());
+  for (auto it = s.library_macros.begin (); it != s.library_macros.end (); ++it)
+    {
+      base.put_str (it->first);
+      base.put_macrodecl (it->second);
+    }
+
+  vector<string> sections;
+  size_t header = sizeof parse_cache_magic + 3 * sizeof (uint32_t);
+  for (unsigned i = 0; i < files.size (); ++i)
+    {
+      parse_cache_writer w (base);
+      w.put_file (files[i]);
+      sections.push_back (string ());
+      sections.back ().swap (w.out);
+      header += 3 * sizeof (uint32_t) + files[i]->name.size ();
+    }
+
+  parse_cache_writer w;
+  uint32_t offset = header;
+  w.put (parse_cache_magic, sizeof parse_cache_magic);
+  w.put_u32 (files.size ());
+  w.put_u32 (offset);
+  w.put_u32 (base.out.size ());
+  offset += base.out.size ();
+  for (unsigned i = 0; i < files.size (); ++i)
+    {
+      const string& name = files[i]->name;
+      w.put_u32 (name.size ());
+      w.put (name.data (), name.size ());
+      w.put_u32 (offset);
+      w.put_u32 (sections[i].size ());
+      offset += sections[i].size ();
+    }
+  assert (w.out.size () == header);
+  w.out += base.out;
+  for (unsigned i = 0; i < sections.size (); ++i)
+    w.out += sections[i];
+  w.put (parse_cache_magic, sizeof parse_cache_magic);
+
+  // Write it aside and rename, so that readers never see part of it.
+  string tmp = path + ".XXXXXX";
+  int fd = mkstemp (&tmp[0]);
+  if (fd < 0)
+    return false;
+  bool ok = (write (fd, w.out.data (), w.out.size ()) == (ssize_t) w.out.size ());
+  ok = (close (fd) == 0) && ok;
+  if (ok)
+    ok = (rename (tmp.c_str (), path.c_str ()) == 0);
+  if (!ok)
+    unlink (tmp.c_str ());
+  return ok;
+}
+
+
+library_cache::~library_cache ()
+{
+  delete base;
+  if (data)
+    munmap (data, size);
+}
+
+
+// Map the cache file, and read its header and the macro section.
+bool
+library_cache::open (const string& path)
+{
+  int fd = ::open (path.c_str (), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close (fd);
+  if (map == MAP_FAILED)
+    return false;
+  data = map;
+  size = st.st_size;
+
+  const char* begin = (const char*) data;
+  const char* end = begin + size;
+  try
+    {
+      parse_cache_reader h (begin, end);
+      char magic[sizeof parse_cache_magic];
+      h.get (magic, sizeof magic);
+      if (memcmp (magic, parse_cache_magic, sizeof magic) != 0
+          || size < 2 * sizeof magic
+          || memcmp (end - sizeof magic, parse_cache_magic, sizeof magic) != 0)
+        throw parse_cache_reader::corrupt ();
+      end -= sizeof magic;
+
+      uint32_t n = h.get_u32 ();
+      uint32_t offset = h.get_u32 ();
+      uint32_t length = h.get_u32 ();
+      if (offset > size || length > (size_t) (end - begin) - offset)
+        throw parse_cache_reader::corrupt ();
+      base = new parse_cache_reader (begin + offset, begin + offset + length);
+
+      for (; n > 0; --n)
+        {
+          uint32_t len = h.get_u32 ();
+          if ((size_t) (h.end - h.p) < len)
+            throw parse_cache_reader::corrupt ();
+          string name (h.p, len);
+          h.p += len;
+          offset = h.get_u32 ();
+          length = h.get_u32 ();
+          if (offset > size || length > (size_t) (end - begin) - offset
+              || sections.count (name))
+            throw parse_cache_reader::corrupt ();
+          sections[name] = make_pair (offset, length);
+          order.push_back (name);
+        }
+
+      base->get_nodes (macro_files, &parse_cache_reader::get_file);
+      for (uint32_t n = base->get_u32 (); n > 0; --n)
+        {
+          string name = base->get_string ();
+          macrodecl* m = base->get_macrodecl ();
+          if (!m)
+            throw parse_cache_reader::corrupt ();
+          macros[name] = m;
+        }
+      if (base->p != base->end)
+        throw parse_cache_reader::corrupt ();
+      for (unsigned i = 0; i < macro_files.size (); ++i)
+        if (!macro_files[i])
+          throw parse_cache_reader::corrupt ();
+    }
+  catch (const parse_cache_reader::corrupt&)
+    {
+      // NB: whatever was read so far is leaked, like trees usually are.
+      return false;
+    }
+  return true;
+}
+
+
+// Add the macro files and macros to the session, like parsing the .stpm
+// files would have.
+void
+library_cache::load_macros (systemtap_session& s)
+{
+  s.library_files.insert (s.library_files.end (),
+                          macro_files.begin (), macro_files.end ());
+  s.library_macros.insert (macros.begin (), macros.end ());
+}
+
+
+// Read the section of the tapset NAME, or return null if there is none
+// or it's corrupt.
+stapfile*
+library_cache::read_file (const string& name)
+{
+  map<string, pair<unsigned, unsigned> >::const_iterator it = sections.find (name);
+  if (it == sections.end ())
+    return 0;
+
+  const char* begin = (const char*) data + it->second.first;
+  parse_cache_reader r (*base);
+  r.p = begin;
+  r.end = begin + it->second.second;
+  try
+    {
+      stapfile* f = r.get_file ();
+      if (!f || f->name != name || r.p != r.end)
+        throw parse_cache_reader::corrupt ();
+      for (unsigned i = 0; i < f->functions.size (); ++i)
+        if (f->functions[i]->name.to_string ().rfind ("__overload_") == string::npos)
+          throw parse_cache_reader::corrupt ();
+      return f;
+    }
+  catch (const parse_cache_reader::corrupt&)
+    {
+      return 0;
+    }
+}
+
+
+// Number the overloads of a tapset's functions after those that the
+// session has already seen, as parsing it now would have.
+static void
+renumber_overloads (systemtap_session& s, stapfile* f)
+{
+  for (unsigned i = 0; i < f->functions.size (); ++i)
+    {
+      functiondecl* fd = f->functions[i];
+      string name = fd->name.to_string ();
+      name.erase (name.rfind ("__overload_"));
+      fd->name = name + "__overload_"
+        + lex_cast (s.overload_count[fd->unmangled_name]++);
+    }
+}
+
+
+// Load the tapset NAME from the cache, or return null.  It's up to the
+// caller to add it to the session's library files.
+stapfile*
+library_cache::load_file (systemtap_session& s, const string& name)
+{
+  stapfile* f = read_file (name);
+  if (f)
+    renumber_overloads (s, f);
+  return f;
+}
+
+
+// Load everything in the cache.  Nothing is added to the session unless
+// all of it could be read.
+bool
+library_cache::load_all (systemtap_session& s)
+{
+  vector<stapfile*> files;
+  for (unsigned i = 0; i < order.size (); ++i)
+    {
+      stapfile* f = read_file (order[i]);
+      if (!f)
+        return false;
+      files.push_back (f);
+    }
+
+  load_macros (s);
+  for (unsigned i = 0; i < files.size (); ++i)
+    {
+      renumber_overloads (s, files[i]);
+      s.library_files.push_back (files[i]);
+    }
+  return true;
+}
+
+
+// ------------------------------------------------------------------------
+// The tapset symbol index.  It is a text file, with a line for each
+// tapset file ("file FLAGS PATH") and for each public symbol that one of
+// them defines ("function|global|alias FILE NAME", FILE counting the
+// file lines from zero).  Aliases go by the first component of their
+// names, since that is where resolving a probe point starts.
+
+static const char library_index_magic[] = "STAPIDX1";
+
+static void
+add_library_symbol (library_index::symbol_map& symbols, const string& name,
+                    unsigned file)
+{
+  vector<unsigned>& files = symbols[name];
+  if (files.empty () || files.back () != file)
+    files.push_back (file);
+}
+
+
+void
+library_index::build (const vector<pair<string, unsigned> >& tapsets,
+                      const vector<stapfile*>& parsed)
+{
+  map<string, stapfile*> by_name;
+  for (unsigned i = 0; i < parsed.size (); ++i)
+    by_name[parsed[i]->name] = parsed[i];
+
+  for (unsigned i = 0; i < tapsets.size (); ++i)
+    {
+      // NB: the macro files always get parsed, as any tapset may use them.
+      if (endswith (tapsets[i].first, ".stpm"))
+        continue;
+
+      unsigned n = files.size ();
+      file lf = { tapsets[i].first, tapsets[i].second, false, false };
+      files.push_back (lf);
+
+      stapfile* f = by_name[tapsets[i].first];
+      if (!f)
+        continue;
+
+      for (unsigned j = 0; j < f->functions.size (); ++j)
+        if (f->functions[j]->name.starts_with ("__global_"))
+          add_library_symbol (functions,
+                              f->functions[j]->unmangled_name.to_string (), n);
+      for (unsigned j = 0; j < f->globals.size (); ++j)
+        if (f->globals[j]->name.starts_with ("__global_"))
+          add_library_symbol (globals,
+                              f->globals[j]->unmangled_name.to_string (), n);
+      for (unsigned j = 0; j < f->aliases.size (); ++j)
+        {
+          probe_alias* alias = f->aliases[j];
+          for (unsigned k = 0; k < alias->alias_names.size (); ++k)
+            add_library_symbol (aliases,
+                                alias->alias_names[k]->components[0]->functor.to_string (),
+                                n);
+        }
+    }
+}
+
+
+bool
+library_index::save (const string& path) const
+{
+  string tmp = path + ".XXXXXX";
+  int fd = mkstemp (&tmp[0]);
+  if (fd < 0)
+    return false;
+  close (fd);
+
+  ofstream o (tmp.c_str (), ios::trunc);
+  o << library_index_magic << endl;
+  for (unsigned i = 0; i < files.size (); ++i)
+    o << "file " << files[i].flags << ' ' << files[i].path << endl;
+
+  const symbol_map* maps[] = { &functions, &globals, &aliases };
+  const char* kinds[] = { "function", "global", "alias" };
+  for (unsigned m = 0; m < 3; ++m)
+    for (auto it = maps[m]->begin (); it != maps[m]->end (); ++it)
+      for (unsigned i = 0; i < it->second.size (); ++i)
+        o << kinds[m] << ' ' << it->second[i] << ' ' << it->first << endl;
+  o.close ();
+
+  if (o.fail () || rename (tmp.c_str (), path.c_str ()) != 0)
+    {
+      unlink (tmp.c_str ());
+      return false;
+    }
+  return true;
+}
+
+
+bool
+library_index::load (const string& path)
+{
+  ifstream i (path.c_str ());
+  string line;
+  if (!getline (i, line) || line != library_index_magic)
+    return false;
+
+  vector<file> new_files;
+  symbol_map new_maps[3];
+  const char* kinds[] = { "function", "global", "alias" };
+  while (getline (i, line))
+    {
+      istringstream l (line);
+      string kind, name;
+      unsigned n;
+      if (!(l >> kind >> n) || l.get () != ' ' || !getline (l, name)
+          || name.empty ())
+        return false;
+
+      if (kind == "file")
+        {
+          file lf = { name, n, false, false };
+          new_files.push_back (lf);
+          continue;
+        }
+
+      unsigned m = 0;
+      while (m < 3 && kind != kinds[m])
+        ++m;
+      if (m == 3 || n >= new_files.size ())
+        return false;
+      add_library_symbol (new_maps[m], name, n);
+    }
+  if (!i.eof ())
+    return false;
+
+  files.swap (new_files);
+  functions.swap (new_maps[0]);
+  globals.swap (new_maps[1]);
+  aliases.swap (new_maps[2]);
+  return true;
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -11,7 +11,9 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 #include <iostream>
 #include <stdexcept>
@@ -68,6 +70,7 @@ struct token
   
   friend class parser;
   friend class lexer;
+  friend struct parse_cache_reader;
 private:
   void make_junk (token_junk_type);
   token(): chain(0), type(tok_junk), junk_type(tok_junk_unknown) {}
@@ -115,6 +118,62 @@ stapfile* parse_library_macros (systemtap_session& s, const std::string& n);
 
 probe* parse_synthetic_probe (systemtap_session &s, std::istream& i, const token* tok);
 
+// The pass-1 tapset cache: what parsing the tapsets left in the session
+bool save_library_files (systemtap_session& s, const std::string& path);
+
+struct parse_cache_reader;
+
+// A cache file saved by save_library_files, from which the tapsets can
+// be loaded all at once or one by one.
+struct library_cache
+{
+  library_cache (): data (0), size (0), base (0) {}
+  ~library_cache ();
+
+  bool open (const std::string& path);
+  void load_macros (systemtap_session& s);
+  stapfile* load_file (systemtap_session& s, const std::string& name);
+  bool load_all (systemtap_session& s);
+
+private:
+  void* data;
+  size_t size;
+  parse_cache_reader* base;	// as left by the macro section
+  std::map<std::string, std::pair<unsigned, unsigned> > sections;
+  std::vector<std::string> order;
+  std::vector<stapfile*> macro_files;
+  std::map<std::string, macrodecl*> macros;
+
+  stapfile* read_file (const std::string& name);
+  library_cache (const library_cache&);
+  library_cache& operator= (const library_cache&);
+};
+
+// Which tapset files define which public functions, globals and probe
+// aliases (by the first component of their names), so that pass 2 only
+// needs to load the tapsets that the script actually refers to.
+struct library_index
+{
+  struct file
+  {
+    std::string path;
+    unsigned flags;
+    bool parsed;
+    bool cached;
+  };
+  typedef std::map<std::string, std::vector<unsigned> > symbol_map;
+
+  std::vector<file> files;
+  symbol_map functions;
+  symbol_map globals;
+  symbol_map aliases;
+
+  void build (const std::vector<std::pair<std::string, unsigned> >& tapsets,
+              const std::vector<stapfile*>& parsed);
+  bool save (const std::string& path) const;
+  bool load (const std::string& path);
+};
+
 #endif // PARSE_H
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -15,11 +15,32 @@
 #define MAP_GET_CPU()	smp_processor_id()
 #define MAP_PUT_CPU()	do {} while (0)
 
+/* With -DSTP_PMAP_NODE_AGG, pmaps on NUMA machines get a partial
+ * aggregate per node, so that the nodes can merge their own cpus' maps
+ * in parallel (see _stp_pmap_node_agg).  It's opt-in, since the merges
+ * run from IPIs and each node's partial costs another full-size map. */
+#if defined(STP_PMAP_NODE_AGG) \
+	&& !(defined(CONFIG_NUMA) && defined(CONFIG_SMP) \
+	     && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29))
+#undef STP_PMAP_NODE_AGG
+#endif
+
+/* pmaps remember which hash buckets of each per-cpu map were written
+ * since the last aggregation, so that it only has to redo those.
+ * -DSTP_PMAP_NO_INCREMENTAL aggregates from scratch every time. */
+#ifndef STP_PMAP_NO_INCREMENTAL
+#define STP_PMAP_INCREMENTAL 1
+#endif
 
 struct pmap {
 	int bit_shift;	/* scale factor for integer arithmetic */
 	int stat_ops;	/* related statistical operators */
 	MAP agg;	/* aggregation map */
+#ifdef STP_PMAP_NODE_AGG
+	int node_agg_ok;		/* more than one node, all allocated */
+	MAP node_agg[MAX_NUMNODES];	/* per-node partial aggregates */
+	struct cpumask node_cpus;	/* cpus doing the partial merges */
+#endif
 	MAP map[];	/* per-cpu maps */
 };
 
@@ -47,6 +68,20 @@ static inline void _stp_pmap_set_map(PMAP p, MAP m, unsigned cpu)
 	p->map[cpu] = m;
 }
 
+#ifdef STP_PMAP_INCREMENTAL
+static inline unsigned _stp_map_dirty_words(MAP map)
+{
+	return (map->hash_table_mask + BITS_PER_LONG) / BITS_PER_LONG;
+}
+
+/* hv is the unscaled hash value of a key being written or deleted */
+static inline void _stp_map_mark_dirty(MAP map, uint32_t hv)
+{
+	if (map->dirty)
+		__set_bit(hv & map->hash_table_mask, map->dirty);
+}
+#endif
+
 
 /** Deletes a map.
  * Deletes a map, freeing all memory in all elements.
@@ -61,6 +96,10 @@ static void _stp_map_del(MAP map)
 
 	if (map->node_mem)
 		_stp_vfree(map->node_mem);
+	if (map->dirty)
+		_stp_vfree(map->dirty);
+	if (map->sort_heap)
+		_stp_vfree(map->sort_heap);
 
 	_stp_vfree(map);
 }
@@ -77,6 +116,11 @@ static void _stp_pmap_del(PMAP pmap)
 		_stp_map_del(m);
 	}
 
+#ifdef STP_PMAP_NODE_AGG
+	for (i = 0; i < MAX_NUMNODES; i++)
+		_stp_map_del(pmap->node_agg[i]);
+#endif
+
 	/* free agg map elements */
 	_stp_map_del(_stp_pmap_get_agg(pmap));
 	_stp_vfree(pmap);
@@ -103,8 +147,13 @@ _stp_map_init(MAP m, unsigned max_entries, unsigned hash_table_mask,
 	INIT_MLIST_HEAD(&m->head);
 
         m->hash_table_mask = hash_table_mask;
+#ifdef STP_MAP_OPENADDR
+	/* the buckets are already zeroed by _stp_map_vzalloc() */
+	m->node_size = node_size;
+#else
 	for (i = 0; i <= hash_table_mask; i++)
 		INIT_MHLIST_HEAD(&m->hashes[i]);
+#endif
 
 	m->maxnum = max_entries;
 	m->wrap = wrap;
@@ -118,7 +167,9 @@ _stp_map_init(MAP m, unsigned max_entries, unsigned hash_table_mask,
 	for (i = 0; i < max_entries; i++) {
 		struct map_node *node = m->node_mem + i * node_size;
 		mlist_add(&node->lnode, &m->pool);
+#ifndef STP_MAP_OPENADDR
 		INIT_MHLIST_NODE(&node->hnode);
+#endif
 	}
 
 	return 0;
@@ -139,9 +190,15 @@ _stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
 {
 	MAP m;
         unsigned hash_table_mask = HASHTABLESIZE(max_entries)-1; /* usable as bitmask */
+#ifdef STP_MAP_OPENADDR
+	m = _stp_map_vzalloc(sizeof(struct map_root) +
+                             sizeof(struct map_bucket) * (hash_table_mask+1),
+                             cpu);
+#else
 	m = _stp_map_vzalloc(sizeof(struct map_root) +
                              sizeof(struct mhlist_head) * (hash_table_mask+1),
                              cpu);
+#endif
 	if (m == NULL)
 		return NULL;
 
@@ -152,6 +209,20 @@ _stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
 	return m;
 }
 
+/* Give a map the heap that lets _stp_map_sortn() select its top
+ * entries without sorting all of it. */
+static int _stp_map_sortn_alloc(MAP map)
+{
+	map->sort_heap = _stp_map_vzalloc(map->maxnum
+					  * sizeof(struct map_sort_entry), -1);
+	return map->sort_heap ? 0 : -ENOMEM;
+}
+
+static int _stp_pmap_sortn_alloc(PMAP pmap)
+{
+	return _stp_map_sortn_alloc(_stp_pmap_get_agg(pmap));
+}
+
 static PMAP
 _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 {
@@ -177,8 +248,47 @@ _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 		goto err1;
         _stp_pmap_set_agg(pmap, m);
 
+#ifdef STP_PMAP_INCREMENTAL
+	/* Allocate the dirty bucket bitmaps.  Nothing has been
+	 * aggregated yet, so the first aggregation starts over. */
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		m->dirty = _stp_map_vzalloc(_stp_map_dirty_words(m)
+					    * sizeof(long), i);
+		if (m->dirty == NULL)
+			goto err2;
+	}
+	m = _stp_pmap_get_agg(pmap);
+	m->dirty = _stp_map_vzalloc(_stp_map_dirty_words(m) * sizeof(long), -1);
+	if (m->dirty == NULL)
+		goto err2;
+	m->dirty_all = 1;
+#endif
+
+#ifdef STP_PMAP_NODE_AGG
+	/* Allocate the per-node partial aggregates, on their nodes.
+	 * Without them we just aggregate serially, so failure here
+	 * isn't fatal. */
+	if (num_possible_nodes() > 1) {
+		pmap->node_agg_ok = 1;
+		for_each_possible_cpu(i) {
+			int node = cpu_to_node(i);
+			if (pmap->node_agg[node])
+				continue;
+			pmap->node_agg[node] = _stp_map_new(max_entries, wrap,
+							    node_size, i);
+			if (pmap->node_agg[node] == NULL)
+				pmap->node_agg_ok = 0;
+		}
+	}
+#endif
+
 	return pmap;
 
+#ifdef STP_PMAP_INCREMENTAL
+err2:
+	_stp_map_del(_stp_pmap_get_agg(pmap));
+#endif
 err1:
 	for_each_possible_cpu(i) {
 		m = _stp_pmap_get_map (pmap, i);
@@ -32,12 +32,40 @@
  *
  * This function is called automatically when the print buffer is full.
  * It MUST also be called at the end of every probe that prints something.
+ *
+ * With STP_BINARY_TRACE (stap --binary-trace) the buffer holds a series
+ * of records, each starting with a struct _stp_bintrace_hdr.  Compiled
+ * printfs write their format id and raw arguments as one record, and
+ * stap-merge -b formats them.  All other output goes into a text record
+ * (id 0) that is kept open at text_hdr, so the usual print functions
+ * need not know about records; it is closed whenever a binary record is
+ * written or the buffer is flushed.
  * @{
  */
 
+#ifdef STP_BINARY_TRACE
+#if STP_BUFFER_SIZE > 65535
+#error "STP_BUFFER_SIZE is too large for --binary-trace records"
+#endif
+
+struct _stp_bintrace_hdr {
+	uint16_t id;			/* format id, or one of below */
+	uint16_t len;			/* payload bytes that follow */
+};
+
+#define STP_BINTRACE_TEXT 0		/* plain text output */
+#define STP_BINTRACE_FORMAT 0xffff	/* format table entry */
+#define STP_PBUF_HDR sizeof(struct _stp_bintrace_hdr)
+#else
+#define STP_PBUF_HDR 0
+#endif
+
 typedef struct __stp_pbuf {
 	uint32_t len;			/* bytes used in the buffer */
-	char buf[STP_BUFFER_SIZE];
+#ifdef STP_BINARY_TRACE
+	uint32_t text_hdr;		/* offset of the open text record */
+#endif
+	char buf[STP_BUFFER_SIZE + STP_PBUF_HDR];
 } _stp_pbuf;
 
 static void *Stp_pbuf = NULL;
@@ -56,6 +84,16 @@ static int _stp_print_init (void)
 	Stp_pbuf = _stp_alloc_percpu(sizeof(_stp_pbuf));
 	if (unlikely(Stp_pbuf == 0))
 		return -1;
+#ifdef STP_BINARY_TRACE
+	{
+		int cpu;
+		for_each_possible_cpu(cpu) {
+			_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, cpu);
+			pb->text_hdr = 0;
+			pb->len = STP_PBUF_HDR;
+		}
+	}
+#endif
 
 	/* now initialize IO buffer used in io.c */
 	Stp_lbuf = _stp_alloc_percpu(sizeof(_stp_lbuf));
@@ -74,6 +112,29 @@ static void _stp_print_cleanup (void)
 		_stp_free_percpu(Stp_lbuf);
 }
 
+#ifdef STP_BINARY_TRACE
+/* Finish the open text record, or drop its header if nothing was
+ * written to it. */
+static inline void _stp_pbuf_close_text(_stp_pbuf *pb)
+{
+	struct _stp_bintrace_hdr h;
+
+	if (pb->len == pb->text_hdr + STP_PBUF_HDR) {
+		pb->len = pb->text_hdr;
+		return;
+	}
+	h.id = STP_BINTRACE_TEXT;
+	h.len = pb->len - pb->text_hdr - STP_PBUF_HDR;
+	memcpy(pb->buf + pb->text_hdr, &h, sizeof(h));
+}
+
+static inline void _stp_pbuf_open_text(_stp_pbuf *pb)
+{
+	pb->text_hdr = pb->len;
+	pb->len += STP_PBUF_HDR;
+}
+#endif
+
 #include "print_flush.c"
 
 static inline void _stp_print_flush(void)
@@ -115,6 +176,52 @@ static void _stp_unreserve_bytes (int numbytes)
 	pb->len -= numbytes;
 }
 
+#ifdef STP_BINARY_TRACE
+/** Reserves space for a binary record in the output buffer.
+ * @param id The record id
+ * @param numbytes Size of the record payload
+ * @returns A pointer to the payload, or NULL if it cannot fit
+ */
+static void * _stp_bintrace_reserve (unsigned id, int numbytes)
+{
+	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	struct _stp_bintrace_hdr h;
+	void *ret;
+
+	if (unlikely(numbytes < 0
+		     || numbytes + STP_PBUF_HDR > STP_BUFFER_SIZE))
+		return NULL;
+
+	if (unlikely(pb->len + numbytes + STP_PBUF_HDR > STP_BUFFER_SIZE))
+		_stp_print_flush();
+
+	_stp_pbuf_close_text(pb);
+	h.id = id;
+	h.len = numbytes;
+	memcpy(pb->buf + pb->len, &h, sizeof(h));
+	ret = pb->buf + pb->len + STP_PBUF_HDR;
+	pb->len += STP_PBUF_HDR + numbytes;
+	_stp_pbuf_open_text(pb);
+	return ret;
+}
+
+/** Write one entry of the format table.
+ * These are written once at startup, and let stap-merge -b
+ * turn the records of format @a id back into text.
+ */
+static void _stp_bintrace_format (unsigned id, const char *desc, int len)
+{
+	uint16_t fid = id;
+	char *rec = _stp_bintrace_reserve(STP_BINTRACE_FORMAT,
+					  sizeof(fid) + len);
+
+	if (likely(rec != NULL)) {
+		memcpy(rec, &fid, sizeof(fid));
+		memcpy(rec + sizeof(fid), desc, len);
+	}
+}
+#endif
+
 /** Write 64-bit args directly into the output stream.
  * This function takes a variable number of 64-bit arguments
  * and writes them directly into the output stream.  Marginally faster
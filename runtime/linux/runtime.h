@@ -161,17 +161,7 @@ static struct
 
 #define _stp_seq_inc() (atomic_inc_return(&_stp_seq.seq))
 
-/* dwarf unwinder only tested so far on arm, i386, x86_64, ppc64 and s390x.
-   Only define STP_USE_DWARF_UNWINDER when STP_NEED_UNWIND_DATA,
-   as set through a pragma:unwind in one of the [u]context-unwind.stp
-   functions. */
-#if (defined(__arm__) || defined(__i386__) || defined(__x86_64__) || defined(__powerpc64__)) || defined (__s390x__) || defined(__aarch64__) || defined(__mips__)
-#ifdef STP_NEED_UNWIND_DATA
-#ifndef STP_USE_DWARF_UNWINDER
-#define STP_USE_DWARF_UNWINDER
-#endif
-#endif
-#endif
+#include "unwind_arch.h"
 
 // PR13489, inode-uprobes sometimes lacks the necessary SYMBOL_EXPORT's.
 #if !defined(STAPCONF_TASK_USER_REGSET_VIEW_EXPORTED)
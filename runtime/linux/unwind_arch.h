@@ -0,0 +1,26 @@
+/* -*- linux-c -*-
+ * Whether the DWARF unwinder is used
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _LINUX_UNWIND_ARCH_H_
+#define _LINUX_UNWIND_ARCH_H_
+
+/* dwarf unwinder only tested so far on arm, i386, x86_64, ppc64 and s390x.
+   Only define STP_USE_DWARF_UNWINDER when STP_NEED_UNWIND_DATA,
+   as set through a pragma:unwind in one of the [u]context-unwind.stp
+   functions.  Also included by the symbol data files of stap
+   --split-module, whose unwind tables depend on it. */
+#if (defined(__arm__) || defined(__i386__) || defined(__x86_64__) || defined(__powerpc64__)) || defined (__s390x__) || defined(__aarch64__) || defined(__mips__)
+#ifdef STP_NEED_UNWIND_DATA
+#ifndef STP_USE_DWARF_UNWINDER
+#define STP_USE_DWARF_UNWINDER
+#endif
+#endif
+#endif
+
+#endif /* _LINUX_UNWIND_ARCH_H_ */
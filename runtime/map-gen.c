@@ -802,8 +802,7 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int add, int s1, int s2, int s3, int s4, int s5)
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	struct map_cursor c;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
@@ -812,16 +811,16 @@ static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -2;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
+	_stp_map_mark_dirty(map, hv);
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hash_entry(n, c, map, hv) {
 		if (KEY_EQ_P(n)) {
 			return MAP_SET_VAL(map, n, val, add, s1, s2, s3, s4, s5);
 		}
 	}
 	/* key not found */
-	n = KEYSYM(get_map_node)(_new_map_create (map, head));
+	n = KEYSYM(get_map_node)(_new_map_create (map, hv));
 	if (n == NULL)
 		return -1;
 	KEYCPY(n);
@@ -842,17 +841,15 @@ static int KEYSYM(_stp_map_add) (MAP map, ALLKEYSD(key), VSTYPE val)
 static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	struct map_cursor c;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
 		return NULLRET;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hash_entry(n, c, map, hv) {
 		if (KEY_EQ_P(n)) {
 			return MAP_GET_VAL(n);
 		}
@@ -864,8 +861,7 @@ static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	struct map_cursor c;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
@@ -874,10 +870,9 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -1;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hash_entry(n, c, map, hv) {
 		if (KEY_EQ_P(n)) {
 			_new_map_del_node(map, &n->node);
 			return 0;
@@ -887,19 +882,18 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 	return 0;
 }
 
-static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* scaled */,
+static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* unscaled */,
                                       ALLKEYSD(key))
 {
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	struct map_cursor c;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
 		return -1;
 
-	head = &map->hashes[hv];
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hash_entry(n, c, map, hv) {
 		if (KEY_EQ_P(n)) {
+			_stp_map_mark_dirty(map, hv);
 			_new_map_del_node(map, &n->node);
 			return 0;
 		}
@@ -911,17 +905,15 @@ static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* scaled */,
 static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	struct map_cursor c;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
 		return 0;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hash_entry(n, c, map, hv) {
 		if (KEY_EQ_P(n)) {
 			return 1;
 		}
@@ -43,6 +43,113 @@ static int str_eq_p (char *key1, char *key2)
 }
 
 
+#ifdef STP_MAP_OPENADDR
+/* The open-addressing index.  Each used slot refers to a node by its
+ * position in node_mem, and each node remembers its slot, so removal
+ * never has to search. */
+
+static inline struct map_node *_stp_map_oa_node(MAP map, uint32_t idx)
+{
+	return (struct map_node *)(map->node_mem + idx * map->node_size);
+}
+
+static struct map_node *_stp_map_oa_probe(MAP map, struct map_cursor *c,
+					  uint32_t hv)
+{
+	struct map_bucket *b;
+	unsigned i;
+
+	while (1) {
+		b = &map->buckets[c->bucket];
+		while (c->slot < MAP_BUCKET_SLOTS) {
+			i = c->slot++;
+			if (b->node[i] && b->hash[i] == hv)
+				return _stp_map_oa_node(map, b->node[i] - 1);
+		}
+		if (b->overflow == 0 || ++c->probes > map->hash_table_mask)
+			return NULL;
+		c->bucket = (c->bucket + 1) & map->hash_table_mask;
+		c->slot = 0;
+	}
+}
+
+static struct map_node *_stp_map_oa_first(MAP map, struct map_cursor *c,
+					  uint32_t hv)
+{
+	c->bucket = hv & map->hash_table_mask;
+	c->slot = 0;
+	c->probes = 0;
+	return _stp_map_oa_probe(map, c, hv);
+}
+
+static void _stp_map_oa_insert(MAP map, struct map_node *m, uint32_t hv)
+{
+	unsigned bucket = hv & map->hash_table_mask;
+	uint32_t idx = ((void *)m - map->node_mem) / map->node_size;
+	struct map_bucket *b;
+	unsigned i;
+
+	/* HASHTABLESIZE() guarantees more slots than nodes, so this ends. */
+	while (1) {
+		b = &map->buckets[bucket];
+		for (i = 0; i < MAP_BUCKET_SLOTS; i++) {
+			if (b->node[i] == 0) {
+				b->hash[i] = hv;
+				b->node[i] = idx + 1;
+				m->hash = hv;
+				m->slot = bucket * MAP_BUCKET_SLOTS + i;
+				return;
+			}
+		}
+		b->overflow++;
+		bucket = (bucket + 1) & map->hash_table_mask;
+	}
+}
+
+/* Like _stp_map_oa_probe(), but finds every node whose hash value
+ * belongs in bucket home, starting from _stp_map_oa_first_home(). */
+static struct map_node *_stp_map_oa_probe_home(MAP map, struct map_cursor *c,
+					       unsigned home)
+{
+	struct map_bucket *b;
+	unsigned i;
+
+	while (1) {
+		b = &map->buckets[c->bucket];
+		while (c->slot < MAP_BUCKET_SLOTS) {
+			i = c->slot++;
+			if (b->node[i]
+			    && (b->hash[i] & map->hash_table_mask) == home)
+				return _stp_map_oa_node(map, b->node[i] - 1);
+		}
+		if (b->overflow == 0 || ++c->probes > map->hash_table_mask)
+			return NULL;
+		c->bucket = (c->bucket + 1) & map->hash_table_mask;
+		c->slot = 0;
+	}
+}
+
+static struct map_node *_stp_map_oa_first_home(MAP map, struct map_cursor *c,
+					       unsigned home)
+{
+	c->bucket = home;
+	c->slot = 0;
+	c->probes = 0;
+	return _stp_map_oa_probe_home(map, c, home);
+}
+
+static void _stp_map_oa_remove(MAP map, struct map_node *m)
+{
+	unsigned bucket = m->hash & map->hash_table_mask;
+	unsigned last = m->slot / MAP_BUCKET_SLOTS;
+
+	map->buckets[last].node[m->slot % MAP_BUCKET_SLOTS] = 0;
+	for (; bucket != last; bucket = (bucket + 1) & map->hash_table_mask)
+		map->buckets[bucket].overflow--;
+}
+#endif /* STP_MAP_OPENADDR */
+
+
 /** @addtogroup maps 
  * Implements maps (associative arrays) and lists
  * @{ 
@@ -108,8 +215,10 @@ static void _stp_map_clear(MAP map)
 	while (!mlist_empty(&map->head)) {
 		m = mlist_map_node(mlist_next(&map->head));
 
+#ifndef STP_MAP_OPENADDR
 		/* remove node from old hash list */
 		mhlist_del_init(&m->hnode);
+#endif
 
 		/* remove from entry list */
 		mlist_del(&m->lnode);
@@ -117,6 +226,16 @@ static void _stp_map_clear(MAP map)
 		/* add to free pool */
 		mlist_add(&m->lnode, &map->pool);
 	}
+
+#ifdef STP_MAP_OPENADDR
+	memset(map->buckets, 0,
+	       sizeof(struct map_bucket) * (map->hash_table_mask + 1));
+#endif
+#ifdef STP_PMAP_INCREMENTAL
+	if (map->dirty)
+		memset(map->dirty, 0, _stp_map_dirty_words(map) * sizeof(long));
+	map->dirty_all = 0;
+#endif
 }
 
 static void _stp_pmap_clear(PMAP pmap)
@@ -253,11 +372,81 @@ static void _stp_map_sort (MAP map, int keynum, int dir,
         } while (nmerges > 1);
 }
 
+#ifdef __KERNEL__
+/* Does heap entry a sort after b? */
+static int _stp_sort_after(struct map_sort_entry *a, struct map_sort_entry *b,
+			   int keynum, int dir, map_get_key_fn get_key)
+{
+	if (_stp_cmp(a->h, b->h, keynum, dir, get_key))
+		return 1;
+	if (_stp_cmp(b->h, a->h, keynum, dir, get_key))
+		return 0;
+	return a->seq > b->seq;
+}
+
+static void _stp_sort_sift_down(struct map_sort_entry *heap, int len, int i,
+				int keynum, int dir, map_get_key_fn get_key)
+{
+	struct map_sort_entry e = heap[i];
+	int c;
+
+	while ((c = 2 * i + 1) < len) {
+		if (c + 1 < len && _stp_sort_after(&heap[c + 1], &heap[c],
+						   keynum, dir, get_key))
+			c++;
+		if (!_stp_sort_after(&heap[c], &e, keynum, dir, get_key))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = e;
+}
+
+/* Move the top n elements to the start of the map, in order, with
+ * O(num * log n) comparisons.  The heap holds the best n seen so far,
+ * the one that sorts last at its root, so each further element only
+ * has to beat the root to get in. */
+static void _stp_map_sortn_heap(MAP map, int n, int keynum, int dir,
+				map_get_key_fn get_key)
+{
+	struct map_sort_entry *heap = map->sort_heap, e;
+	struct mlist_head *head = &map->head, *p;
+	int i, len = 0;
+
+	e.seq = 0;
+	for (p = mlist_next(head); p != head; p = mlist_next(p), e.seq++) {
+		e.h = p;
+		if (len < n) {
+			for (i = len++; i > 0; i = (i - 1) / 2) {
+				if (!_stp_sort_after(&e, &heap[(i - 1) / 2],
+						     keynum, dir, get_key))
+					break;
+				heap[i] = heap[(i - 1) / 2];
+			}
+			heap[i] = e;
+		} else if (_stp_sort_after(&heap[0], &e, keynum, dir, get_key)) {
+			heap[0] = e;
+			_stp_sort_sift_down(heap, len, 0, keynum, dir, get_key);
+		}
+	}
+
+	/* Pop them from the last to the first, each to the front. */
+	while (len > 0) {
+		p = heap[0].h;
+		heap[0] = heap[--len];
+		_stp_sort_sift_down(heap, len, 0, keynum, dir, get_key);
+		mlist_del(p);
+		mlist_add(p, head);
+	}
+}
+#endif /* __KERNEL__ */
+
 /** Get the top values from an array.
  * Sorts an array such that the start of the array contains the top
  * or bottom 'n' values. Use this when sorting the entire array
  * would be too time-consuming and you are only interested in the
- * highest or lowest values.
+ * highest or lowest values.  Maps given a heap by
+ * _stp_map_sortn_alloc() select them in O(num * log n).
  *
  * @param map Map
  * @param n Top (or bottom) number of elements. 0 sorts the entire array.
@@ -268,6 +457,12 @@ static void _stp_map_sort (MAP map, int keynum, int dir,
 static void _stp_map_sortn(MAP map, int n, int keynum, int dir,
 			   map_get_key_fn get_key)
 {
+#ifdef __KERNEL__
+	if (map->sort_heap && n > 0 && (unsigned)n < map->num) {
+		_stp_map_sortn_heap(map, n, keynum, dir, get_key);
+		return;
+	}
+#endif
 	if (n == 0 || n > 30) {
 		_stp_map_sort(map, keynum, dir, get_key);
 	} else {
@@ -313,18 +508,307 @@ static void _stp_map_sortn(MAP map, int n, int keynum, int dir,
 	}
 }
 
-static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
+static struct map_node *_stp_new_agg(MAP agg, uint32_t hv,
 				     struct map_node *ptr, map_update_fn update)
 {
 	struct map_node *aptr;
 	/* copy keys and aggregate */
-	aptr = _new_map_create(agg, ahead);
+	aptr = _new_map_create(agg, hv);
 	if (aptr == NULL)
 		return NULL;
 	(*update)(agg, aptr, ptr, 0);
 	return aptr;
 }
 
+/* Merge node ptr into agg.  hv is its unscaled hash value, or for
+ * chained maps just its hash bucket.  Returns nonzero if agg ran out
+ * of room. */
+static int _stp_map_merge_node (MAP agg, struct map_node *ptr, uint32_t hv,
+				map_update_fn update, map_cmp_fn cmp)
+{
+	struct map_node *aptr;
+#ifdef STP_MAP_OPENADDR
+	struct map_cursor c;
+
+	for (aptr = _stp_map_oa_first(agg, &c, hv); aptr;
+	     aptr = _stp_map_oa_probe(agg, &c, hv))
+		if ((*cmp)(ptr, aptr))
+			break;
+#else
+	struct mhlist_node *f;
+	int match = 0;
+
+	mhlist_for_each_entry(aptr, f, &agg->hashes[hv & agg->hash_table_mask],
+			      hnode) {
+		if ((*cmp)(ptr, aptr)) {
+			match = 1;
+			break;
+		}
+	}
+	if (!match)
+		aptr = NULL;
+#endif
+	if (aptr) {
+		(*update)(agg, aptr, ptr, 1);
+		return 0;
+	}
+	return _stp_new_agg(agg, hv, ptr, update) == NULL;
+}
+
+/* Merge the entries of map m into agg.  Returns nonzero if agg
+ * ran out of room. */
+static int _stp_map_merge (MAP agg, MAP m, map_update_fn update, map_cmp_fn cmp)
+{
+	struct map_node *ptr;
+#ifdef STP_MAP_OPENADDR
+	struct mlist_head *e;
+
+	for (e = mlist_next(&m->head); e != &m->head; e = mlist_next(e)) {
+		ptr = mlist_map_node(e);
+		if (_stp_map_merge_node(agg, ptr, ptr->hash, update, cmp))
+			return -1;
+	}
+#else
+	struct mhlist_node *e;
+	unsigned hash;
+
+	/* walk the hash chains. */
+	for (hash = 0; hash <= m->hash_table_mask; hash++) {
+		mhlist_for_each_entry(ptr, e, &m->hashes[hash], hnode) {
+			if (_stp_map_merge_node(agg, ptr, hash, update, cmp))
+				return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+#ifdef STP_PMAP_NODE_AGG
+/* Aggregating a large pmap from one cpu pulls every remote node's
+ * per-cpu maps across the interconnect.  Instead, one cpu on each node
+ * merges that node's maps into its node-local partial aggregate, all
+ * nodes in parallel, and the calling cpu merges the few partials.
+ *
+ * The other cpus are driven by IPI, which may only be waited for with
+ * interrupts enabled, so probes that run with them disabled (kprobes,
+ * timers, ...) keep aggregating serially.  Having preemption disabled
+ * while waiting also keeps the chosen cpus from going offline under us,
+ * since cpu hotplug needs to run stop_machine on every cpu. */
+
+#ifndef STP_PMAP_NODE_AGG_MIN
+#define STP_PMAP_NODE_AGG_MIN 4096	/* entries, below which it's not worth it */
+#endif
+
+struct _stp_pmap_node_req {
+	PMAP pmap;
+	map_update_fn update;
+	map_cmp_fn cmp;
+	atomic_t pending;		/* nodes still merging */
+	atomic_t failed;
+};
+
+static void _stp_pmap_node_merge (struct _stp_pmap_node_req *req, int node)
+{
+	MAP nagg = req->pmap->node_agg[node];
+	int i;
+
+	_stp_map_clear(nagg);
+	for_each_possible_cpu(i) {
+		if (cpu_to_node(i) != node)
+			continue;
+		if (_stp_map_merge(nagg, _stp_pmap_get_map(req->pmap, i),
+				   req->update, req->cmp)) {
+			atomic_inc(&req->failed);
+			break;
+		}
+	}
+}
+
+static void _stp_pmap_node_agg_fn (void *info)
+{
+	struct _stp_pmap_node_req *req = info;
+
+	_stp_pmap_node_merge(req, numa_node_id());
+	smp_mb();	/* publish the partial before signalling */
+	atomic_dec(&req->pending);
+}
+
+/** Aggregate a pmap node by node.
+ * @returns 0 on success, -ENOMEM if an aggregate filled up, or
+ * -EAGAIN if the caller should aggregate serially instead.
+ */
+static int _stp_pmap_node_agg (PMAP pmap, MAP agg, map_update_fn update,
+			       map_cmp_fn cmp)
+{
+	struct _stp_pmap_node_req req;
+	nodemask_t merged;
+	int i, node, this_node, entries = 0;
+
+	if (!pmap->node_agg_ok || irqs_disabled() || in_interrupt())
+		return -EAGAIN;
+
+	for_each_possible_cpu(i)
+		entries += _stp_pmap_get_map(pmap, i)->num;
+	if (entries < STP_PMAP_NODE_AGG_MIN)
+		return -EAGAIN;
+
+	req.pmap = pmap;
+	req.update = update;
+	req.cmp = cmp;
+	atomic_set(&req.failed, 0);
+
+	preempt_disable();
+	this_node = numa_node_id();
+	nodes_clear(merged);
+	cpumask_clear(&pmap->node_cpus);
+	for_each_online_node(node) {
+		unsigned cpu = cpumask_any_and(cpumask_of_node(node),
+					       cpu_online_mask);
+		if (cpu >= nr_cpu_ids || pmap->node_agg[node] == NULL)
+			continue;
+		node_set(node, merged);
+		if (node != this_node)
+			cpumask_set_cpu(cpu, &pmap->node_cpus);
+	}
+	atomic_set(&req.pending, cpumask_weight(&pmap->node_cpus));
+	smp_call_function_many(&pmap->node_cpus, _stp_pmap_node_agg_fn,
+			       &req, 0);
+	_stp_pmap_node_merge(&req, this_node);
+	while (atomic_read(&req.pending))
+		cpu_relax();
+	smp_rmb();
+	preempt_enable();
+
+	if (atomic_read(&req.failed))
+		return -ENOMEM;
+
+	/* The final merge: the partials, plus the maps of any cpus
+	 * on nodes that had no online cpu to merge them. */
+	for_each_node_mask(node, merged)
+		if (_stp_map_merge(agg, pmap->node_agg[node], update, cmp))
+			return -ENOMEM;
+	for_each_possible_cpu(i)
+		if (!node_isset(cpu_to_node(i), merged)
+		    && _stp_map_merge(agg, _stp_pmap_get_map(pmap, i),
+				      update, cmp))
+			return -ENOMEM;
+	return 0;
+}
+#endif /* STP_PMAP_NODE_AGG */
+
+#ifdef STP_PMAP_INCREMENTAL
+/* A script that prints the top entries of a large statistics array
+ * every second aggregates it again and again, while only part of it
+ * changes in between.  So writers mark the hash buckets they touch in
+ * their cpu's dirty bitmap, and the aggregate is kept up to date by
+ * redoing only those buckets: dropping their totals, then merging
+ * each cpu's entries for them again.  Deleting an entry marks its
+ * bucket too.  Anything else that loses entries (wrapping, a failed
+ * aggregation) sets dirty_all, and the next aggregation starts over. */
+
+/* Gather the dirty buckets of all cpus in the aggregate's bitmap,
+ * clearing theirs.  Returns nonzero if any cpu set dirty_all. */
+static int _stp_pmap_collect_dirty (PMAP pmap, MAP agg)
+{
+	unsigned w, words = _stp_map_dirty_words(agg);
+	int i, all = agg->dirty_all;
+
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map (pmap, i);
+		all |= m->dirty_all;
+		m->dirty_all = 0;
+		for (w = 0; w < words; w++) {
+			/* only write the cache lines that have bits set */
+			if (m->dirty[w]) {
+				agg->dirty[w] |= m->dirty[w];
+				m->dirty[w] = 0;
+			}
+		}
+	}
+	return all;
+}
+
+/* Recompute the aggregate's entries in hash bucket b. */
+static int _stp_pmap_agg_bucket (PMAP pmap, MAP agg, unsigned b,
+				 map_update_fn update, map_cmp_fn cmp)
+{
+	struct map_node *ptr;
+	int i;
+#ifdef STP_MAP_OPENADDR
+	struct map_cursor c;
+
+	/* removing the current node doesn't disturb the cursor */
+	for (ptr = _stp_map_oa_first_home(agg, &c, b); ptr;
+	     ptr = _stp_map_oa_probe_home(agg, &c, b))
+		_new_map_del_node(agg, ptr);
+
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map (pmap, i);
+		for (ptr = _stp_map_oa_first_home(m, &c, b); ptr;
+		     ptr = _stp_map_oa_probe_home(m, &c, b))
+			if (_stp_map_merge_node(agg, ptr, ptr->hash,
+						update, cmp))
+				return -1;
+	}
+#else
+	struct mhlist_node *e;
+
+	while (!hlist_empty(&agg->hashes[b]))
+		_new_map_del_node(agg, hlist_entry(agg->hashes[b].first,
+						   struct map_node, hnode));
+
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map (pmap, i);
+		mhlist_for_each_entry(ptr, e, &m->hashes[b], hnode) {
+			if (_stp_map_merge_node(agg, ptr, b, update, cmp))
+				return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/** Update the aggregate from the dirty buckets.
+ * @returns 0 on success, -ENOMEM if the aggregate filled up, or
+ * -EAGAIN if the caller should aggregate from scratch instead.
+ */
+static int _stp_pmap_agg_dirty (PMAP pmap, MAP agg, map_update_fn update,
+				map_cmp_fn cmp)
+{
+	unsigned b, nbuckets = agg->hash_table_mask + 1;
+	int rc = 0;
+
+	if (_stp_pmap_collect_dirty(pmap, agg))
+		rc = -EAGAIN;
+
+	for (b = find_first_bit(agg->dirty, nbuckets); rc == 0 && b < nbuckets;
+	     b = find_next_bit(agg->dirty, nbuckets, b + 1))
+		if (_stp_pmap_agg_bucket(pmap, agg, b, update, cmp))
+			rc = -ENOMEM;
+	memset(agg->dirty, 0, _stp_map_dirty_words(agg) * sizeof(long));
+
+	/* A wrapping aggregate may have dropped a clean entry for room. */
+	if (rc == 0 && agg->dirty_all)
+		rc = -EAGAIN;
+	if (rc == -ENOMEM)
+		agg->dirty_all = 1;
+	return rc;
+}
+#endif /* STP_PMAP_INCREMENTAL */
+
+static int _stp_pmap_merge_cpus (PMAP pmap, MAP agg, map_update_fn update,
+				 map_cmp_fn cmp)
+{
+	int i;
+
+	for_each_possible_cpu(i) {
+		if (_stp_map_merge(agg, _stp_pmap_get_map (pmap, i),
+				   update, cmp))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
 /** Aggregate per-cpu maps.
  * This function aggregates the per-cpu maps into an aggregated
  * map. A pointer to that aggregated map is returned.
@@ -336,52 +820,38 @@ static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
  */
 static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
 {
-	int i, hash;
-	MAP m, agg;
-	struct map_node *ptr, *aptr = NULL;
-	struct mhlist_head *head, *ahead;
-	struct mhlist_node *e, *f;
-	int quit = 0;
+	MAP agg;
+	int rc;
 
 	agg = _stp_pmap_get_agg(pmap);
 
-        /* FIXME. we either clear the aggregation map or clear each local map */
-	/* every time we aggregate. which would be best? */
-	_stp_map_clear (agg);
+#ifdef STP_PMAP_INCREMENTAL
+	rc = _stp_pmap_agg_dirty(pmap, agg, update, cmp);
+	if (rc != -EAGAIN)
+		return rc ? NULL : agg;
+#endif
 
-	for_each_possible_cpu(i) {
-		m = _stp_pmap_get_map (pmap, i);
-		/* walk the hash chains. */
-		for (hash = 0; hash <= m->hash_table_mask; hash++) {
-			head = &m->hashes[hash];
-			ahead = &agg->hashes[hash];
-			mhlist_for_each_entry(ptr, e, head, hnode) {
-				int match = 0;
-				mhlist_for_each_entry(aptr, f, ahead, hnode) {
-					if ((*cmp)(ptr, aptr)) {
-						match = 1;
-						break;
-					}
-				}
-				if (match)
-					(*update)(agg, aptr, ptr, 1);
-				else {
-					if (!_stp_new_agg(agg, ahead, ptr, update)) {
-                                                agg = NULL;
-						goto out;
-                                                // NB: break would head out to the for (hash...) 
-                                                // loop, which behaves badly with an agg==NULL.
-					}
-				}
-			}
-		}
-	}
+	/* Start over from the per-cpu maps. */
+	_stp_map_clear (agg);
 
-out:
-	return agg;
+#ifdef STP_PMAP_NODE_AGG
+	rc = _stp_pmap_node_agg(pmap, agg, update, cmp);
+	if (rc == -EAGAIN)
+		rc = _stp_pmap_merge_cpus(pmap, agg, update, cmp);
+#else
+	rc = _stp_pmap_merge_cpus(pmap, agg, update, cmp);
+#endif
+
+#ifdef STP_PMAP_INCREMENTAL
+	/* Only a complete aggregate can be updated next time. */
+	if (rc)
+		agg->dirty_all = 1;
+#endif
+	return rc ? NULL : agg;
 }
 
-static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
+/* hv is the unscaled hash value of the new node's keys */
+static struct map_node *_new_map_create (MAP map, uint32_t hv)
 {
 	struct map_node *m;
 	if (mlist_empty(&map->pool)) {
@@ -390,22 +860,37 @@ static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
 			return NULL;
 		}
 		m = mlist_map_node(mlist_next(&map->head));
+#ifdef STP_MAP_OPENADDR
+		_stp_map_oa_remove(map, m);
+#else
 		mhlist_del_init(&m->hnode);
+#endif
+#ifdef STP_PMAP_INCREMENTAL
+		map->dirty_all = 1;
+#endif
 	} else {
 		m = mlist_map_node(mlist_next(&map->pool));
 		map->num++;
 	}
 	mlist_move_tail(&m->lnode, &map->head);
 
+#ifdef STP_MAP_OPENADDR
+	_stp_map_oa_insert(map, m, hv);
+#else
 	/* add node to new hash list */
-	mhlist_add_head(&m->hnode, head);
+	mhlist_add_head(&m->hnode, &map->hashes[hv & map->hash_table_mask]);
+#endif
 	return m;
 }
 
 static void _new_map_del_node (MAP map, struct map_node *n)
 {
+#ifdef STP_MAP_OPENADDR
+	_stp_map_oa_remove(map, n);
+#else
 	/* remove node from old hash list */
 	mhlist_del_init(&n->hnode);
+#endif
 
 	/* remove from entry list */
 	mlist_del(&n->lnode);
@@ -456,10 +941,12 @@ static int _new_map_set_stat (MAP map, struct stat_data *sd, int64_t val, int ad
 static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data *sd2, int add)
 {
 	Hist st = &map->hist;
+#ifdef STP_NEED_STAT_VARIANCE
 	int64_t S11, S12, S21, S22;
 	int64_t sd1_count, sd1_avg_s;
 	S11 = S12 = S21 = S22 = 0;
 	sd1_count = sd1_avg_s = 0;
+#endif
 
         if (sd2 == NULL) {
                 sd1->count = 0;
@@ -469,8 +956,10 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
                                 sd1->histogram[j] = 0;
                 }
         } else if (add && sd1->count > 0 && sd2->count > 0) {
+#ifdef STP_NEED_STAT_VARIANCE
 		sd1_count = sd1->count;
 		sd1_avg_s = sd1->avg_s;
+#endif
 
 		sd1->count += sd2->count;
 		sd1->sum += sd2->sum;
@@ -479,6 +968,7 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
 		if (sd2->max > sd1->max)
 			sd1->max = sd2->max;
 
+#ifdef STP_NEED_STAT_VARIANCE
                 if (sd2->stat_ops & STAT_OP_VARIANCE) {
                         sd1->shift = sd2->shift;
                         sd1->avg_s = _stp_div64(NULL, sd1->sum << sd2->shift, sd1->count);
@@ -498,6 +988,7 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
                         sd1->variance_s = _stp_div64(NULL, (S11 + S12 + S21 + S22), (sd1->count - 1));
                         sd1->variance = sd1->variance_s >> (2 * sd2->shift);
                 }
+#endif
 		if (st->type != HIST_NONE) {
 			int j;
 			for (j = 0; j < st->buckets; j++)
@@ -508,12 +999,14 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
 		sd1->sum = sd2->sum;
 		sd1->min = sd2->min;
 		sd1->max = sd2->max;
+#ifdef STP_NEED_STAT_VARIANCE
                 if (sd2->stat_ops & STAT_OP_VARIANCE) {
                         sd1->shift = sd2->shift;
                         sd1->avg_s = sd2->avg_s;
                         sd1->variance_s = sd2->variance_s;
                         sd1->variance = sd2->variance_s >> (2 * sd2->shift);
                 }
+#endif
 		if (st->type != HIST_NONE) {
 			int j;
 			for (j = 0; j < st->buckets; j++)
@@ -30,7 +30,23 @@
 #define MAPHASHBIAS 0
 #endif
 
+/* The open-addressing index is only implemented for the kernel runtime. */
+#if defined(STP_MAP_OPENADDR) && !defined(__KERNEL__)
+#undef STP_MAP_OPENADDR
+#endif
+
+#ifdef STP_MAP_OPENADDR
+/* Number of entries in one cache-line sized bucket of the index. */
+#define MAP_BUCKET_SLOTS 7
+
+/* Enough buckets to keep the index less than half full.  Every entry
+   must find a free slot, so MAPHASHBIAS may only make it bigger. */
+#define HASHTABLESIZE(entries) \
+	(1 << (ilog2(max_t(int, 2*(entries)/MAP_BUCKET_SLOTS, 1)) + 1 \
+	       + max_t(int, MAPHASHBIAS, 0)))
+#else
 #define HASHTABLESIZE(entries) (1 << max_t(int, ilog2(entries)+MAPHASHBIAS, 1))
+#endif
 /* NB: a power of two, since we truncate hv with & rather than % */
 
 
@@ -72,12 +88,51 @@ struct map_node {
 	/* list of other nodes in the map */
 	struct mlist_head lnode;
 
+#ifdef STP_MAP_OPENADDR
+	/* unscaled hash value, and where the index refers to this node */
+	uint32_t hash;
+	uint32_t slot;
+#else
 	/* list of nodes with the same hash value */
 	struct mhlist_node hnode;
+#endif
+};
+
+#ifdef STP_MAP_OPENADDR
+/* One bucket of the open-addressing index.  Lookups compare the
+ * packed hash values first, and only touch a node on a match.  A full
+ * bucket spills into the next one (linear probing); "overflow" counts
+ * the entries that did so, and a lookup can stop at a bucket where it
+ * is zero. */
+struct map_bucket {
+	uint32_t hash[MAP_BUCKET_SLOTS];
+	uint32_t node[MAP_BUCKET_SLOTS]; /* node index + 1, 0 if free */
+	uint32_t overflow;
+	uint32_t unused;
+} __attribute__((aligned(64)));
+
+/* position of a lookup in the index, see map_for_each_hash_entry */
+struct map_cursor {
+	unsigned bucket;
+	unsigned slot;
+	unsigned probes;
+};
+#else
+struct map_cursor {
+	struct mhlist_node *e;
 };
+#endif
 
 #define mlist_map_node(head) mlist_entry((head), struct map_node, lnode)
 
+#ifdef __KERNEL__
+/* An entry of the heap that _stp_map_sortn() selects the top n with. */
+struct map_sort_entry {
+	struct mlist_head *h;
+	unsigned long seq;	/* position in the list, to keep ties in order */
+};
+#endif
+
 /* This structure contains all information about a map.
  * It is allocated once when _stp_map_new() is called. 
  */
@@ -99,6 +154,20 @@ struct map_root {
 
 #ifdef __KERNEL__
 	void *node_mem;
+
+	/* For the per-cpu maps of a pmap, the hash buckets written since
+	 * the last aggregation, and whether entries were lost in ways
+	 * the buckets don't tell (wrapping).  For its aggregate map, the
+	 * buckets being redone, and whether it has to be rebuilt from
+	 * scratch.  See _stp_pmap_agg(). */
+	unsigned long *dirty;
+	int dirty_all;
+
+	/* maxnum entries, for maps that foreach sorts with a limit */
+	struct map_sort_entry *sort_heap;
+#endif
+#ifdef STP_MAP_OPENADDR
+	unsigned node_size;
 #endif
 
 	/* linked list of current entries */
@@ -112,7 +181,11 @@ struct map_root {
 
 	/* the hash table for this array */
         unsigned hash_table_mask;
+#ifdef STP_MAP_OPENADDR
+	struct map_bucket buckets[0]; /* dynamically allocated at tail */
+#else
 	struct mhlist_head hashes[0]; /* dynamically allocated at tail */
+#endif
 };
 
 /** All maps are of this type. */
@@ -137,6 +210,21 @@ typedef int (*map_cmp_fn)(struct map_node *dst, struct map_node *src);
 #define foreach(map, ptr)						\
 	for (ptr = _stp_map_start(map); ptr; ptr = _stp_map_iter (map, ptr))
 
+/** Loop through the elements of a map that may match an (unscaled)
+ * hash value.  The caller still has to compare the keys.
+ * @param ptr pointer to a KEYSYM(map_node)
+ * @param c a struct map_cursor
+ */
+#ifdef STP_MAP_OPENADDR
+#define map_for_each_hash_entry(ptr, c, map, hv)			\
+	for (ptr = (void *)_stp_map_oa_first(map, &(c), hv); ptr;	\
+	     ptr = (void *)_stp_map_oa_probe(map, &(c), hv))
+#else
+#define map_for_each_hash_entry(ptr, c, map, hv)			\
+	mhlist_for_each_entry(ptr, (c).e,				\
+		&(map)->hashes[(hv) & (map)->hash_table_mask], node.hnode)
+#endif
+
 /** @} */
 
 
@@ -146,6 +234,10 @@ typedef int (*map_cmp_fn)(struct map_node *dst, struct map_node *src);
 #include "dyninst/map_runtime.h"
 #endif
 
+#ifndef STP_PMAP_INCREMENTAL
+#define _stp_map_mark_dirty(map, hv) do { } while (0)
+#endif
+
 
 /** @cond DONT_INCLUDE */
 /************* prototypes for map.c ****************/
@@ -166,7 +258,7 @@ static struct map_node * _stp_map_iter(MAP map, struct map_node *m);
 static void _stp_map_del(MAP map);
 static void _stp_map_clear(MAP map);
 
-static struct map_node *_new_map_create (MAP map, struct mhlist_head *head);
+static struct map_node *_new_map_create (MAP map, uint32_t hv);
 static int _new_map_set_int64 (MAP map, int64_t *dst, int64_t val, int add);
 static int _new_map_set_str (MAP map, char* dst, char *val, int add);
 static void _new_map_del_node (MAP map, struct map_node *n);
@@ -177,11 +269,15 @@ static PMAP _stp_pmap_new_hstat_log (unsigned max_entries, int wrap, int node_si
 static PMAP _stp_pmap_new_hstat (unsigned max_entries, int wrap, int node_size);
 static void _stp_pmap_del(PMAP pmap);
 static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp);
-static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
+static struct map_node *_stp_new_agg(MAP agg, uint32_t hv,
 				     struct map_node *ptr, map_update_fn update);
 static int _new_map_set_stat (MAP map, struct stat_data *dst, int64_t val, int add, int s1, int s2, int s3, int s4, int s5);
 static int _new_map_copy_stat (MAP map, struct stat_data *dst, struct stat_data *src, int add);
 static void _stp_map_sort (MAP map, int keynum, int dir, map_get_key_fn get_key);
 static void _stp_map_sortn(MAP map, int n, int keynum, int dir, map_get_key_fn get_key);
+#ifdef STP_MAP_OPENADDR
+static struct map_node *_stp_map_oa_first(MAP map, struct map_cursor *c, uint32_t hv);
+static struct map_node *_stp_map_oa_probe(MAP map, struct map_cursor *c, uint32_t hv);
+#endif
 /** @endcond */
 #endif /* _MAP_H_ */
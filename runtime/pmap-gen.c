@@ -137,10 +137,36 @@ static void KEYSYM(pmap_update_node) (MAP m, struct map_node *m1, struct map_nod
 }
 
 #if VALUE_TYPE == INT64 || VALUE_TYPE == STRING
-static PMAP KEYSYM(_stp_pmap_new) (unsigned max_entries, int wrap)
+/*
+ * _stp_pmap_new* ()
+ * @param max_entries (KEY_MAPENTRIES and associated parameter)
+ * @param wrap (KEY_STAT_WRAP)
+ */
+static PMAP KEYSYM(_stp_pmap_new) (int first_arg, ...)
 {
-	PMAP pmap = _stp_pmap_new (max_entries, wrap,
-				   sizeof(struct KEYSYM(map_node)));
+	int max_entries=0, wrap=0;
+	int arg = first_arg;
+	PMAP pmap;
+	va_list ap;
+
+	va_start (ap, first_arg);
+	do {
+		switch (arg) {
+		case KEY_MAPENTRIES:
+			max_entries = va_arg(ap, int);
+			break;
+		case KEY_STAT_WRAP:
+			wrap = 1;
+			break;
+		default:
+			_stp_warn ("Unknown argument %d\n", arg);
+		}
+		arg = va_arg(ap, int);
+	} while (arg);
+	va_end (ap);
+
+	pmap = _stp_pmap_new (max_entries, wrap,
+			      sizeof(struct KEYSYM(map_node)));
 	return pmap;
 }
 #else
@@ -230,10 +256,28 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 
 #endif /* VALUE_TYPE */
 
+/* Replace the value of a key.  Any partial values held by the other
+ * cpus are dropped, so that the next aggregation yields exactly val.
+ * This touches every cpu's map, so it needs an exclusive lock. */
 static int KEYSYM(_stp_pmap_set) (PMAP pmap, ALLKEYSD(key), VSTYPE val)
 {
-	int res;
-	MAP m = _stp_pmap_get_map (pmap, MAP_GET_CPU());
+	unsigned int hv;
+	int res, cpu, this_cpu;
+	MAP m;
+
+	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
+		return -2;
+	hv = KEYSYM(hash) (ALLKEYS(key));
+
+	this_cpu = MAP_GET_CPU();
+	for_each_possible_cpu(cpu) {
+		if (cpu == this_cpu)
+			continue;
+		m = _stp_pmap_get_map (pmap, cpu);
+		(void)KEYSYM(_stp_map_del_hash) (m, hv, ALLKEYS(key));
+	}
+
+	m = _stp_pmap_get_map (pmap, this_cpu);
 	res = KEYSYM(__stp_map_set) (m, ALLKEYS(key), val, 0, 1, 1, 1, 1, 1);
         MAP_PUT_CPU();
 	return res;
@@ -254,16 +298,14 @@ static inline int KEYSYM(_stp_pmap_add) (PMAP pmap, ALLKEYSD(key), VSTYPE val, i
 static VALTYPE KEYSYM(_stp_pmap_get_cpu) (PMAP pmap, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	struct map_cursor c;
 	struct KEYSYM(map_node) *n;
 	VALTYPE res;
 	MAP map;
 
 	map = _stp_pmap_get_map (pmap, MAP_GET_CPU());
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	hv = KEYSYM(hash) (ALLKEYS(key));
+	map_for_each_hash_entry(n, c, map, hv) {
 		if (KEY_EQ_P(n)) {
 			res = MAP_GET_VAL(n);
 			MAP_PUT_CPU();
@@ -279,8 +321,7 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 {
 	unsigned int hv;
 	int cpu, clear_agg = 0;
-	struct mhlist_head *head, *ahead;
-	struct mhlist_node *e;
+	struct map_cursor c;
 	struct KEYSYM(map_node) *n;
 	struct map_node *anode = NULL;
 	MAP map, agg;
@@ -289,8 +330,7 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 
 	/* first look it up in the aggregation map */
 	agg = _stp_pmap_get_agg(pmap);
-	ahead = &agg->hashes[hv & agg->hash_table_mask];
-	mhlist_for_each_entry(n, e, ahead, node.hnode) {
+	map_for_each_hash_entry(n, c, agg, hv) {
 		if (KEY_EQ_P(n)) {
 			anode = &n->node;
 			clear_agg = 1;
@@ -301,11 +341,10 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 	/* now total each cpu */
 	for_each_possible_cpu(cpu) {
 		map = _stp_pmap_get_map (pmap, cpu);
-		head = &map->hashes[hv & map->hash_table_mask];
-		mhlist_for_each_entry(n, e, head, node.hnode) {
+		map_for_each_hash_entry(n, c, map, hv) {
 			if (KEY_EQ_P(n)) {
 				if (anode == NULL) {
-					anode = _stp_new_agg(agg, ahead, &n->node,
+					anode = _stp_new_agg(agg, hv, &n->node,
 							     KEYSYM(pmap_update_node));
 				} else {
 					if (clear_agg) {
@@ -324,6 +363,27 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 	return NULLRET;
 }
 
+/* returns 1 if any cpu holds the key, 0 otherwise */
+static int KEYSYM(_stp_pmap_exists) (PMAP pmap, ALLKEYSD(key))
+{
+	unsigned int hv;
+	int cpu;
+	struct map_cursor c;
+	struct KEYSYM(map_node) *n;
+	MAP map;
+
+	hv = KEYSYM(hash) (ALLKEYS(key));
+	for_each_possible_cpu(cpu) {
+		map = _stp_pmap_get_map (pmap, cpu);
+		map_for_each_hash_entry(n, c, map, hv) {
+			if (KEY_EQ_P(n))
+				return 1;
+		}
+	}
+	/* key not found */
+	return 0;
+}
+
 static MAP KEYSYM(_stp_pmap_agg) (PMAP pmap)
 {
 	return _stp_pmap_agg(pmap, KEYSYM(pmap_update_node),
@@ -344,12 +404,12 @@ static int KEYSYM(_stp_pmap_del) (PMAP pmap, ALLKEYSD(key))
 	/* Delete in each cpu's map */
 	for_each_possible_cpu(cpu) {
 		m = _stp_pmap_get_map (pmap, cpu);
-		(void)KEYSYM(_stp_map_del_hash) (m, hv & m->hash_table_mask,
-                                                 ALLKEYS(key));
+		(void)KEYSYM(_stp_map_del_hash) (m, hv, ALLKEYS(key));
 	}
 
-	/* Note that we don't need to delete the aggregate's value,
-	 * since it isn't "live" between statements. */
+	/* The aggregate's value stays for now: deleting from a cpu's
+	 * map marks the key's bucket dirty, and the next aggregation
+	 * rebuilds that bucket of the aggregate without it. */
 	return 1;
 }
 
@@ -20,15 +20,25 @@ static STP_DEFINE_SPINLOCK(_stp_print_lock);
 
 void stp_print_flush(_stp_pbuf *pb)
 {
-	size_t len = pb->len;
+	size_t len;
 	void *entry = NULL;
 
+#ifdef STP_BINARY_TRACE
+	/* Send whole records only, and start over with an open
+	 * text record. */
+	_stp_pbuf_close_text(pb);
+	len = pb->len;
+	pb->len = 0;
+	_stp_pbuf_open_text(pb);
+#else
+	len = pb->len;
+	pb->len = 0;
+#endif
+
 	/* check to see if there is anything in the buffer */
 	if (likely(len == 0))
 		return;
 
-	pb->len = 0;
-
 	if (unlikely(_stp_transport_get_state() != STP_TRANSPORT_RUNNING))
 		return;
 
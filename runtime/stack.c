@@ -627,10 +627,11 @@ static void _stp_stack_kernel_sprint(char *str, int size, struct context* c,
 	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
 	_stp_print_flush();
 
-	_stp_stack_kernel_print(c, sym_flags);
+	_stp_stack_kernel_print(c, sym_flags | _STP_SYM_NO_DEFER);
 
-	strlcpy(str, pb->buf, size < (int)pb->len ? size : (int)pb->len);
-	pb->len = 0;
+	strlcpy(str, pb->buf + STP_PBUF_HDR,
+		size < (int)(pb->len - STP_PBUF_HDR) ? size : (int)(pb->len - STP_PBUF_HDR));
+	pb->len = STP_PBUF_HDR;
 }
 
 static void _stp_stack_user_sprint(char *str, int size, struct context* c,
@@ -644,10 +645,11 @@ static void _stp_stack_user_sprint(char *str, int size, struct context* c,
 	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
 	_stp_print_flush();
 
-	_stp_stack_user_print(c, sym_flags);
+	_stp_stack_user_print(c, sym_flags | _STP_SYM_NO_DEFER);
 
-	strlcpy(str, pb->buf, size < (int)pb->len ? size : (int)pb->len);
-	pb->len = 0;
+	strlcpy(str, pb->buf + STP_PBUF_HDR,
+		size < (int)(pb->len - STP_PBUF_HDR) ? size : (int)(pb->len - STP_PBUF_HDR));
+	pb->len = STP_PBUF_HDR;
 }
 
 #endif /* _STACK_C_ */
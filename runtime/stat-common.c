@@ -293,24 +293,29 @@ static inline void __stp_stat_add(Hist st, stat_data *sd, int64_t val,
 				  int stat_op_max, int stat_op_variance)
 {
 	int n;
+#ifdef STP_NEED_STAT_VARIANCE
 	int delta = 0;
+#endif
 
 	sd->shift = st->bit_shift;
 	sd->stat_ops = st->stat_ops;
 	if (sd->count == 0) {
 		sd->count = 1;
 		sd->sum = sd->min = sd->max = val;
+#ifdef STP_NEED_STAT_VARIANCE
 		sd->avg_s = val << sd->shift;
 		sd->_M2 = 0;
+#endif
 	} else {
 		if(stat_op_count)
 			sd->count++;
 		if(stat_op_sum)
 			sd->sum += val;
-		if (stat_op_min && (val > sd->max))
+		if (stat_op_max && (val > sd->max))
 			sd->max = val;
-		if (stat_op_max && (val < sd->min))
+		if (stat_op_min && (val < sd->min))
 			sd->min = val;
+#ifdef STP_NEED_STAT_VARIANCE
 		/*
 		 * Below, we use Welford's online algorithm for computing variance.
 		 * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance
@@ -321,6 +326,7 @@ static inline void __stp_stat_add(Hist st, stat_data *sd, int64_t val,
 		    sd->_M2 += delta * ((val << sd->shift) - sd->avg_s);
 		    sd->variance_s = (sd->count < 2) ? -1 : _stp_div64(NULL, sd->_M2, (sd->count - 1));
 		}
+#endif
 	}
 
 	switch (st->type) {
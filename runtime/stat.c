@@ -160,7 +160,9 @@ static void _stp_stat_clear_data (Stat st, stat_data *sd)
 {
         int j;
         sd->count = sd->sum = sd->min = sd->max = 0;
+#ifdef STP_NEED_STAT_VARIANCE
         sd->avg_s = sd->variance = sd->variance_s = 0;
+#endif
 
         if (st->hist.type != HIST_NONE) {
                 for (j = 0; j < st->hist.buckets; j++)
@@ -179,12 +181,13 @@ static void _stp_stat_clear_data (Stat st, stat_data *sd)
 static stat_data *_stp_stat_get (Stat st, int clear)
 {
 	int i, j;
-	int64_t S1, S2;
+#ifdef STP_NEED_STAT_VARIANCE
+	int64_t S1 = 0, S2 = 0;
+#endif
 	stat_data *agg = _stp_stat_get_agg(st);
 	stat_data *sd;
 	STAT_LOCK(agg);
 	_stp_stat_clear_data (st, agg);
-	S1 = S2 = 0;
 
 	for_each_possible_cpu(i) {
 		stat_data *sd = _stp_stat_per_cpu_ptr (st, i);
@@ -209,7 +212,9 @@ static stat_data *_stp_stat_get (Stat st, int clear)
 		STAT_UNLOCK(sd);
 	}
 
+#ifdef STP_NEED_STAT_VARIANCE
 	agg->avg_s = _stp_div64(NULL, agg->sum << agg->shift, agg->count);
+#endif
 
 	/*
 	 * For aggregating variance over available CPUs, the Total Variance
@@ -221,17 +226,21 @@ static stat_data *_stp_stat_get (Stat st, int clear)
 	for_each_possible_cpu(i) {
 		sd = _stp_stat_per_cpu_ptr (st, i);
 		STAT_LOCK(sd);
+#ifdef STP_NEED_STAT_VARIANCE
 		if (sd->count) {
 			S1 += sd->count * (sd->avg_s - agg->avg_s) * (sd->avg_s - agg->avg_s);
 			S2 += (sd->count - 1) * sd->variance_s;
 		}
+#endif
 		if (clear)
 			_stp_stat_clear_data (st, sd);
 		STAT_UNLOCK(sd);
 	}
 
+#ifdef STP_NEED_STAT_VARIANCE
 	agg->variance_s = _stp_div64(NULL, (S1 + S2), (agg->count - 1));
 	agg->variance = agg->variance_s >> (2 * agg->shift);
+#endif
 
 	/*
 	 * Originally this function returned the aggregate still
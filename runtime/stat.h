@@ -37,18 +37,28 @@
 /** histogram type */
 enum histtype { HIST_NONE, HIST_LOG, HIST_LINEAR };
 
+/* The translator defines STP_NEED_STAT_VARIANCE when some statistic
+   uses @variance.  The -t timing reports include variance too. */
+#if defined(STP_TIMING) && !defined(STP_NEED_STAT_VARIANCE)
+#define STP_NEED_STAT_VARIANCE 1
+#endif
+
 /** Statistics are stored in this struct.  This is per-cpu or per-node data 
-    and is variable length due to the unknown size of the histogram. */
+    and is variable length due to the unknown size of the histogram.
+    The state for Welford's variance algorithm is left out entirely
+    unless STP_NEED_STAT_VARIANCE is defined. */
 struct stat_data {
 	int shift;
 	int stat_ops;
 	int64_t count;
 	int64_t sum;
 	int64_t min, max;
+#ifdef STP_NEED_STAT_VARIANCE
 	int64_t avg_s;
 	int64_t _M2;
 	int64_t variance;
 	int64_t variance_s;
+#endif
 	int64_t histogram[];
 };
 typedef struct stat_data stat_data;
@@ -100,12 +100,175 @@ static unsigned long _stp_umodule_relocate(const char *path,
   return 0;
 }
 
+/* The kernel modules' sections that are in memory, sorted by address,
+   for _stp_kmod_sec_lookup() to binary search.  It is kept up to date
+   by _stp_kmodule_update_address().  Lookups may come from any context,
+   so rather than wait for a writer, they check the sequence count and
+   fall back to scanning _stp_modules[] if the index changed under
+   them. */
+struct _stp_kmod_range {
+	unsigned long addr, end;
+	unsigned long maxend; /* of this and all the lower ranges */
+	struct _stp_module *mod;
+	struct _stp_section *sec;
+};
+
+static struct _stp_kmod_range *_stp_kmod_index;
+static unsigned _stp_kmod_index_num;
+static unsigned _stp_kmod_index_seq; /* odd while being changed */
+static DEFINE_SPINLOCK(_stp_kmod_index_lock);
+
+/* The index entry each cpu found last, since backtraces and repeated
+   samples tend to hit the same few sections again. */
+static DEFINE_PER_CPU(unsigned, _stp_kmod_last_hit);
+
+/* Put the section at its place in the index, or take it out if it
+   isn't in memory (any more). */
+static void _stp_kmod_index_update(struct _stp_module *m,
+				   struct _stp_section *s)
+{
+  struct _stp_kmod_range *r = _stp_kmod_index;
+  unsigned long flags;
+  unsigned i, n;
+
+  if (r == NULL)
+    return;
+
+  spin_lock_irqsave(&_stp_kmod_index_lock, flags);
+  _stp_kmod_index_seq++;
+  smp_wmb();
+
+  n = _stp_kmod_index_num;
+  for (i = 0; i < n; i++)
+    if (r[i].sec == s)
+      {
+	memmove(&r[i], &r[i + 1], (n - i - 1) * sizeof(*r));
+	n--;
+	break;
+      }
+
+  if (s->static_addr != 0 && s->size != 0)
+    {
+      for (i = n; i > 0 && r[i - 1].addr > s->static_addr; i--)
+	r[i] = r[i - 1];
+      r[i].addr = s->static_addr;
+      r[i].end = s->static_addr + s->size;
+      r[i].mod = m;
+      r[i].sec = s;
+      n++;
+    }
+  for (i = 0; i < n; i++)
+    r[i].maxend = max(r[i].end, i ? r[i - 1].maxend : 0UL);
+  _stp_kmod_index_num = n;
+
+  smp_wmb();
+  _stp_kmod_index_seq++;
+  spin_unlock_irqrestore(&_stp_kmod_index_lock, flags);
+}
+
+/* Set up the index once _stp_module_self knows where it is.  Without
+   it, lookups just scan the modules. */
+static void _stp_kmod_index_init(void)
+{
+  unsigned mi, si, n = 0;
+
+  for (mi = 0; mi < _stp_num_modules; mi++)
+    n += _stp_modules[mi]->num_sections;
+  if (n == 0)
+    return;
+
+  _stp_kmod_index = _stp_kzalloc(n * sizeof(struct _stp_kmod_range));
+  if (_stp_kmod_index == NULL)
+    return;
+
+  for (mi = 0; mi < _stp_num_modules; mi++)
+    for (si = 0; si < _stp_modules[mi]->num_sections; si++)
+      _stp_kmod_index_update(_stp_modules[mi], &_stp_modules[mi]->sections[si]);
+}
+
+static void _stp_kmod_index_free(void)
+{
+  unsigned long flags;
+  struct _stp_kmod_range *r;
+
+  spin_lock_irqsave(&_stp_kmod_index_lock, flags);
+  r = _stp_kmod_index;
+  _stp_kmod_index = NULL;
+  _stp_kmod_index_num = 0;
+  spin_unlock_irqrestore(&_stp_kmod_index_lock, flags);
+  _stp_kfree(r);
+}
+
+/* Look addr up in the index.  Returns 1 and the range's index in *hit
+   if found, 0 if not, -1 if the index can't tell right now. */
+static int _stp_kmod_index_lookup(unsigned long addr, unsigned *hit,
+				  struct _stp_module **m,
+				  struct _stp_section **sec)
+{
+  struct _stp_kmod_range *r;
+  unsigned seq, n, begin = 0, end;
+  int found = 0;
+
+  seq = _stp_kmod_index_seq;
+  smp_rmb();
+  r = _stp_kmod_index;
+  n = _stp_kmod_index_num;
+  if (r == NULL || (seq & 1))
+    return -1;
+
+  if (*hit < n && addr >= r[*hit].addr && addr < r[*hit].end)
+    begin = *hit;
+  else if (n > 0)
+    {
+      /* the last range starting at or below addr, or one below it
+	 that reaches over it */
+      end = n;
+      while (begin + 1 < end)
+	{
+	  unsigned mid = (begin + end) / 2;
+	  if (r[mid].addr <= addr)
+	    begin = mid;
+	  else
+	    end = mid;
+	}
+      while (begin > 0 && addr >= r[begin].end && addr < r[begin - 1].maxend)
+	begin--;
+    }
+
+  if (begin < n && addr >= r[begin].addr && addr < r[begin].end)
+    {
+      *m = r[begin].mod;
+      *sec = r[begin].sec;
+      found = 1;
+    }
+
+  smp_rmb();
+  if (_stp_kmod_index_seq != seq)
+    return -1;
+  if (found)
+    *hit = begin;
+  return found;
+}
+
 /* Return (kernel) module owner and, if sec != NULL, fills in closest
    section of the address if found, return NULL otherwise. */
 static struct _stp_module *_stp_kmod_sec_lookup(unsigned long addr,
 						struct _stp_section **sec)
 {
   unsigned midx = 0;
+  unsigned *hit = &per_cpu(_stp_kmod_last_hit, raw_smp_processor_id());
+  struct _stp_module *m = NULL;
+  struct _stp_section *s = NULL;
+
+  switch (_stp_kmod_index_lookup(addr, hit, &m, &s))
+    {
+    case 1:
+      if (sec)
+	*sec = s;
+      return m;
+    case 0:
+      return NULL;
+    }
 
   for (midx = 0; midx < _stp_num_modules; midx++)
     {
@@ -156,11 +319,11 @@ static struct _stp_module *_stp_umod_lookup(unsigned long addr,
   return NULL;
 }
 
-static const char *_stp_kallsyms_lookup(unsigned long addr,
-                                        unsigned long *symbolsize,
-                                        unsigned long *offset, 
-                                        const char **modname, 
-                                        /* char ** secname? */
+static const char *__stp_kallsyms_lookup(unsigned long addr,
+                                         unsigned long *symbolsize,
+                                         unsigned long *offset, 
+                                         const char **modname, 
+                                         /* char ** secname? */
 					struct task_struct *task)
 {
 	struct _stp_module *m = NULL;
@@ -248,6 +411,143 @@ static const char *_stp_kallsyms_lookup(unsigned long addr,
 	return NULL;
 }
 
+#ifdef STP_SYM_CACHE
+#ifndef STP_SYM_CACHE_SIZE
+#define STP_SYM_CACHE_SIZE 512
+#endif
+
+/* A direct-mapped cache of the results of __stp_kallsyms_lookup(), per
+   cpu, for the profiling and backtrace scripts that symbolize the same
+   addresses over and over.  An entry holds for the address space
+   (process, or 0 for the kernel) and the _stp_sym_cache_gen it was
+   made in. */
+struct _stp_sym_cache_entry {
+	unsigned long addr;
+	const char *name;
+	const char *modname;
+	unsigned long offset;
+	unsigned size;
+	unsigned gen;
+	pid_t space;
+};
+
+struct _stp_sym_cache {
+	unsigned long hits, misses;
+	int busy; /* an entry is being written */
+	struct _stp_sym_cache_entry entries[STP_SYM_CACHE_SIZE];
+};
+
+static struct _stp_sym_cache *_stp_sym_caches; /* percpu */
+
+static void _stp_sym_cache_init(void)
+{
+	_stp_sym_caches = _stp_alloc_percpu(sizeof(struct _stp_sym_cache));
+}
+
+static void _stp_sym_cache_free(void)
+{
+	if (_stp_sym_caches)
+		_stp_free_percpu(_stp_sym_caches);
+	_stp_sym_caches = NULL;
+}
+
+static void _stp_sym_cache_report(void)
+{
+	unsigned long hits = 0, misses = 0;
+	int cpu;
+
+	if (_stp_sym_caches == NULL)
+		return;
+
+	_stp_printf("----- symbol cache report:\n");
+	for_each_possible_cpu(cpu) {
+		struct _stp_sym_cache *c = per_cpu_ptr(_stp_sym_caches, cpu);
+		if (c->hits || c->misses)
+			_stp_printf("cpu %d: hits: %lu, misses: %lu\n",
+				    cpu, c->hits, c->misses);
+		hits += c->hits;
+		misses += c->misses;
+	}
+	if (hits + misses)
+		_stp_printf("hits: %lu, misses: %lu, hit rate: %lu%%\n",
+			    hits, misses, hits * 100 / (hits + misses));
+}
+
+static const char *_stp_kallsyms_lookup(unsigned long addr,
+                                        unsigned long *symbolsize,
+                                        unsigned long *offset,
+                                        const char **modname,
+					struct task_struct *task)
+{
+	struct _stp_sym_cache *c;
+	struct _stp_sym_cache_entry *e, hit;
+	pid_t space = task ? task->tgid : 0;
+	unsigned gen = atomic_read(&_stp_sym_cache_gen);
+	unsigned long size = 0, off = 0;
+	const char *name, *mod = NULL;
+
+	if (_stp_sym_caches == NULL || addr == 0)
+		return __stp_kallsyms_lookup(addr, symbolsize, offset,
+					     modname, task);
+
+	preempt_disable();
+	c = per_cpu_ptr(_stp_sym_caches, smp_processor_id());
+	e = &c->entries[(addr ^ (addr >> 12) ^ space) % STP_SYM_CACHE_SIZE];
+
+	/* A probe that interrupts the writing of the entry sees it
+	   change under its copy, and takes it for a miss. */
+	hit = *e;
+	barrier();
+	if (hit.addr == addr && hit.space == space && hit.gen == gen
+	    && e->addr == addr && e->space == space && e->gen == gen) {
+		c->hits++;
+		preempt_enable();
+		if (symbolsize)
+			*symbolsize = hit.size;
+		if (offset)
+			*offset = hit.offset;
+		if (modname)
+			*modname = hit.modname;
+		return hit.name;
+	}
+	c->misses++;
+
+	name = __stp_kallsyms_lookup(addr, &size, &off, &mod, task);
+
+	/* An interrupting probe leaves the entry alone. */
+	if (!c->busy) {
+		c->busy = 1;
+		e->addr = 0;
+		barrier();
+		e->name = name;
+		e->modname = mod;
+		e->offset = off;
+		e->size = size;
+		e->gen = gen;
+		e->space = space;
+		barrier();
+		e->addr = addr;
+		barrier();
+		c->busy = 0;
+	}
+	preempt_enable();
+
+	if (symbolsize)
+		*symbolsize = size;
+	if (offset)
+		*offset = off;
+	if (modname)
+		*modname = mod;
+	return name;
+}
+#else
+static inline void _stp_sym_cache_init(void) { }
+static inline void _stp_sym_cache_free(void) { }
+static inline void _stp_sym_cache_report(void) { }
+
+#define _stp_kallsyms_lookup __stp_kallsyms_lookup
+#endif /* STP_SYM_CACHE */
+
 #ifdef STP_NEED_LINE_DATA
 static void _stp_filename_lookup(struct _stp_module *mod, char ** filename,
                                  uint8_t *dirsecp, uint8_t *enddirsecp,
@@ -352,6 +652,37 @@ static void _stp_filename_lookup(struct _stp_module *mod, char ** filename,
     }
 }
 
+/* Binary search the module's line table for the entry covering addr,
+   where addr is relative to the module like in .debug_line. */
+static unsigned long _stp_line_table_lookup(struct _stp_module *m,
+                                            unsigned long addr,
+                                            char **filename, int need_filename)
+{
+  const struct _stp_line *l;
+  unsigned long off;
+  unsigned begin = 0, end = m->num_lines;
+
+  if (addr < m->line_base || addr - m->line_base > 0xffffffffUL)
+    return 0;
+  off = addr - m->line_base;
+
+  while (begin + 1 < end)
+    {
+      unsigned mid = (begin + end) / 2;
+      if (m->lines[mid].addr <= off)
+        begin = mid;
+      else
+        end = mid;
+    }
+
+  l = &m->lines[begin];
+  if (l->addr > off || l->line == 0)
+    return 0;
+  if (need_filename)
+    *filename = (char *) m->line_files[l->file];
+  return l->line;
+}
+
 #endif /* STP_NEED_LINE_DATA */
 
 unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_struct *task, char ** filename, int need_filename)
@@ -383,7 +714,7 @@ unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_struct *tas
   else
     m = _stp_kmod_sec_lookup(addr, &sec);
 
-  if (m == NULL || m->debug_line == NULL)
+  if (m == NULL || (m->debug_line == NULL && m->num_lines == 0))
     return 0;
 
   // if addr is a kernel address, it will need to be adjusted
@@ -404,6 +735,8 @@ unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_struct *tas
       addr = addr - offset;
     }
 
+  if (m->num_lines)
+    return _stp_line_table_lookup(m, addr, filename, need_filename);
 
   linep = m->debug_line;
   enddatap = m->debug_line + m->debug_line_len;
@@ -1018,9 +1351,96 @@ static int _stp_snprint_addr(char *str, size_t len, unsigned long address,
   }
 }
 
+#ifdef STP_DEFER_SYMBOLS
+/* Writes a symbol record (see struct _stp_symrec) that stapio turns
+   into the text _stp_snprint_addr() would have printed.  Only the
+   module of the address is looked up here; the symbol lookup and the
+   formatting happen in user space, out of probe context.  Returns 0 if
+   the address is in no known module, for the caller to print it. */
+static int _stp_defer_addr(unsigned long address, int flags,
+			   struct task_struct *task)
+{
+  struct _stp_module *m = NULL;
+  struct _stp_section *sec = NULL;
+  const char *modname = NULL;
+  unsigned long rel;
+  struct _stp_symrec h;
+  size_t len, name_len, path_len, sec_len;
+  uint8_t build_id_len;
+  char *rec;
+
+  if (address == 0)
+    return 0;
+
+  if (task)
+    {
+      unsigned long vm_start = 0, vm_end = 0;
+#ifdef CONFIG_COMPAT
+      if (test_tsk_thread_flag(task, TIF_32BIT))
+        address &= ((compat_ulong_t) ~0);
+#endif
+      m = _stp_umod_lookup(address, task, &modname, &vm_start, &vm_end);
+      if (m == NULL || m->num_sections == 0)
+        return 0;
+      sec = &m->sections[0];
+      if (strcmp(".dynamic", sec->name) == 0)
+        rel = address - vm_start;
+      else
+        rel = address;
+    }
+  else
+    {
+      m = _stp_kmod_sec_lookup(address, &sec);
+      if (m == NULL)
+        return 0;
+      modname = m->name;
+      rel = address - sec->static_addr;
+    }
+  if (modname == NULL)
+    modname = "";
+
+  build_id_len = (m->build_id_len > 0 && m->build_id_len < 256
+                  ? m->build_id_len : 0);
+  name_len = strlen(modname) + 1;
+  path_len = strlen(m->path) + 1;
+  sec_len = strlen(sec->name) + 1;
+  len = sizeof(h) + 1 + build_id_len + name_len + path_len + sec_len;
+  if (len > 0xffff)
+    return 0;
+  rec = _stp_reserve_bytes(len);
+  if (rec == NULL)
+    return 0;
+
+  memcpy(h.magic, STP_SYMREC_MAGIC, sizeof(h.magic));
+  h.len = len;
+  h.flags = flags;
+  h.addr = address;
+  h.rel = rel;
+  memcpy(rec, &h, sizeof(h));
+  rec += sizeof(h);
+  *rec++ = build_id_len;
+  memcpy(rec, m->build_id_bits, build_id_len);
+  rec += build_id_len;
+  memcpy(rec, modname, name_len);
+  rec += name_len;
+  memcpy(rec, m->path, path_len);
+  rec += path_len;
+  memcpy(rec, sec->name, sec_len);
+  return 1;
+}
+#endif
+
 static void _stp_print_addr(unsigned long address, int flags,
 			    struct task_struct *task)
 {
+#ifdef STP_DEFER_SYMBOLS
+  /* stapio has no line tables, so those are looked up here. */
+  if ((flags & (_STP_SYM_SYMBOL | _STP_SYM_MODULE))
+      && !(flags & (_STP_SYM_NO_DEFER | _STP_SYM_LINENUMBER
+                    | _STP_SYM_FILENAME))
+      && _stp_defer_addr(address, flags, task))
+    return;
+#endif
   _stp_snprint_addr(NULL, 0, address, flags, task);
 }
 
@@ -1064,6 +1484,9 @@ static void _stp_kmodule_update_address(const char* module,
                        _stp_modules[mi]->sections[si].name,
                        address);
               _stp_modules[mi]->sections[si].static_addr = address;
+              _stp_kmod_index_update(_stp_modules[mi],
+                                     &_stp_modules[mi]->sections[si]);
+              _stp_sym_cache_invalidate();
 
               if (reloc) break;
               else continue; /* wildcarded - will have more hits */
@@ -39,6 +39,9 @@
 #define _STP_SYM_LINENUMBER 1024
 /* Adds the filename the symbol is from when  _STP_SYM_LINENUMBER is used. */
 #define _STP_SYM_FILENAME 2048
+/* Looks up the symbol right away, even with STP_DEFER_SYMBOLS; for
+   output that is read back from the print buffer. */
+#define _STP_SYM_NO_DEFER 4096
 
 /* Used for backtraces in hex string form. */
 #define _STP_SYM_NONE	(_STP_SYM_HEXSTR | _STP_SYM_POST_SPACE)
@@ -86,6 +89,15 @@ struct _stp_symbol {
 	const char *symbol;
 };
 
+/* An entry of the address-sorted line table that the translator
+   precomputes from .debug_line.  It covers the addresses up to the
+   next entry; a zero line marks a gap between sequences. */
+struct _stp_line {
+	uint32_t addr; /* offset from _stp_module.line_base */
+	uint32_t line;
+	uint32_t file; /* index into _stp_module.line_files */
+};
+
 struct _stp_section {
         const char *name;
         unsigned long static_addr; /* XXX non-null if everywhere the same. */
@@ -116,6 +128,11 @@ struct _stp_module {
 	uint32_t eh_frame_len;
 	uint32_t unwind_hdr_len;
   uint32_t debug_line_len;
+	/* The line table, used instead of debug_line if there is one. */
+	const struct _stp_line *lines;
+	const char * const *line_files;
+	uint32_t num_lines;
+	unsigned long line_base;
 	unsigned long eh_frame_addr; /* Orig load address (offset) .eh_frame */
 	unsigned long unwind_hdr_addr; /* same for .eh_frame_hdr */
 
@@ -126,6 +143,10 @@ struct _stp_module {
 	int build_id_len;
 };
 
+/* The symbol data files of stap --split-module (STP_SYMBOL_DATA) only
+   need the types above. */
+#ifndef STP_SYMBOL_DATA
+
 /* Defined by translator-generated stap-symbols.h. */
 static struct _stp_module *_stp_modules [];
 static const unsigned _stp_num_modules;
@@ -146,6 +167,33 @@ static void _stp_kmodule_update_address(const char* module,
                                         const char* section,
                                         unsigned long offset);
 
+/* Deferred symbolization is only implemented for the kernel runtime. */
+#if defined(STP_DEFER_SYMBOLS) && !defined(__KERNEL__)
+#undef STP_DEFER_SYMBOLS
+#endif
+
+/* The symbol cache is only implemented for the kernel runtime. */
+#if defined(STP_SYM_CACHE) && !defined(__KERNEL__)
+#undef STP_SYM_CACHE
+#endif
+
+/* The unwind rule cache is only implemented for the kernel runtime,
+   and only needed with the dwarf unwinder. */
+#if defined(STP_CFI_CACHE) \
+    && (!defined(__KERNEL__) || !defined(STP_USE_DWARF_UNWINDER))
+#undef STP_CFI_CACHE
+#endif
+
+#if defined(STP_SYM_CACHE) || defined(STP_CFI_CACHE)
+/* Bumped whenever an address may come to stand for another symbol or
+   other unwind rules, which invalidates everything in the symbol cache,
+   see sym.c, and in the unwind rule cache, see unwind.c. */
+static atomic_t _stp_sym_cache_gen = ATOMIC_INIT(0);
+#define _stp_sym_cache_invalidate() atomic_inc(&_stp_sym_cache_gen)
+#else
+#define _stp_sym_cache_invalidate() do { } while (0)
+#endif
+
 #if (defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)) \
     || defined(STP_NEED_LINE_DATA)
 static struct _stp_module _stp_module_self;
@@ -154,4 +202,6 @@ static struct _stp_symbol _stp_module_self_symbols_0[];
 static struct _stp_symbol _stp_module_self_symbols_1[];
 #endif /* defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)
           || defined(STP_NEED_LINE_DATA) */
+
+#endif /* STP_SYMBOL_DATA */
 #endif /* _STP_SYM_H_ */
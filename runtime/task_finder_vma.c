@@ -9,6 +9,7 @@
 #include <linux/dcache.h>
 
 #include "stp_helper_lock.h"
+#include "sym.h"
 
 // __stp_tf_vma_lock protects the hash table.
 // Documentation/spinlocks.txt suggest we can be a bit more clever
@@ -216,6 +217,7 @@ stap_add_vma_map_info(struct task_struct *tsk,
 	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
 	hlist_add_head(&entry->hlist, head);
 	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	_stp_sym_cache_invalidate();
 	return 0;
 }
 
@@ -268,6 +270,8 @@ stap_remove_vma_map_info(struct task_struct *tsk, unsigned long vm_start)
                 rc = 0;
 	}
 	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	if (rc == 0)
+		_stp_sym_cache_invalidate();
 	return rc;
 }
 
@@ -374,6 +378,7 @@ stap_drop_vma_maps(struct task_struct *tsk)
             }
         }
 	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	_stp_sym_cache_invalidate();
 	return 0;
 }
 
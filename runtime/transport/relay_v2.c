@@ -39,6 +39,18 @@
 #define STP_RELAY_TIMER_INTERVAL		((HZ + 99) / 100)
 #endif
 
+#ifndef STP_RELAY_TIMER_MAX_INTERVAL
+/* Longest interval the wakeup timer backs off to while the channel is
+   idle, in jiffies (default 100 ms) */
+#define STP_RELAY_TIMER_MAX_INTERVAL		((HZ + 9) / 10)
+#endif
+
+#ifndef STP_RELAY_WAKEUP_WATERMARK
+/* Once this many sub-buffers are waiting for the reader, the wakeup
+   timer runs every jiffy until it catches up (default: half of them) */
+#define STP_RELAY_WAKEUP_WATERMARK(n_subbufs)	(((n_subbufs) + 1) / 2)
+#endif
+
 /* Note: if struct _stp_relay_data_type changes, staplog.c might need
  * to be changed. */
 struct _stp_relay_data_type {
@@ -50,10 +62,18 @@ struct _stp_relay_data_type {
 #endif
 	atomic_t wakeup;
 	struct timer_list timer;
+	unsigned long timer_interval;
 	int overwrite_flag;
 };
 struct _stp_relay_data_type _stp_relay_data;
 
+/* Per-cpu reader wakeups and dropped sub-buffers, for the exit report. */
+struct _stp_relay_cpu_stats {
+	unsigned long wakeups;
+	unsigned long dropped;
+};
+static DEFINE_PER_CPU(struct _stp_relay_cpu_stats, _stp_relay_cpu_stats);
+
 /* relay_file_operations is const, so .owner is obviously not set there.
  * Below struct, filled in _stp_transport_data_fs_init(), fixes it. */
 static struct file_operations relay_file_operations_w_owner;
@@ -113,37 +133,68 @@ toobig:
 	return 0;
 }
 
-static void __stp_relay_wakeup_readers(struct rchan_buf *buf)
+/*
+ * Wake cpu's reader if it has complete sub-buffers to read.  Returns
+ * nonzero if it had to be woken with STP_RELAY_WAKEUP_WATERMARK or
+ * more of them waiting.  (A reader that is not waiting will see the
+ * backlog by itself, e.g. flight recorder mode with nobody attached.)
+ */
+static int __stp_relay_wakeup_readers(struct rchan_buf *buf, int cpu)
 {
-	if (buf && waitqueue_active(&buf->read_wait) &&
-	    buf->subbufs_produced != buf->subbufs_consumed)
-		wake_up_interruptible(&buf->read_wait);
+	size_t pending;
+
+	if (!buf || !waitqueue_active(&buf->read_wait))
+		return 0;
+	pending = buf->subbufs_produced - buf->subbufs_consumed;
+	if (!pending)
+		return 0;
+	wake_up_interruptible(&buf->read_wait);
+	per_cpu(_stp_relay_cpu_stats, cpu).wakeups++;
+	return pending >= STP_RELAY_WAKEUP_WATERMARK(buf->chan->n_subbufs);
 }
 
+/*
+ * The wakeup timer adapts its interval to the load: it backs off
+ * towards STP_RELAY_TIMER_MAX_INTERVAL while no sub-buffers get
+ * completed, returns to STP_RELAY_TIMER_INTERVAL when they do, and
+ * runs every jiffy while some reader lags by more than the watermark.
+ */
 static void __stp_relay_wakeup_timer(unsigned long val)
 {
-#ifdef STP_BULKMODE
-	int i;
-#endif
+	unsigned long interval = _stp_relay_data.timer_interval;
 
 	if (atomic_read(&_stp_relay_data.wakeup)) {
 		struct rchan_buf *buf;
-		
+		int behind = 0;
+#ifdef STP_BULKMODE
+		int i;
+#endif
+
 		atomic_set(&_stp_relay_data.wakeup, 0);
 #ifdef STP_BULKMODE
 		for_each_possible_cpu(i) {
 			buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf,
 						    i);
-			__stp_relay_wakeup_readers(buf);
+			behind |= __stp_relay_wakeup_readers(buf, i);
 		}
 #else
 		buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, 0);
-		__stp_relay_wakeup_readers(buf);
+		behind = __stp_relay_wakeup_readers(buf, 0);
 #endif
-	}
+		if (behind) {
+			/* Check again soon; the flag would otherwise only
+			   be raised by the next completed sub-buffer. */
+			atomic_set(&_stp_relay_data.wakeup, 1);
+			interval = 1;
+		} else
+			interval = STP_RELAY_TIMER_INTERVAL;
+	} else if (interval < STP_RELAY_TIMER_MAX_INTERVAL)
+		interval = min_t(unsigned long, interval * 2,
+				 STP_RELAY_TIMER_MAX_INTERVAL);
+	_stp_relay_data.timer_interval = interval;
 
 	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
-        	mod_timer(&_stp_relay_data.timer, jiffies + STP_RELAY_TIMER_INTERVAL);
+        	mod_timer(&_stp_relay_data.timer, jiffies + interval);
         else
 		dbug_trans(0, "relay_v2 wakeup timer expiry\n");
 }
@@ -151,6 +202,7 @@ static void __stp_relay_wakeup_timer(unsigned long val)
 static void __stp_relay_timer_init(void)
 {
 	atomic_set(&_stp_relay_data.wakeup, 0);
+	_stp_relay_data.timer_interval = STP_RELAY_TIMER_INTERVAL;
 	init_timer(&_stp_relay_data.timer);
 	_stp_relay_data.timer.expires = jiffies + STP_RELAY_TIMER_INTERVAL;
 	_stp_relay_data.timer.function = __stp_relay_wakeup_timer;
@@ -204,6 +256,7 @@ static int __stp_relay_subbuf_start_callback(struct rchan_buf *buf,
 	if (_stp_relay_data.overwrite_flag || !relay_buf_full(buf))
 		return 1;
 
+	per_cpu(_stp_relay_cpu_stats, smp_processor_id()).dropped++;
 #ifdef _STP_USE_DROPPED_FILE
 	atomic_inc(&_stp_relay_data.dropped);
 #endif
@@ -280,6 +333,19 @@ static void _stp_transport_data_fs_stop(void)
 	}
 }
 
+static void _stp_transport_data_fs_report(void)
+{
+	int i;
+
+	_stp_printf("----- relay report:\n");
+	for_each_possible_cpu(i) {
+		struct _stp_relay_cpu_stats *st = &per_cpu(_stp_relay_cpu_stats, i);
+		if (st->wakeups || st->dropped)
+			_stp_printf("cpu %d: wakeups: %lu, dropped sub-buffers: %lu\n",
+				    i, st->wakeups, st->dropped);
+	}
+}
+
 static void _stp_transport_data_fs_close(void)
 {
 	_stp_transport_data_fs_stop();
@@ -804,6 +804,10 @@ static void _stp_transport_data_fs_stop(void)
 	}
 }
 
+static void _stp_transport_data_fs_report(void)
+{
+}
+
 static void _stp_transport_data_fs_close(void)
 {
 	int cpu;
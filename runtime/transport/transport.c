@@ -381,6 +381,9 @@ static void _stp_transport_close(void)
 	_stp_unregister_ctl_channel();
 	_stp_transport_fs_close();
 	_stp_print_cleanup();	/* free print buffers */
+	_stp_sym_cache_free();
+	_stp_cfi_cache_free();
+	_stp_kmod_index_free();
 	_stp_mem_debug_done();
 
 	dbug_trans(1, "---- CLOSED ----\n");
@@ -473,6 +476,11 @@ static int _stp_transport_init(void)
 	if (_stp_module_update_self() < 0)
 		goto err3;
 
+	/* index the sections for address lookups */
+	_stp_kmod_index_init();
+	_stp_sym_cache_init();
+	_stp_cfi_cache_init();
+
 	/* start transport */
 	_stp_transport_data_fs_start();
 
@@ -95,6 +95,14 @@ static void _stp_transport_data_fs_stop(void);
  */
 static void _stp_transport_data_fs_close(void);
 
+/*
+ * _stp_transport_data_fs_report
+ *
+ * This function prints transport statistics, if any, for the -t
+ * report at module exit.
+ */
+static void _stp_transport_data_fs_report(void);
+
 /*
  * _stp_transport_data_fs_overwrite - set data overwrite mode
  * overwrite:		boolean
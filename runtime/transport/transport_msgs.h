@@ -185,3 +185,21 @@ struct _stp_msg_remote_id
         int32_t remote_id;
         char remote_uri[STP_REMOTE_URI_LEN];
 };
+
+/* A symbol record in the data stream.  With stap --defer-symbols
+   (stapio -s), the printed backtraces carry one of these per address
+   instead of text, and stapio looks the symbols up in the modules' ELF
+   files before writing the output.  The header is followed by a byte
+   giving the length of the build-id, the build-id, and the
+   NUL-terminated module name, path and section name.  The address
+   relative to that section is what the runtime's symbol tables hold. */
+#define STP_SYMREC_MAGIC "\0sym"
+
+struct _stp_symrec
+{
+	char magic[4];		/* STP_SYMREC_MAGIC */
+	uint16_t len;		/* of the whole record */
+	uint16_t flags;		/* _STP_SYM_* */
+	uint64_t addr;
+	uint64_t rel;
+};
@@ -312,6 +312,8 @@ static int processCFI(const u8 *start, const u8 *end, unsigned long targetLoc,
 
 	dbug_unwind(1, "targetLoc=%lx state->loc=%lx\n", targetLoc, state->loc);
 	for (ptr.p8 = start; result && ptr.p8 < end;) {
+		/* Until an instruction moves past targetLoc. */
+		state->rowLoc = state->loc;
 		switch (*ptr.p8 >> 6) {
 			uleb128_t value;
 			uleb128_t value2;
@@ -851,6 +853,164 @@ static u32 *_stp_search_unwind_hdr(unsigned long pc,
 	return fde;
 }
 
+#ifdef STP_CFI_CACHE
+#ifndef STP_CFI_CACHE_SIZE
+#define STP_CFI_CACHE_SIZE 256
+#endif
+
+/* A direct-mapped cache, per cpu, of the rules processCFI() worked out
+   for a pc, so that unwinding through the same functions over and over
+   skips both the search for their FDE and the interpretation of its CIE
+   and FDE instructions.  An entry holds for the row of the FDE the pc
+   was in, [start, end), as found in the given unwind table, for the
+   address space (process, or 0 for the kernel) and the
+   _stp_sym_cache_gen it was made in. */
+struct _stp_cfi_cache_entry {
+	unsigned long start, end;
+	const void *table;
+	unsigned gen;
+	pid_t space;
+	int compat_task;
+	int call_frame;
+	uleb128_t retAddrReg;
+	struct unwind_reg_state rules;
+};
+
+struct _stp_cfi_cache {
+	unsigned long hits, misses;
+	int busy; /* an entry is being written */
+	struct _stp_cfi_cache_entry entries[STP_CFI_CACHE_SIZE];
+};
+
+static struct _stp_cfi_cache *_stp_cfi_caches[NR_CPUS];
+
+static void _stp_cfi_cache_init(void)
+{
+	int cpu;
+
+	/* Without a cache, a cpu just interprets the CFI every time. */
+	for_each_possible_cpu(cpu)
+		_stp_cfi_caches[cpu] =
+			_stp_vzalloc_node(sizeof(struct _stp_cfi_cache),
+					  cpu_to_node(cpu));
+}
+
+static void _stp_cfi_cache_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (_stp_cfi_caches[cpu])
+			_stp_vfree(_stp_cfi_caches[cpu]);
+		_stp_cfi_caches[cpu] = NULL;
+	}
+}
+
+static void _stp_cfi_cache_report(void)
+{
+	unsigned long hits = 0, misses = 0;
+	int cpu;
+
+	_stp_printf("----- unwind rule cache report:\n");
+	for_each_possible_cpu(cpu) {
+		struct _stp_cfi_cache *c = _stp_cfi_caches[cpu];
+		if (c == NULL)
+			continue;
+		if (c->hits || c->misses)
+			_stp_printf("cpu %d: hits: %lu, misses: %lu\n",
+				    cpu, c->hits, c->misses);
+		hits += c->hits;
+		misses += c->misses;
+	}
+	if (hits + misses)
+		_stp_printf("hits: %lu, misses: %lu, hit rate: %lu%%\n",
+			    hits, misses, hits * 100 / (hits + misses));
+}
+
+static inline struct _stp_cfi_cache_entry *
+_stp_cfi_cache_slot(struct _stp_cfi_cache *c, unsigned long pc, pid_t space)
+{
+	/* Neighbouring pcs, likely in the same row, share an entry. */
+	return &c->entries[((pc >> 4) ^ (pc >> 12) ^ space) % STP_CFI_CACHE_SIZE];
+}
+
+/* Sets up the rules for pc in the current row of state, and returns 1,
+   if they are in the cache.  Called in probe context, so that the cpu
+   can't change under us. */
+static int _stp_cfi_cache_lookup(unsigned long pc, const void *table,
+				 int user, int compat_task,
+				 struct unwind_state *state,
+				 uleb128_t *retAddrReg, int *call_frame)
+{
+	struct _stp_cfi_cache *c = _stp_cfi_caches[smp_processor_id()];
+	struct _stp_cfi_cache_entry *e;
+	pid_t space = user ? current->tgid : 0;
+	unsigned gen = atomic_read(&_stp_sym_cache_gen);
+
+	if (c == NULL)
+		return 0;
+
+	e = _stp_cfi_cache_slot(c, pc, space);
+	if (!(pc >= e->start && pc < e->end && e->table == table
+	      && e->space == space && e->gen == gen
+	      && e->compat_task == compat_task)) {
+		c->misses++;
+		return 0;
+	}
+
+	state->stackDepth = 0;
+	memcpy(&REG_STATE, &e->rules, sizeof(REG_STATE));
+	*retAddrReg = e->retAddrReg;
+	*call_frame = e->call_frame;
+
+	/* A probe that interrupts the writing of the entry sees it
+	   change under its copy, and takes it for a miss. */
+	barrier();
+	if (!(pc >= e->start && pc < e->end && e->table == table
+	      && e->space == space && e->gen == gen
+	      && e->compat_task == compat_task)) {
+		c->misses++;
+		return 0;
+	}
+	c->hits++;
+	return 1;
+}
+
+/* Remembers the rules in the current row of state, which hold for the
+   pcs in [start, end). */
+static void _stp_cfi_cache_store(unsigned long pc, const void *table,
+				 int user, int compat_task,
+				 unsigned long start, unsigned long end,
+				 struct unwind_state *state,
+				 uleb128_t retAddrReg, int call_frame)
+{
+	struct _stp_cfi_cache *c = _stp_cfi_caches[smp_processor_id()];
+	struct _stp_cfi_cache_entry *e;
+	pid_t space = user ? current->tgid : 0;
+
+	/* An interrupting probe leaves the entry alone. */
+	if (c == NULL || c->busy || !(pc >= start && pc < end))
+		return;
+
+	c->busy = 1;
+	e = _stp_cfi_cache_slot(c, pc, space);
+	e->end = 0;
+	barrier();
+	e->start = start;
+	e->table = table;
+	e->gen = atomic_read(&_stp_sym_cache_gen);
+	e->space = space;
+	e->compat_task = compat_task;
+	e->call_frame = call_frame;
+	e->retAddrReg = retAddrReg;
+	memcpy(&e->rules, &REG_STATE, sizeof(REG_STATE));
+	barrier();
+	e->end = end;
+	barrier();
+	c->busy = 0;
+}
+#endif /* STP_CFI_CACHE */
+
 #define FRAME_REG(r, t) (((t *)frame)[reg_info[r].offs])
 
 #ifndef CONFIG_64BIT
@@ -1183,6 +1343,15 @@ static int unwind_frame(struct unwind_context *context,
 		goto err;
 	}
 
+#ifdef STP_CFI_CACHE
+	if (_stp_cfi_cache_lookup(pc, table, user, compat_task, state,
+				  &retAddrReg, &call_frame)) {
+		dbug_unwind(1, "%s: cached rules for pc=%lx\n", m->path, pc);
+		frame->call_frame = call_frame;
+		goto rules;
+	}
+#endif
+
 	/* Sets all rules to default Same value. */
 	memset(state, 0, sizeof(*state));
 
@@ -1294,6 +1463,19 @@ static int unwind_frame(struct unwind_context *context,
 	    || REG_STATE.regs[retAddrReg].where == Nowhere)
 		goto err;
 
+#ifdef STP_CFI_CACHE
+	/* processCFI stopped either in the row of pc, or at the end of
+	   the FDE, in its last row. */
+	if (state->loc > pc)
+		_stp_cfi_cache_store(pc, table, user, compat_task,
+				     state->rowLoc, state->loc, state,
+				     retAddrReg, call_frame);
+	else
+		_stp_cfi_cache_store(pc, table, user, compat_task,
+				     state->loc, endLoc, state,
+				     retAddrReg, call_frame);
+rules:
+#endif
 	/* update frame */
 	if (REG_STATE.cfa_is_expr) {
 		if (compute_expr(REG_STATE.cfa_expr, frame, &cfa, user, compat_task))
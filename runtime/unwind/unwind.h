@@ -494,6 +494,7 @@ struct unwind_reg_state {
 
 struct unwind_state {
 	uleb128_t loc;
+	uleb128_t rowLoc; /* where the row processCFI stopped in starts */
 	uleb128_t codeAlign;
 	sleb128_t dataAlign;
 	unsigned stackDepth:8;
@@ -511,6 +512,12 @@ static const struct cfa badCFA = { ARRAY_SIZE(reg_info), 1 };
 struct unwind_context { };
 #endif /* !STP_USE_DWARF_UNWINDER */
 
+#ifndef STP_CFI_CACHE
+static inline void _stp_cfi_cache_init(void) { }
+static inline void _stp_cfi_cache_free(void) { }
+static inline void _stp_cfi_cache_report(void) { }
+#endif
+
 #ifndef MAXBACKTRACE
 #define MAXBACKTRACE 20
 #endif
@@ -25,6 +25,7 @@
 #include "version.h"
 #include "stringtable.h"
 #include "tapsets.h"
+#include "parse.h"
 
 #include <cerrno>
 #include <cstdlib>
@@ -42,6 +43,7 @@ extern "C" {
 #include <unistd.h>
 #include <sys/wait.h>
 #include <wordexp.h>
+#include <fnmatch.h>
 }
 
 #if HAVE_NSS
@@ -155,6 +157,9 @@ systemtap_session::systemtap_session ():
   uprobes_path = "";
   load_only = false;
   skip_badvars = false;
+  pass2_jobs = thread::hardware_concurrency();
+  split_module = 0;
+  line_table_budget = 16384;
   privilege = pr_stapdev;
   privilege_set = false;
   compatible = VERSION; // XXX: perhaps also process GIT_SHAID if available?
@@ -173,12 +178,16 @@ systemtap_session::systemtap_session ():
   sysroot = "";
   update_release_sysroot = false;
   suppress_time_limits = false;
+  binary_trace = false;
+  defer_symbols = false;
   target_namespaces_pid = 0;
   color_mode = color_auto;
   color_errors = isatty(STDERR_FILENO) // conditions for coloring when
     && strcmp(getenv("TERM") ?: "notdumb", "dumb"); // on auto
   interactive_mode = false;
   pass_1a_complete = false;
+  tapset_index = 0;
+  tapset_cache = 0;
   timeout = 0;
 
   // PR12443: put compiled-in / -I paths in front, to be preferred during 
@@ -343,6 +352,9 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   uprobes_path = "";
   load_only = other.load_only;
   skip_badvars = other.skip_badvars;
+  pass2_jobs = other.pass2_jobs;
+  split_module = other.split_module;
+  line_table_budget = other.line_table_budget;
   privilege = other.privilege;
   privilege_set = other.privilege_set;
   compatible = other.compatible;
@@ -359,10 +371,14 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   update_release_sysroot = other.update_release_sysroot;
   sysenv = other.sysenv;
   suppress_time_limits = other.suppress_time_limits;
+  binary_trace = other.binary_trace;
+  defer_symbols = other.defer_symbols;
   color_errors = other.color_errors;
   color_mode = other.color_mode;
   interactive_mode = other.interactive_mode;
   pass_1a_complete = other.pass_1a_complete;
+  tapset_index = 0;
+  tapset_cache = 0;
   timeout = other.timeout;
 
   include_path = other.include_path;
@@ -406,6 +422,8 @@ systemtap_session::~systemtap_session ()
   remove_tmp_dir();
   delete_map(subsessions);
   delete pattern_root;
+  delete tapset_index;
+  delete tapset_cache;
 }
 
 const string
@@ -667,6 +685,18 @@ systemtap_session::usage (int exitcode)
     "              relative to the sysroot.\n"
     "   --suppress-time-limits\n"
     "              disable -DSTP_OVERLOAD, -DMAXACTION, and -DMAXTRYACTION limits\n"
+    "   --binary-trace\n"
+    "              write printf output as binary records, implies -b;\n"
+    "              decode with stap-merge -b\n"
+    "   --pass2-jobs=N\n"
+    "              scan debuginfo in pass 2 with N threads, 0 or 1 for none\n"
+    "   --split-module=N\n"
+    "              compile the symbol and unwind data in N more C files;\n"
+    "              probe handlers stay in the main one\n"
+    "   --line-table-budget=KB\n"
+    "              largest line table to precompute per module, 0 for none\n"
+    "   --defer-symbols\n"
+    "              have stapio look up the symbols of printed backtraces\n"
     "   --save-uprobes\n"
     "              save uprobes.ko to current directory if it is built from source\n"
     "   --target-namesapce=PID\n"
@@ -1481,6 +1511,48 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	      break;
 	    }
 
+	case LONG_OPT_BINARY_TRACE:
+	  binary_trace = true;
+	  server_args.push_back ("--binary-trace");
+	  break;
+
+	case LONG_OPT_PASS2_JOBS:
+	  assert(optarg);
+	  pass2_jobs = strtoul (optarg, &num_endptr, 10);
+	  if (*optarg == '\0' || *num_endptr != '\0')
+	    {
+	      cerr << _F("Invalid --pass2-jobs value '%s'.", optarg) << endl;
+	      return 1;
+	    }
+	  break;
+
+	case LONG_OPT_SPLIT_MODULE:
+	  assert(optarg);
+	  split_module = strtoul (optarg, &num_endptr, 10);
+	  if (*optarg == '\0' || *num_endptr != '\0')
+	    {
+	      cerr << _F("Invalid --split-module value '%s'.", optarg) << endl;
+	      return 1;
+	    }
+	  server_args.push_back (string ("--split-module=") + optarg);
+	  break;
+
+	case LONG_OPT_LINE_TABLE_BUDGET:
+	  assert(optarg);
+	  line_table_budget = strtoul (optarg, &num_endptr, 10);
+	  if (*optarg == '\0' || *num_endptr != '\0')
+	    {
+	      cerr << _F("Invalid --line-table-budget value '%s'.", optarg) << endl;
+	      return 1;
+	    }
+	  server_args.push_back (string ("--line-table-budget=") + optarg);
+	  break;
+
+	case LONG_OPT_DEFER_SYMBOLS:
+	  defer_symbols = true;
+	  server_args.push_back ("--defer-symbols");
+	  break;
+
 	case LONG_OPT_RUNTIME:
           if (!parse_cmdline_runtime (optarg))
             return 1;
@@ -1722,6 +1794,33 @@ systemtap_session::check_options (int argc, char * const argv [])
     }
 #endif
 
+  if (binary_trace)
+    {
+      if (runtime_usermode_p ())
+        {
+          cerr << _("--binary-trace is only supported by the kernel runtime.") << endl;
+          usage(1);
+        }
+      // Records are decoded per flush, so each cpu needs its own file.
+      bulk_mode = true;
+    }
+
+  if (defer_symbols)
+    {
+      if (runtime_usermode_p ())
+        {
+          cerr << _("--defer-symbols is only supported by the kernel runtime.") << endl;
+          usage(1);
+        }
+      // stapio rewrites the symbol records as it reads them, but leaves
+      // the bulk mode files alone.
+      if (bulk_mode)
+        {
+          cerr << _("--defer-symbols can't be used with -b or --binary-trace.") << endl;
+          usage(1);
+        }
+    }
+
   if (runtime_specified && ! specified_servers.empty ())
     {
       print_warning("Ignoring --use-server due to the use of -R");
@@ -2148,40 +2247,130 @@ systemtap_session::register_library_aliases()
   files.insert(files.end(), user_files.begin(), user_files.end());
 
   for (unsigned f = 0; f < files.size(); ++f)
+    register_library_aliases(files[f]);
+}
+
+
+void
+systemtap_session::register_library_aliases(stapfile* file)
+{
+  for (unsigned a = 0; a < file->aliases.size(); ++a)
     {
-      stapfile * file = files[f];
-      for (unsigned a = 0; a < file->aliases.size(); ++a)
-	{
-	  probe_alias * alias = file->aliases[a];
-          try
+      probe_alias * alias = file->aliases[a];
+      try
+        {
+          for (unsigned n = 0; n < alias->alias_names.size(); ++n)
             {
-              for (unsigned n = 0; n < alias->alias_names.size(); ++n)
+              probe_point * name = alias->alias_names[n];
+              match_node * mn = pattern_root;
+              for (unsigned c = 0; c < name->components.size(); ++c)
                 {
-                  probe_point * name = alias->alias_names[n];
-                  match_node * mn = pattern_root;
-                  for (unsigned c = 0; c < name->components.size(); ++c)
-                    {
-                      probe_point::component * comp = name->components[c];
-                      // XXX: alias parameters
-                      if (comp->arg)
-                        throw SEMANTIC_ERROR(_F("alias component %s contains illegal parameter",
-                                                comp->functor.to_string().c_str()));
-                      mn = mn->bind(comp->functor);
-                    }
-		  // PR 12916: All probe aliases are OK for all users. The actual
-		  // referenced probe points will be checked when the alias is resolved.
-		  mn->bind_privilege (pr_all);
-                  mn->bind(new alias_expansion_builder(alias));
+                  probe_point::component * comp = name->components[c];
+                  // XXX: alias parameters
+                  if (comp->arg)
+                    throw SEMANTIC_ERROR(_F("alias component %s contains illegal parameter",
+                                            comp->functor.to_string().c_str()));
+                  mn = mn->bind(comp->functor);
                 }
+              // PR 12916: All probe aliases are OK for all users. The actual
+              // referenced probe points will be checked when the alias is resolved.
+              mn->bind_privilege (pr_all);
+              mn->bind(new alias_expansion_builder(alias));
             }
-          catch (const semantic_error& e)
-            {
-              semantic_error er(ERR_SRC, _("while registering probe alias"),
-                                alias->tok, NULL, &e);
-              print_error (er);
-            }
-	}
+        }
+      catch (const semantic_error& e)
+        {
+          semantic_error er(ERR_SRC, _("while registering probe alias"),
+                            alias->tok, NULL, &e);
+          print_error (er);
+        }
+    }
+}
+
+
+// Load the I'th file of the tapset index from the tapset cache, or else
+// parse it, unless that's been done already, and make what it defines
+// available like pass 1 would have.
+void
+systemtap_session::load_library_file(unsigned i)
+{
+  library_index::file& lf = tapset_index->files[i];
+  if (lf.parsed)
+    return;
+  lf.parsed = true;
+
+  if (verbose>2)
+    clog << _F("Processing tapset \"%s\"", lf.path.c_str()) << endl;
+
+  stapfile* f = 0;
+  if (tapset_cache)
+    f = tapset_cache->load_file (*this, lf.path);
+  if (f)
+    lf.cached = true;
+  else
+    {
+      // NB: like in pass 1, only the script's own uses of $1 etc. count
+      vector<bool> saved_used_args (used_args);
+      f = parse (*this, lf.path, lf.flags);
+      used_args.swap (saved_used_args);
+    }
+  if (f == 0)
+    {
+      print_warning(_F("tapset \"%s\" has errors, and will be skipped", lf.path.c_str()));
+      return;
+    }
+
+  library_files.push_back (f);
+  register_library_aliases (f);
+}
+
+
+void
+systemtap_session::load_library_functions(const string& name)
+{
+  if (!tapset_index)
+    return;
+  library_index::symbol_map::const_iterator it = tapset_index->functions.find(name);
+  if (it != tapset_index->functions.end())
+    for (unsigned i = 0; i < it->second.size(); ++i)
+      load_library_file (it->second[i]);
+}
+
+
+void
+systemtap_session::load_library_globals(const string& name)
+{
+  if (!tapset_index)
+    return;
+  library_index::symbol_map::const_iterator it = tapset_index->globals.find(name);
+  if (it != tapset_index->globals.end())
+    for (unsigned i = 0; i < it->second.size(); ++i)
+      load_library_file (it->second[i]);
+}
+
+
+// Parse the tapsets with aliases that a probe point starting with
+// FUNCTOR may expand to.
+void
+systemtap_session::load_library_aliases(const string& functor)
+{
+  if (!tapset_index)
+    return;
+  library_index::symbol_map& aliases = tapset_index->aliases;
+  if (!contains_glob_chars (functor))
+    {
+      library_index::symbol_map::const_iterator it = aliases.find(functor);
+      if (it != aliases.end())
+        for (unsigned i = 0; i < it->second.size(); ++i)
+          load_library_file (it->second[i]);
+      return;
     }
+
+  for (library_index::symbol_map::const_iterator it = aliases.begin();
+       it != aliases.end(); ++it)
+    if (fnmatch (functor.c_str(), it->first.c_str(), FNM_NOESCAPE) == 0)
+      for (unsigned i = 0; i < it->second.size(); ++i)
+        load_library_file (it->second[i]);
 }
 
 
@@ -98,7 +98,18 @@ struct statistic_decl
   }
 };
 
+// what the builders of a kind of probe point did in pass 2, for -v
+struct builder_stats
+{
+  builder_stats(): calls(0), probes(0), usecs(0) {}
+  unsigned calls;
+  unsigned probes;
+  unsigned long usecs;
+};
+
 struct macrodecl; // defined in parse.h
+struct library_index; // defined in parse.h
+struct library_cache; // defined in parse.h
 
 struct parse_error: public std::runtime_error
 {
@@ -248,6 +259,8 @@ public:
   int download_dbinfo;
   bool suppress_handler_errors;
   bool suppress_time_limits;
+  bool binary_trace;
+  bool defer_symbols;
   bool color_errors;
   bool interactive_mode;
   bool pass_1a_complete;
@@ -321,6 +334,16 @@ public:
   // Skip bad $ vars
   bool skip_badvars;
 
+  // Threads for pass 2 to scan DWARF with (--pass2-jobs)
+  unsigned pass2_jobs;
+
+  // C files to write the symbol and unwind data into (--split-module)
+  unsigned split_module;
+
+  // Largest line table to precompute per module, in KiB, 0 for none
+  // (--line-table-budget)
+  unsigned line_table_budget;
+
   // NB: It is very important for all of the above (and below) fields
   // to be cleared in the systemtap_session ctor (session.cxx).
 
@@ -331,6 +354,7 @@ public:
 
   match_node* pattern_root;
   void register_library_aliases();
+  void register_library_aliases(stapfile* file);
 
   // data for various preprocessor library macros
   std::map<std::string, macrodecl*> library_macros;
@@ -339,6 +363,15 @@ public:
   std::vector<stapfile*> user_files;
   std::vector<stapfile*> library_files;
 
+  // the tapsets that pass 2 loads only once something refers to them,
+  // from the tapset cache if it has them
+  library_index* tapset_index;
+  library_cache* tapset_cache;
+  void load_library_file(unsigned i);
+  void load_library_functions(const std::string& name);
+  void load_library_globals(const std::string& name);
+  void load_library_aliases(const std::string& functor);
+
   // filters to run over all code before symbol resolution
   //   e.g. @cast expansion
   std::vector<update_visitor*> code_filters;
@@ -353,6 +386,8 @@ public:
   std::vector<derived_probe*> probes; // see also *_probes groups below
   std::vector<embeddedcode*> embeds;
   std::map<interned_string, statistic_decl> stat_decls;
+  // builder name -> time spent deriving probes
+  std::map<std::string, builder_stats> builder_times;
   // track things that are removed
   std::vector<vardecl*> unused_globals;
   std::vector<derived_probe*> unused_probes; // see also *_probes groups below
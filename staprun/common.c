@@ -52,6 +52,7 @@ int color_errors;
 color_modes color_mode;
 int monitor;
 int monitor_interval;
+int defer_symbols;
 
 /* module variables */
 char *modname = NULL;
@@ -131,6 +132,7 @@ void parse_args(int argc, char **argv)
 	fnum_max = 0;
 	monitor = 0;
         monitor_interval = 1;
+	defer_symbols = 0;
         remote_id = -1;
         remote_uri = NULL;
         relay_basedir_fd = -1;
@@ -138,7 +140,7 @@ void parse_args(int argc, char **argv)
         color_errors = isatty(STDERR_FILENO)
                 && strcmp(getenv("TERM") ?: "notdumb", "dumb");
 
-	while ((c = getopt(argc, argv, "ALu::vhb:t:dc:o:x:N:S:DwRr:VT:C:M:"
+	while ((c = getopt(argc, argv, "ALu::vhb:t:dc:o:x:N:S:DwRr:VT:C:M:s"
 #ifdef HAVE_OPENAT
                            "F:"
 #endif
@@ -267,6 +269,9 @@ void parse_args(int argc, char **argv)
 				err(_("Invalid monitor interval\n"));
 			}
 			break;
+		case 's':
+			defer_symbols = 1;
+			break;
 		default:
 			usage(argv[0],1);
 		}
@@ -341,7 +346,7 @@ void parse_args(int argc, char **argv)
 void usage(char *prog, int rc)
 {
 	printf(_("\n%s [-v] [-w] [-V] [-h] [-u] [-c cmd ] [-x pid] [-u user] [-A|-L|-d] [-C WHEN]\n"
-                "\t[-b bufsize] [-R] [-r N:URI] [-o FILE [-D] [-S size[,N]]] MODULE [module-options]\n"), prog);
+                "\t[-b bufsize] [-R] [-r N:URI] [-s] [-o FILE [-D] [-S size[,N]]] MODULE [module-options]\n"), prog);
 	printf(_("-v              Increase verbosity.\n"
 	"-V              Print version number and exit.\n"
 	"-h              Print this help text and exit.\n"
@@ -387,6 +392,8 @@ void usage(char *prog, int rc)
 #ifdef HAVE_OPENAT
         "-F fd           Specifies file descriptor for module relay directory\n"
 #endif
+	"-s              Look up the symbols of the backtraces the module\n"
+	"                printed with stap --defer-symbols.\n"
 	"\n"
 	"MODULE can be either a module name or a module path.  If a\n"
 	"module name is used, it is searched in the following directory:\n"));
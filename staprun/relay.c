@@ -11,6 +11,7 @@
  */
 
 #include "staprun.h"
+#include <sys/time.h>
 
 int out_fd[NR_CPUS];
 int monitor_end = 0;
@@ -25,6 +26,12 @@ static time_t *time_backlog[NR_CPUS];
 static int backlog_order=0;
 #define BACKLOG_MASK ((1 << backlog_order) - 1)
 #define MONITORLINELENGTH 4096
+#define RELAY_CHUNK 131072
+
+/* per-cpu throughput, reported by close_relayfs() */
+static uint64_t relay_bytes[NR_CPUS];
+static uint64_t relay_spliced[NR_CPUS];
+static struct timeval relay_start;
 
 #ifdef NEED_PPOLL
 int ppoll(struct pollfd *fds, nfds_t nfds,
@@ -119,18 +126,197 @@ static int switch_outfile(int cpu, int *fnum)
 	return 0;
 }
 
+/* Decide whether cpu's output can be fed with splice(2).  The monitor
+   has to look at the data, and splice refuses O_APPEND outputs; ttys
+   and such may not take spliced data either, so stick to plain files
+   and pipes.  Returns the pipe to splice through in pipefd, or -1s. */
+static void init_splice(int cpu, int pipefd[2])
+{
+	struct stat st;
+	int flags;
+
+	pipefd[0] = pipefd[1] = -1;
+	if (monitor || defer_symbols || getenv("SYSTEMTAP_NO_SPLICE"))
+		return;
+	if (fstat(out_fd[cpu], &st) < 0 ||
+	    !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)))
+		return;
+	flags = fcntl(out_fd[cpu], F_GETFL);
+	if (flags < 0 || (flags & O_APPEND))
+		return;
+	if (pipe_cloexec(pipefd) < 0) {
+		pipefd[0] = pipefd[1] = -1;
+		return;
+	}
+#ifdef F_SETPIPE_SZ
+	/* Let one splice move as much as one read(2) would; NB may fail
+	   against /proc/sys/fs/pipe-max-size, which is harmless. */
+	(void) fcntl(pipefd[1], F_SETPIPE_SZ, RELAY_CHUNK);
+#endif
+	dbug(2, "cpu %d: splicing relay data to output %d\n", cpu, out_fd[cpu]);
+}
+
+static void close_splice(int pipefd[2])
+{
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	pipefd[0] = pipefd[1] = -1;
+}
+
+/* Fetch the next chunk from cpu's relay file: into the pipe if
+   splicing, else into buf.  If the relay file turns out not to support
+   splice, fall back to copying for good. */
+static ssize_t relay_read(int cpu, char *buf, size_t len, int pipefd[2])
+{
+	ssize_t rc;
+
+	if (pipefd[0] >= 0) {
+		rc = splice(relay_fd[cpu], NULL, pipefd[1], NULL, len,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (rc >= 0 || (errno != EINVAL && errno != ENOSYS))
+			return rc;
+		dbug(2, "cpu %d: relay file can't splice, copying instead\n", cpu);
+		close_splice(pipefd);
+	}
+	return read(relay_fd[cpu], buf, len);
+}
+
+/* Move the wbytes that relay_read() left in the pipe on to the output.
+   Returns the number of bytes that are left over in buf instead, for
+   the copy loop to write, or -1 on error. */
+static ssize_t splice_out(int cpu, char *buf, ssize_t wbytes,
+			  off_t *wsize, int pipefd[2])
+{
+	ssize_t rc;
+
+	while (wbytes > 0) {
+		rc = splice(pipefd[0], NULL, out_fd[cpu], NULL, wbytes,
+			    SPLICE_F_MOVE);
+		if (rc > 0) {
+			wbytes -= rc;
+			*wsize += rc;
+			relay_bytes[cpu] += rc;
+			relay_spliced[cpu] += rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && errno == EINVAL) {
+			/* The output won't take spliced data after all.
+			   Pull the rest back out of the pipe and stop
+			   splicing. */
+			ssize_t got = 0;
+			dbug(2, "cpu %d: output can't splice, copying instead\n", cpu);
+			while (got < wbytes) {
+				rc = read(pipefd[0], buf + got, wbytes - got);
+				if (rc <= 0)
+					break;
+				got += rc;
+			}
+			close_splice(pipefd);
+			if (got == wbytes)
+				return got;
+		}
+		perr("Couldn't write to output %d for cpu %d, exiting.",
+		     out_fd[cpu], cpu);
+		return -1;
+	}
+	return 0;
+}
+
+/* Write wbytes from wbuf, or from the pipe if relay_read() spliced
+   them there, on to cpu's output, switching output files as needed. */
+static int write_out(int cpu, char *buf, char *wbuf, int wbytes,
+		     off_t *wsize, int *fnum, int pipefd[2])
+{
+	ssize_t rc;
+
+	/* Switching file */
+	pthread_mutex_lock(&mutex[cpu]);
+	if ((fsize_max && ((*wsize + wbytes) > fsize_max)) ||
+	    switch_file[cpu]) {
+		if (switch_outfile(cpu, fnum) < 0) {
+			switch_file[cpu] = 0;
+			pthread_mutex_unlock(&mutex[cpu]);
+			return -1;
+		}
+		switch_file[cpu] = 0;
+		*wsize = 0;
+	}
+	pthread_mutex_unlock(&mutex[cpu]);
+
+	if (pipefd[0] >= 0) {
+		wbytes = splice_out(cpu, buf, wbytes, wsize, pipefd);
+		if (wbytes < 0)
+			return -1;
+	}
+
+	/* Copy loop.  Must repeat write(2) in case of a pipe overflow
+	   or other transient fullness. */
+	while (wbytes > 0) {
+		if (monitor) {
+			ssize_t bytes = wbytes > MONITORLINELENGTH ? MONITORLINELENGTH : wbytes;
+			/* Start scanning the wbuf[] for lines - \n.
+			  Plop each one found into the h_queue.lines[] ring. */
+			char *p = wbuf; /* scan position */
+			char *p_end = wbuf + bytes; /* one past last byte */
+			char *line = p;
+			while (p < p_end) {
+				if (*p == '\n') { /* got a line */
+					monitor_remember_output_line(line, (p-line)+1); /* strlen, including \n */
+					line = p+1;
+				}
+				p++;
+			}
+			/* Flush remaining output */
+			if (line != p_end)
+				monitor_remember_output_line(line, (p_end - line));
+			wbytes -= bytes;
+			wbuf += bytes;
+			*wsize += bytes;
+		} else {
+			rc = write(out_fd[cpu], wbuf, wbytes);
+			if (rc <= 0) {
+				perr("Couldn't write to output %d for cpu %d, exiting.",
+				     out_fd[cpu], cpu);
+				return -1;
+			}
+			wbytes -= rc;
+			wbuf += rc;
+			*wsize += rc;
+			relay_bytes[cpu] += rc;
+		}
+	}
+	return 0;
+}
+
+/* Write out what symbolize_records() holds back for cpu. */
+static int flush_symbolized(int cpu, char *buf, off_t *wsize, int *fnum,
+			    int pipefd[2])
+{
+	char *wbuf;
+	ssize_t n = symbolize_flush(cpu, &wbuf);
+
+	if (n <= 0)
+		return n;
+	return write_out(cpu, buf, wbuf, n, wsize, fnum, pipefd);
+}
+
 /**
  *	reader_thread - per-cpu channel buffer reader
  */
 static void *reader_thread(void *data)
 {
-        char buf[131072];
+        char buf[RELAY_CHUNK];
         int rc, cpu = (int)(long)data;
         struct pollfd pollfd;
 	struct timespec tim = {.tv_sec=0, .tv_nsec=200000000}, *timeout = &tim;
 	sigset_t sigs;
 	off_t wsize = 0;
 	int fnum = 0;
+	int pipefd[2];
 
 	sigemptyset(&sigs);
 	sigaddset(&sigs,SIGUSR2);
@@ -163,6 +349,10 @@ static void *reader_thread(void *data)
 	pollfd.fd = relay_fd[cpu];
 	pollfd.events = POLLIN;
 
+	/* Bulk traces can be large, so prefer moving them through a
+	   pipe with splice(2) over copying every byte through buf. */
+	init_splice(cpu, pipefd);
+
         do {
 		dbug(3, "thread %d start ppoll\n", cpu);
                 rc = ppoll(&pollfd, 1, timeout, &sigs);
@@ -190,65 +380,39 @@ static void *reader_thread(void *data)
 			}
                 }
 
-		while ((rc = read(relay_fd[cpu], buf, sizeof(buf))) > 0) {
+		/* Nothing came in for a while: the bytes symbolize_records()
+		   held back as the possible start of a record are not one. */
+		if (rc == 0 && defer_symbols
+		    && flush_symbolized(cpu, buf, &wsize, &fnum, pipefd) < 0)
+			goto error_out;
+
+		while ((rc = relay_read(cpu, buf, sizeof(buf), pipefd)) > 0) {
                         int wbytes = rc;
                         char *wbuf = buf;
 
-			/* Switching file */
-			pthread_mutex_lock(&mutex[cpu]);
-			if ((fsize_max && ((wsize + rc) > fsize_max)) ||
-			    switch_file[cpu]) {
-				if (switch_outfile(cpu, &fnum) < 0) {
-					switch_file[cpu] = 0;
-					pthread_mutex_unlock(&mutex[cpu]);
+			/* Turn the module's symbol records into text. */
+			if (defer_symbols) {
+				ssize_t n = symbolize_records(cpu, buf, rc, &wbuf);
+				if (n < 0) {
+					_perr("symbolizing backtraces");
 					goto error_out;
 				}
-				switch_file[cpu] = 0;
-				wsize = 0;
+				wbytes = n;
 			}
-			pthread_mutex_unlock(&mutex[cpu]);
 
-                        /* Copy loop.  Must repeat write(2) in case of a pipe overflow
-                           or other transient fullness. */
-                        while (wbytes > 0) {
-				if (monitor) {
-					ssize_t bytes = wbytes > MONITORLINELENGTH ? MONITORLINELENGTH : wbytes;
-					/* Start scanning the wbuf[] for lines - \n.
-					  Plop each one found into the h_queue.lines[] ring. */
-					char *p = wbuf; /* scan position */
-					char *p_end = wbuf + bytes; /* one past last byte */
-					char *line = p;
-					while (p < p_end) {
-						if (*p == '\n') { /* got a line */
-							monitor_remember_output_line(line, (p-line)+1); /* strlen, including \n */
-							line = p+1;
-						}
-						p++;
-					}
-					/* Flush remaining output */
-					if (line != p_end)
-						monitor_remember_output_line(line, (p_end - line));
-					wbytes -= bytes;
-					wbuf += bytes;
-					wsize += bytes;
-				} else {
-	                                rc = write(out_fd[cpu], wbuf, wbytes);
-	                                if (rc <= 0) {
-						perr("Couldn't write to output %d for cpu %d, exiting.",
-	                                             out_fd[cpu], cpu);
-	                                        goto error_out;
-	                                }
-	                                wbytes -= rc;
-	                                wbuf += rc;
-	                                wsize += rc;
-				}
-                        }
+			if (write_out(cpu, buf, wbuf, wbytes, &wsize, &fnum,
+				      pipefd) < 0)
+				goto error_out;
 		}
         } while (!stop_threads);
+	if (defer_symbols && flush_symbolized(cpu, buf, &wsize, &fnum, pipefd) < 0)
+		goto error_out;
+	close_splice(pipefd);
 	dbug(3, "exiting thread for cpu %d\n", cpu);
 	return(NULL);
 
 error_out:
+	close_splice(pipefd);
 	/* Signal the main thread that we need to quit */
 	kill(getpid(), SIGTERM);
 	dbug(2, "exiting thread for cpu %d after error\n", cpu);
@@ -423,6 +587,7 @@ int init_relayfs(void)
         sigaction(SIGUSR2, &sa, NULL);
 
         dbug(2, "starting threads\n");
+	gettimeofday(&relay_start, NULL);
 	for (i = 0; i < ncpus; i++) {
 		if (pthread_mutex_init(&mutex[avail_cpus[i]], NULL) < 0) {
                         _perr("failed to create mutex");
@@ -440,6 +605,28 @@ int init_relayfs(void)
 	return 0;
 }
 
+/* Under -v, tell how fast the reader threads moved the trace data. */
+static void report_relayfs(void)
+{
+	struct timeval now;
+	uint64_t bytes = 0, spliced = 0;
+	double secs;
+	int i;
+
+	if (!verbose || !relay_start.tv_sec)
+		return;
+	for (i = 0; i < ncpus; i++) {
+		bytes += relay_bytes[avail_cpus[i]];
+		spliced += relay_spliced[avail_cpus[i]];
+	}
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - relay_start.tv_sec)
+		+ (now.tv_usec - relay_start.tv_usec) / 1000000.0;
+	eprintf(_("Relay output: %llu bytes (%llu spliced) in %.2f s, %.1f MB/s\n"),
+		(unsigned long long) bytes, (unsigned long long) spliced, secs,
+		secs > 0 ? bytes / secs / (1024 * 1024) : 0.0);
+}
+
 void close_relayfs(void)
 {
 	int i;
@@ -466,5 +653,8 @@ void close_relayfs(void)
 	for (i = 0; i < ncpus; i++) {
 		pthread_mutex_destroy(&mutex[avail_cpus[i]]);
 	}
+	report_relayfs();
+	if (defer_symbols)
+		symbolize_cleanup();
 	dbug(2, "done\n");
 }
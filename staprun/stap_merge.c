@@ -23,37 +23,614 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static void usage (char *prog)
 {
-	fprintf(stderr, "%s [-v] [-o output_filename] input_files ...\n", prog);
+	fprintf(stderr, "%s [-v] [-b] [-f] [-o output_filename] input_files ...\n", prog);
 	exit(-1);
 }
 
-#define TIMESTAMP_SIZE (sizeof(int))
-#define NR_CPUS 256
+/* Each input holds chunks of [uint32 sequence][uint32 length][data]. */
+#define HEADER_SIZE (2 * sizeof(uint32_t))
 
-int main (int argc, char *argv[])
+/* Output is written through a stdio buffer of this size, so records
+ * go out in large sequential writes. */
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+/* In follow mode, how long to hold back a record waiting for an idle
+ * input to produce a lower sequence number, and how often to poll. */
+#define FOLLOW_WAIT_MS 1000
+#define FOLLOW_POLL_MS 10
+
+/*
+ * Decoding of stap --binary-trace output (-b).  Each chunk holds a
+ * series of records, a 16-bit id and a 16-bit length followed by that
+ * many bytes.  Id 0 is plain text, 0xffff a format table entry written
+ * when the module starts, and anything else a printf whose raw
+ * arguments we format here.  See runtime/linux/print.c for the writer
+ * and translate.cxx for the format table layout; the formatting below
+ * mirrors runtime/vsprintf.c so the text comes out the same.
+ */
+
+#define BT_TEXT 0
+#define BT_FORMAT 0xffff
+#define BT_BUFFER_SIZE 8192	/* STP_BUFFER_SIZE */
+
+enum bt_flag { BT_ZEROPAD=1, BT_SIGN=2, BT_PLUS=4, BT_SPACE=8,
+	       BT_LEFT=16, BT_SPECIAL=32, BT_LARGE=64 };
+enum bt_spec { BT_UNSPECIFIED, BT_STATIC, BT_DYNAMIC };
+
+struct bt_conv {
+	char type;		/* 'L'iteral, 'd', 's', 'c' or 'b' */
+	unsigned char flags, base, widthtype, prectype;
+	int width, precision;
+	char *literal;
+};
+
+struct bt_format {
+	int nconv;
+	struct bt_conv conv[];
+};
+
+static struct bt_format *bt_formats[65536];
+static long bt_errors;
+
+static uint32_t bt_get32 (const unsigned char *p)
 {
-	char *buf, *outfile_name = NULL;
-	int c, i, j, rc, dropped=0;
-	long count=0, min, num[NR_CPUS] = { 0 };
-	FILE *ofp = NULL;
-	FILE *fp[NR_CPUS] = { 0 };
-	int ncpus, len, verbose = 0;
-	int bufsize = 65536;
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void bt_add_format (const char *rec, int len)
+{
+	const unsigned char *p = (const unsigned char *)rec + 2;
+	const unsigned char *end = (const unsigned char *)rec + len;
+	struct bt_format *f;
+	uint16_t id;
+	int n = 0;
 
-	buf = malloc(bufsize);
-	if (buf == NULL) {
+	if (len < 2) {
+		bt_errors++;
+		return;
+	}
+	memcpy(&id, rec, sizeof(id));
+
+	/* Every component takes at least two bytes. */
+	f = calloc(1, sizeof(*f) + (len / 2) * sizeof(struct bt_conv));
+	if (f == NULL) {
 		fprintf(stderr, "Memory allocation failed.\n");
 		exit(-2);
 	}
 
-	while ((c = getopt (argc, argv, "vo:")) != EOF)  {
+	while (p < end) {
+		struct bt_conv *c = &f->conv[n++];
+		c->type = *p++;
+		if (c->type == 'L') {
+			const unsigned char *nul = memchr(p, 0, end - p);
+			if (nul == NULL)
+				goto bad;
+			c->literal = strdup((const char *)p);
+			p = nul + 1;
+			continue;
+		}
+		if (end - p < 12)
+			goto bad;
+		c->flags = p[0];
+		c->base = p[1];
+		c->widthtype = p[2];
+		c->prectype = p[3];
+		c->width = bt_get32(p + 4);
+		c->precision = bt_get32(p + 8);
+		p += 12;
+	}
+	f->nconv = n;
+	free(bt_formats[id]);
+	bt_formats[id] = f;
+	return;
+
+bad:
+	bt_errors++;
+	free(f);
+}
+
+static char *bt_number (char *buf, char *end, uint64_t num, int base,
+			int size, int precision, int type)
+{
+	char c, sign, tmp[66];
+	const char *digits;
+	static const char small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	static const char large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	int i;
+
+	digits = (type & BT_LARGE) ? large_digits : small_digits;
+	if (type & BT_LEFT)
+		type &= ~BT_ZEROPAD;
+	if (base < 2 || base > 36)
+		return buf;
+	c = (type & BT_ZEROPAD) ? '0' : ' ';
+	sign = 0;
+	if (type & BT_SIGN) {
+		if ((int64_t) num < 0) {
+			sign = '-';
+			num = - (int64_t) num;
+			size--;
+		} else if (type & BT_PLUS) {
+			sign = '+';
+			size--;
+		} else if (type & BT_SPACE) {
+			sign = ' ';
+			size--;
+		}
+	}
+	if (type & BT_SPECIAL) {
+		if (base == 16)
+			size -= 2;
+		else if (base == 8)
+			size--;
+	}
+	i = 0;
+	if (num == 0)
+		tmp[i++] = '0';
+	else while (num != 0) {
+		tmp[i++] = digits[num % base];
+		num /= base;
+	}
+	if (i > precision)
+		precision = i;
+	size -= precision;
+	if (!(type & (BT_ZEROPAD + BT_LEFT)))
+		while (size-- > 0) {
+			if (buf <= end)
+				*buf = ' ';
+			++buf;
+		}
+	if (sign) {
+		if (buf <= end)
+			*buf = sign;
+		++buf;
+	}
+	if (type & BT_SPECIAL) {
+		if (base == 8) {
+			if (buf <= end)
+				*buf = '0';
+			++buf;
+		} else if (base == 16) {
+			if (buf <= end)
+				*buf = '0';
+			++buf;
+			if (buf <= end)
+				*buf = digits[33];
+			++buf;
+		}
+	}
+	if (!(type & BT_LEFT))
+		while (size-- > 0) {
+			if (buf <= end)
+				*buf = c;
+			++buf;
+		}
+	while (i < precision--) {
+		if (buf <= end)
+			*buf = '0';
+		++buf;
+	}
+	while (i-- > 0) {
+		if (buf <= end)
+			*buf = tmp[i];
+		++buf;
+	}
+	while (size-- > 0) {
+		if (buf <= end)
+			*buf = ' ';
+		++buf;
+	}
+	return buf;
+}
+
+static char *bt_char (char *str, char *end, char c, int width, int flags)
+{
+	char escape = 0;
+	int size = 1;
+
+	if ((flags & BT_SPECIAL) &&
+	    (!(isprint((unsigned char)c) && isascii(c)) || c == '\'' || c == '\\')) {
+		switch (c) {
+		case '\a': escape = 'a'; break;
+		case '\b': escape = 'b'; break;
+		case '\f': escape = 'f'; break;
+		case '\n': escape = 'n'; break;
+		case '\r': escape = 'r'; break;
+		case '\t': escape = 't'; break;
+		case '\v': escape = 'v'; break;
+		case '\'': escape = '\''; break;
+		case '\\': escape = '\\'; break;
+		}
+		size = escape ? 2 : 4;
+	}
+
+	if (!(flags & BT_LEFT))
+		while (width-- > size) {
+			if (str <= end)
+				*str = ' ';
+			++str;
+		}
+
+	if (size == 1) {
+		if (str <= end)
+			*str = c;
+		++str;
+	} else {
+		char out[4] = { '\\', escape,
+				'0' + ((c >> 3) & 07), '0' + (c & 07) };
+		int i;
+		if (!escape)
+			out[1] = '0' + ((c >> 6) & 03);
+		for (i = 0; i < size; i++) {
+			if (str <= end)
+				*str = out[i];
+			++str;
+		}
+	}
+
+	while (width-- > size) {
+		if (str <= end)
+			*str = ' ';
+		++str;
+	}
+	return str;
+}
+
+static char *bt_string (char *str, char *end, const char *ptr,
+			int width, int precision, int flags)
+{
+	int i, len = strnlen(ptr, precision);
+
+	if (!(flags & BT_LEFT))
+		while (len < width-- && str <= end)
+			*str++ = ' ';
+	for (i = 0; i < len && str <= end; ++i)
+		*str++ = *ptr++;
+	while (len < width-- && str <= end)
+		*str++ = ' ';
+	if (flags & BT_ZEROPAD && str <= end)
+		*str++ = '\0';
+	return str;
+}
+
+static int bt_binary_precision (int precision)
+{
+	switch (precision) {
+	case -1: case 1: case 2: case 4: case 8:
+		return precision;
+	default:
+		return -1;
+	}
+}
+
+static char *bt_binary (char *str, char *end, int64_t num,
+			int width, int precision, int flags)
+{
+	precision = bt_binary_precision(precision);
+	if (width == -1) {
+		if (precision == -1) {
+			width = 8;
+			precision = 8;
+		}
+		else
+			width = precision;
+	}
+	else if (precision == -1) {
+		precision = bt_binary_precision(width);
+		if (precision == -1)
+			precision = 8;
+	}
+
+	if (!(flags & BT_LEFT))
+		while (precision < width-- && str <= end)
+			*str++ = '\0';
+
+	if ((str + precision - 1) <= end) {
+		int8_t n8 = num;
+		int16_t n16 = num;
+		int32_t n32 = num;
+		switch (precision) {
+		case 1: memcpy(str, &n8, 1); break;
+		case 2: memcpy(str, &n16, 2); break;
+		case 4: memcpy(str, &n32, 4); break;
+		default: memcpy(str, &num, 8); break;
+		}
+		str += precision;
+	}
+
+	while (precision < width-- && str <= end)
+		*str++ = '\0';
+	return str;
+}
+
+static int bt_clamp (int64_t val, char *str, char *end)
+{
+	if (val < 0)
+		return 0;
+	if (val > end - str + 1)
+		return end - str + 1;
+	return val;
+}
+
+/* Pull the next argument of SIZE bytes out of a record. */
+#define BT_ARG(dst, size)				\
+	do {						\
+		if (p + (size) > pend)			\
+			return -1;			\
+		memcpy((dst), p, (size));		\
+		p += (size);				\
+	} while (0)
+
+static int bt_print_record (FILE *ofp, const struct bt_format *f,
+			    const char *p, int len)
+{
+	static char out[BT_BUFFER_SIZE];
+	char *str = out, *end = out + sizeof(out) - 1;
+	const char *pend = p + len;
+	int i;
+
+	for (i = 0; i < f->nconv; i++) {
+		const struct bt_conv *c = &f->conv[i];
+		int width = -1, precision = -1;
+		int64_t val = 0;
+
+		if (c->type == 'L') {
+			const char *src = c->literal;
+			while (*src && str <= end)
+				*str++ = *src++;
+			continue;
+		}
+
+		if (c->widthtype == BT_DYNAMIC) {
+			BT_ARG(&val, 8);
+			width = bt_clamp(val, str, end);
+		} else if (c->widthtype == BT_STATIC)
+			width = bt_clamp(c->width, str, end);
+		if (c->prectype == BT_DYNAMIC) {
+			BT_ARG(&val, 8);
+			precision = bt_clamp(val, str, end);
+		} else if (c->prectype == BT_STATIC)
+			precision = bt_clamp(c->precision, str, end);
+
+		switch (c->type) {
+		case 'd':
+			BT_ARG(&val, 8);
+			str = bt_number(str, end, val, c->base,
+					width, precision, c->flags);
+			break;
+		case 'b':
+			BT_ARG(&val, 8);
+			str = bt_binary(str, end, val, width, precision, c->flags);
+			break;
+		case 'c': {
+			char ch;
+			BT_ARG(&ch, 1);
+			str = bt_char(str, end, ch, width, c->flags);
+			break;
+		}
+		case 's': {
+			const char *nul = memchr(p, 0, pend - p);
+			if (nul == NULL)
+				return -1;
+			str = bt_string(str, end, p, width, precision, c->flags);
+			p = nul + 1;
+			break;
+		}
+		default:
+			return -1;
+		}
+	}
+
+	if (str > end + 1)
+		str = end + 1;
+	return fwrite(out, str - out, 1, ofp) == 1 || str == out ? 0 : -1;
+}
+
+static int bt_print_chunk (FILE *ofp, const char *buf, int len)
+{
+	const char *end = buf + len;
+
+	while (end - buf >= 4) {
+		uint16_t id, rlen;
+		memcpy(&id, buf, sizeof(id));
+		memcpy(&rlen, buf + 2, sizeof(rlen));
+		buf += 4;
+		if (rlen > end - buf)
+			break;
+
+		if (id == BT_TEXT) {
+			if (rlen && fwrite(buf, rlen, 1, ofp) != 1)
+				return -1;
+		} else if (id == BT_FORMAT)
+			bt_add_format(buf, rlen);
+		else if (bt_formats[id] == NULL
+			 || bt_print_record(ofp, bt_formats[id], buf, rlen) < 0)
+			bt_errors++;
+		buf += rlen;
+	}
+	if (buf != end)
+		bt_errors++;
+	return 0;
+}
+
+/*
+ * Inputs are mmap'ed when they are regular files, and grown with
+ * mremap as a live file is appended to.  Anything else (a pipe, say)
+ * is read into a buffer instead.
+ */
+struct input {
+	const char *name;
+	int fd;
+	int mapped;
+	char *base;		/* contents, from offset 0 or the buffer start */
+	size_t size;		/* bytes available at base */
+	size_t pos;		/* offset of the next chunk */
+	size_t alloc;		/* buffer size when not mapped */
+	uint32_t seq;		/* header of the chunk at pos */
+	uint32_t len;
+};
+
+static volatile sig_atomic_t stop_following;
+
+static void stop_handler (int sig)
+{
+	(void) sig;
+	stop_following = 1;
+}
+
+static void input_open (struct input *in, const char *name)
+{
+	struct stat st;
+
+	memset(in, 0, sizeof(*in));
+	in->name = name;
+	in->fd = open(name, O_RDONLY);
+	if (in->fd < 0 || fstat(in->fd, &st) < 0) {
+		fprintf(stderr, "error opening file %s.\n", name);
+		exit(-1);
+	}
+	in->mapped = S_ISREG(st.st_mode);
+}
+
+/* Make more of the input visible, returns nonzero if it grew. */
+static int input_refresh (struct input *in)
+{
+	if (in->mapped) {
+		struct stat st;
+		char *base;
+
+		if (fstat(in->fd, &st) < 0 || (size_t) st.st_size <= in->size)
+			return 0;
+		if (in->size == 0)
+			base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, in->fd, 0);
+		else
+			base = mremap(in->base, in->size, st.st_size, MREMAP_MAYMOVE);
+		if (base == MAP_FAILED) {
+			fprintf(stderr, "ERROR: couldn't map %s: %s\n",
+				in->name, strerror(errno));
+			exit(-2);
+		}
+		madvise(base, st.st_size, MADV_SEQUENTIAL);
+		in->base = base;
+		in->size = st.st_size;
+		return 1;
+	} else {
+		ssize_t rc;
+
+		/* Drop what has been consumed, then top up the buffer. */
+		if (in->pos) {
+			memmove(in->base, in->base + in->pos, in->size - in->pos);
+			in->size -= in->pos;
+			in->pos = 0;
+		}
+		if (in->size == in->alloc) {
+			in->alloc = in->alloc ? in->alloc * 2 : OUTPUT_BUFFER_SIZE;
+			in->base = realloc(in->base, in->alloc);
+			if (in->base == NULL) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(-2);
+			}
+		}
+		rc = read(in->fd, in->base + in->size, in->alloc - in->size);
+		if (rc <= 0)
+			return 0;
+		in->size += rc;
+		return 1;
+	}
+}
+
+/* Load the header of the next complete chunk, returns zero if there
+ * is none yet. */
+static int input_next (struct input *in)
+{
+	uint32_t hdr[2];
+
+	while (in->size - in->pos < HEADER_SIZE)
+		if (!input_refresh(in))
+			return 0;
+	memcpy(hdr, in->base + in->pos, HEADER_SIZE);
+	while (in->size - in->pos - HEADER_SIZE < hdr[1])
+		if (!input_refresh(in))
+			return 0;
+	in->seq = hdr[0];
+	in->len = hdr[1];
+	return 1;
+}
+
+/* A binary min-heap of inputs, ordered by their next sequence number. */
+static struct input **heap;
+static int heap_size;
+
+static void heap_push (struct input *in)
+{
+	int i = heap_size++;
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (heap[parent]->seq <= in->seq)
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = in;
+}
+
+static struct input *heap_pop (void)
+{
+	struct input *top = heap[0], *last = heap[--heap_size];
+	int i = 0;
+
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= heap_size)
+			break;
+		if (child + 1 < heap_size && heap[child + 1]->seq < heap[child]->seq)
+			child++;
+		if (last->seq <= heap[child]->seq)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+static long now_ms (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int main (int argc, char *argv[])
+{
+	char *outfile_name = NULL;
+	int c, i, ncpus, verbose = 0, binary_trace = 0, follow = 0;
+	long count = 0, dropped = 0, waiting_since = 0;
+	struct input *inputs;
+	FILE *ofp = NULL;
+
+	while ((c = getopt (argc, argv, "vbfo:")) != EOF)  {
 		switch (c) {
 		case 'v':
 			verbose = 1;
 			break;
+		case 'b':
+			binary_trace = 1;
+			break;
+		case 'f':
+			follow = 1;
+			break;
 		case 'o':
 			outfile_name = optarg;
 			break;
@@ -65,20 +642,15 @@ int main (int argc, char *argv[])
 	if (optind == argc)
 		usage (argv[0]);
 
-	i = 0;
-	while (optind < argc) {
-		fp[i] = fopen(argv[optind++], "r");
-		if (!fp[i]) {
-			fprintf(stderr, "error opening file %s.\n", argv[optind - 1]);
-			return -1;
-		}
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[i]))
-			num[i] = *((int *)buf);
-		else
-			num[i] = 0;
-		i++;
+	ncpus = argc - optind;
+	inputs = calloc(ncpus, sizeof(*inputs));
+	heap = calloc(ncpus, sizeof(*heap));
+	if (inputs == NULL || heap == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
 	}
-	ncpus = i;
+	for (i = 0; i < ncpus; i++)
+		input_open(&inputs[i], argv[optind + i]);
 
 	if (!outfile_name)
 		ofp = stdout;
@@ -90,54 +662,89 @@ int main (int argc, char *argv[])
 			return -1;
 		}
 	}
-	
-	do {
-		min = num[0];
-		j = 0;
-		for (i = 1; i < ncpus; i++) {
-			if (min == 0 || (num[i] && num[i] < min)) {
-				min = num[i];
-				j = i;
-			}
-		}
+	setvbuf(ofp, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+	if (follow) {
+		signal(SIGINT, stop_handler);
+		signal(SIGTERM, stop_handler);
+	}
+
+	for (i = 0; i < ncpus; i++)
+		if (input_next(&inputs[i]))
+			heap_push(&inputs[i]);
 
-		if (fread(&len, sizeof(int), 1, fp[j])) {
-			if (verbose)
-				fprintf(stdout, "[CPU:%d, seq=%ld, length=%d]\n", j, min, len);
-			if (len > bufsize) {
-				bufsize = len;
-				if (verbose) fprintf(stderr, "reallocating %d bytes\n", bufsize);
-				buf = realloc(buf, bufsize);
-				if (buf == NULL) {
-					fprintf(stderr, "Memory allocation failed.\n");	
-					exit(-2);
+	for (;;) {
+		struct input *in;
+		const char *data;
+
+		/*
+		 * Sequence numbers are global, so a live input that has
+		 * nothing for us yet may still produce a lower one.  Hold
+		 * the lowest chunk back until every input has something,
+		 * it is the next one expected, or we've waited long enough
+		 * to call the gap a drop.
+		 */
+		if (follow && !(heap_size == ncpus
+				|| (heap_size && heap[0]->seq == (uint32_t) (count + 1))
+				|| (heap_size && waiting_since
+				    && now_ms() - waiting_since >= FOLLOW_WAIT_MS))) {
+			if (stop_following)
+				follow = 0; /* drain what is there and finish */
+			else {
+				struct timespec ts = { 0, FOLLOW_POLL_MS * 1000000L };
+				if (!waiting_since) {
+					waiting_since = now_ms();
+					fflush(ofp);
 				}
+				nanosleep(&ts, NULL);
 			}
-			if ((rc = fread(buf, len, 1, fp[j])) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
-				exit(-3);
-			}
-			if ((rc = fwrite(buf, len, 1, ofp)) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
+			heap_size = 0;
+			for (i = 0; i < ncpus; i++)
+				if (input_next(&inputs[i]))
+					heap_push(&inputs[i]);
+			continue;
+		}
+
+		if (heap_size == 0)
+			break;
+		waiting_since = 0;
+
+		in = heap_pop();
+		data = in->base + in->pos + HEADER_SIZE;
+		if (verbose)
+			fprintf(stdout, "[CPU:%ld, seq=%lu, length=%u]\n",
+				(long) (in - inputs), (unsigned long) in->seq, in->len);
+
+		if (binary_trace) {
+			if (bt_print_chunk(ofp, data, in->len) < 0) {
+				fprintf(stderr, "fwrite error: %s\n", strerror(errno));
 				exit(-3);
 			}
 		}
+		else if (in->len && fwrite(data, in->len, 1, ofp) != 1) {
+			fprintf(stderr, "fwrite error: %s\n", strerror(errno));
+			exit(-3);
+		}
 
-		if (min && ++count != min) {
-			fprintf(stderr, "got %ld. expected %ld\n", min, count);
-			dropped += min - count ;
-			count = min;
+		if (in->seq && ++count != in->seq) {
+			fprintf(stderr, "got %lu. expected %ld\n",
+				(unsigned long) in->seq, count);
+			dropped += in->seq - count;
+			count = in->seq;
 		}
 
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[j]))
-			num[j] = *((int *)buf);
-		else
-			num[j] = 0;
-	} while (min);
+		in->pos += HEADER_SIZE + in->len;
+		if (input_next(in))
+			heap_push(in);
+		else if (!follow && in->pos != in->size)
+			fprintf(stderr, "%s: ignoring truncated chunk\n", in->name);
+	}
 
 	for (i = 0; i < ncpus; i++)
-		fclose (fp[i]);
+		close (inputs[i].fd);
 	fclose (ofp);
-	printf ("sequence had %d drops\n", dropped);
+	printf ("sequence had %ld drops\n", dropped);
+	if (bt_errors)
+		printf ("%ld binary trace records could not be decoded\n", bt_errors);
 	return 0;
 }
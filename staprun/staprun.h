@@ -236,6 +236,11 @@ void monitor_input(void);
 void monitor_exited(void);
 void monitor_remember_output_line(const char* buf, const size_t bytes);
 
+/* symbolize.c functions */
+ssize_t symbolize_records(int cpu, char *buf, size_t len, char **out);
+ssize_t symbolize_flush(int cpu, char **out);
+void symbolize_cleanup(void);
+
 /*
  * variables
  */
@@ -274,6 +279,7 @@ extern int relay_basedir_fd;
 extern int color_errors;
 extern int monitor;
 extern int monitor_interval;
+extern int defer_symbols;
 
 typedef enum {color_never, color_auto, color_always} color_modes;
 extern color_modes color_mode;
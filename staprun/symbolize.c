@@ -0,0 +1,794 @@
+/* -*- linux-c -*-
+ *
+ * symbolize.c - look up the symbols of deferred backtraces
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2016 Red Hat Inc.
+ */
+
+/* With stap --defer-symbols, the module writes a struct _stp_symrec
+   into its output for every address of a printed backtrace, instead
+   of looking the symbol up in probe context.  The reader threads pass
+   what they read through symbolize_records(), which finds the symbol
+   in the ELF file of the address' module and formats the line the way
+   the runtime's _stp_snprint_addr() would have. */
+
+#include "staprun.h"
+#include <elf.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+/* Only the _STP_SYM_* flags and types, none of the runtime's code. */
+#define STP_SYMBOL_DATA
+#include "../runtime/sym.h"
+
+struct symbol {
+	uint64_t rel;		/* relative to the section, as in the record */
+	const char *name;
+};
+
+/* The symbols of one section of one ELF file, sorted by address.  An
+   entry without symbols remembers a file that couldn't be read. */
+struct symtab {
+	struct symtab *next;
+	char *path;
+	char *secname;
+	unsigned char build_id[255];
+	unsigned build_id_len;
+	struct symbol *syms;
+	size_t nsyms;
+	void *map;		/* the file, which the names point into */
+	size_t map_size;
+	char *strings;		/* or a copy of them, for /proc/kallsyms */
+};
+
+static struct symtab *symtabs;
+static pthread_mutex_t symtabs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The unfinished record at the end of what each cpu's reader has seen,
+   and the buffer its text is written to. */
+static struct {
+	char *carry;
+	size_t carry_len;
+	char *out;
+	size_t out_len, out_size;
+} symbolize_cpu[NR_CPUS];
+
+
+/* A mapped ELF file, in the host's byte order. */
+struct elf_file {
+	const unsigned char *data;
+	size_t size;
+	int is64;
+};
+
+static int elf_ehdr(const struct elf_file *f, Elf64_Ehdr *eh)
+{
+	const Elf32_Ehdr *e32;
+
+	if (f->is64) {
+		if (f->size < sizeof(Elf64_Ehdr))
+			return -1;
+		memcpy(eh, f->data, sizeof(*eh));
+		return 0;
+	}
+	if (f->size < sizeof(Elf32_Ehdr))
+		return -1;
+	e32 = (const Elf32_Ehdr *) f->data;
+	eh->e_type = e32->e_type;
+	eh->e_phoff = e32->e_phoff;
+	eh->e_shoff = e32->e_shoff;
+	eh->e_phentsize = e32->e_phentsize;
+	eh->e_phnum = e32->e_phnum;
+	eh->e_shentsize = e32->e_shentsize;
+	eh->e_shnum = e32->e_shnum;
+	eh->e_shstrndx = e32->e_shstrndx;
+	return 0;
+}
+
+static int elf_shdr(const struct elf_file *f, const Elf64_Ehdr *eh,
+		    unsigned i, Elf64_Shdr *sh)
+{
+	uint64_t off = eh->e_shoff + (uint64_t) i * eh->e_shentsize;
+
+	if (f->is64) {
+		if (eh->e_shentsize < sizeof(Elf64_Shdr)
+		    || off + sizeof(Elf64_Shdr) > f->size)
+			return -1;
+		memcpy(sh, f->data + off, sizeof(*sh));
+	} else {
+		Elf32_Shdr s32;
+		if (eh->e_shentsize < sizeof(Elf32_Shdr)
+		    || off + sizeof(Elf32_Shdr) > f->size)
+			return -1;
+		memcpy(&s32, f->data + off, sizeof(s32));
+		sh->sh_name = s32.sh_name;
+		sh->sh_type = s32.sh_type;
+		sh->sh_flags = s32.sh_flags;
+		sh->sh_addr = s32.sh_addr;
+		sh->sh_offset = s32.sh_offset;
+		sh->sh_size = s32.sh_size;
+		sh->sh_link = s32.sh_link;
+		sh->sh_entsize = s32.sh_entsize;
+	}
+	if (sh->sh_type != SHT_NOBITS
+	    && (sh->sh_offset > f->size || sh->sh_size > f->size - sh->sh_offset))
+		return -1;
+	return 0;
+}
+
+static int elf_phdr(const struct elf_file *f, const Elf64_Ehdr *eh,
+		    unsigned i, Elf64_Phdr *ph)
+{
+	uint64_t off = eh->e_phoff + (uint64_t) i * eh->e_phentsize;
+
+	if (f->is64) {
+		if (eh->e_phentsize < sizeof(Elf64_Phdr)
+		    || off + sizeof(Elf64_Phdr) > f->size)
+			return -1;
+		memcpy(ph, f->data + off, sizeof(*ph));
+	} else {
+		Elf32_Phdr p32;
+		if (eh->e_phentsize < sizeof(Elf32_Phdr)
+		    || off + sizeof(Elf32_Phdr) > f->size)
+			return -1;
+		memcpy(&p32, f->data + off, sizeof(p32));
+		ph->p_type = p32.p_type;
+		ph->p_offset = p32.p_offset;
+		ph->p_vaddr = p32.p_vaddr;
+		ph->p_filesz = p32.p_filesz;
+	}
+	return 0;
+}
+
+static void elf_sym(const struct elf_file *f, const Elf64_Shdr *sh,
+		    size_t i, Elf64_Sym *sym)
+{
+	const unsigned char *p = f->data + sh->sh_offset + i * sh->sh_entsize;
+
+	if (f->is64) {
+		memcpy(sym, p, sizeof(*sym));
+	} else {
+		Elf32_Sym s32;
+		memcpy(&s32, p, sizeof(s32));
+		sym->st_name = s32.st_name;
+		sym->st_info = s32.st_info;
+		sym->st_shndx = s32.st_shndx;
+		sym->st_value = s32.st_value;
+	}
+}
+
+/* Returns the NUL-terminated string at off in section sh, or NULL. */
+static const char *elf_string(const struct elf_file *f, const Elf64_Shdr *sh,
+			      uint64_t off)
+{
+	const char *s = (const char *) f->data + sh->sh_offset + off;
+
+	if (sh->sh_type != SHT_STRTAB || off >= sh->sh_size
+	    || memchr(s, '\0', sh->sh_size - off) == NULL)
+		return NULL;
+	return s;
+}
+
+/* Finds the NT_GNU_BUILD_ID note in the notes at data. */
+static int note_build_id(const unsigned char *data, uint64_t size,
+			 unsigned char *build_id, unsigned *len)
+{
+	uint64_t off = 0;
+
+	while (off + 12 <= size) {
+		uint32_t namesz, descsz, type;
+		uint64_t name_off, desc_off;
+
+		memcpy(&namesz, data + off, 4);
+		memcpy(&descsz, data + off + 4, 4);
+		memcpy(&type, data + off + 8, 4);
+		name_off = off + 12;
+		desc_off = name_off + ((namesz + 3) & ~3U);
+		if (desc_off + descsz > size)
+			break;
+		if (type == NT_GNU_BUILD_ID && namesz == 4
+		    && memcmp(data + name_off, "GNU", 4) == 0
+		    && descsz <= 255) {
+			memcpy(build_id, data + desc_off, descsz);
+			*len = descsz;
+			return 0;
+		}
+		off = desc_off + ((descsz + 3) & ~3U);
+	}
+	return -1;
+}
+
+static int elf_build_id(const struct elf_file *f, const Elf64_Ehdr *eh,
+			unsigned char *build_id, unsigned *len)
+{
+	unsigned i;
+
+	for (i = 0; i < eh->e_shnum; i++) {
+		Elf64_Shdr sh;
+		if (elf_shdr(f, eh, i, &sh) == 0 && sh.sh_type == SHT_NOTE
+		    && note_build_id(f->data + sh.sh_offset, sh.sh_size,
+				     build_id, len) == 0)
+			return 0;
+	}
+	for (i = 0; i < eh->e_phnum; i++) {
+		Elf64_Phdr ph;
+		if (elf_phdr(f, eh, i, &ph) == 0 && ph.p_type == PT_NOTE
+		    && ph.p_offset <= f->size
+		    && ph.p_filesz <= f->size - ph.p_offset
+		    && note_build_id(f->data + ph.p_offset, ph.p_filesz,
+				     build_id, len) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol *sa = a, *sb = b;
+
+	if (sa->rel != sb->rel)
+		return sa->rel < sb->rel ? -1 : 1;
+	return 0;
+}
+
+/* Maps path and checks that it is an ELF file with the given build-id
+   (if any).  Returns 0 on success. */
+static int open_elf(const char *path, const unsigned char *build_id,
+		    unsigned build_id_len, struct elf_file *f)
+{
+	unsigned char id[255];
+	unsigned id_len = 0;
+	Elf64_Ehdr eh;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < EI_NIDENT) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	f->data = map;
+	f->size = st.st_size;
+	f->is64 = f->data[EI_CLASS] == ELFCLASS64;
+	if (memcmp(f->data, ELFMAG, SELFMAG) != 0
+	    || (f->data[EI_CLASS] != ELFCLASS32 && !f->is64)
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	    || f->data[EI_DATA] != ELFDATA2LSB
+#else
+	    || f->data[EI_DATA] != ELFDATA2MSB
+#endif
+	    || elf_ehdr(f, &eh) < 0
+	    || (build_id_len > 0
+		&& (elf_build_id(f, &eh, id, &id_len) < 0
+		    || id_len != build_id_len
+		    || memcmp(id, build_id, id_len) != 0))) {
+		dbug(2, "%s isn't the ELF file of the module\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	return 0;
+}
+
+/* Collects the symbols of secname (see struct symtab) from the ELF
+   file f, in the terms of the runtime's symbol tables, see
+   dump_symbol_tables() in translate.cxx. */
+static void read_elf_symbols(struct symtab *t, const struct elf_file *f)
+{
+	Elf64_Ehdr eh;
+	Elf64_Shdr symsh, strsh, sh;
+	uint64_t base = 0;
+	int have_symtab = 0, sec_index = -1;
+	int is_kernel = strcmp(t->secname, "_stext") == 0;
+	size_t i, n;
+	unsigned j;
+
+	memset(&symsh, 0, sizeof(symsh));
+	memset(&strsh, 0, sizeof(strsh));
+	if (elf_ehdr(f, &eh) < 0)
+		return;
+
+	/* Prefer the full .symtab over .dynsym. */
+	for (j = 0; j < eh.e_shnum; j++) {
+		if (elf_shdr(f, &eh, j, &sh) < 0)
+			continue;
+		if ((sh.sh_type == SHT_SYMTAB
+		     || (sh.sh_type == SHT_DYNSYM && !have_symtab))
+		    && sh.sh_entsize >= (f->is64 ? sizeof(Elf64_Sym)
+					 : sizeof(Elf32_Sym))
+		    && elf_shdr(f, &eh, sh.sh_link, &strsh) == 0) {
+			symsh = sh;
+			have_symtab = sh.sh_type == SHT_SYMTAB ? 2 : 1;
+		}
+	}
+	if (!have_symtab)
+		return;
+
+	if (eh.e_type == ET_REL) {
+		/* Module sections: addresses are section offsets. */
+		Elf64_Shdr shstr;
+		if (elf_shdr(f, &eh, eh.e_shstrndx, &shstr) < 0)
+			return;
+		for (j = 0; j < eh.e_shnum; j++) {
+			const char *name;
+			if (elf_shdr(f, &eh, j, &sh) == 0
+			    && (name = elf_string(f, &shstr, sh.sh_name))
+			    && strcmp(name, t->secname) == 0) {
+				sec_index = j;
+				break;
+			}
+		}
+		if (sec_index < 0)
+			return;
+	} else if (is_kernel) {
+		/* The kernel: addresses are relative to _stext. */
+		n = symsh.sh_size / symsh.sh_entsize;
+		for (i = 0; i < n; i++) {
+			Elf64_Sym sym;
+			const char *name;
+			elf_sym(f, &symsh, i, &sym);
+			name = elf_string(f, &strsh, sym.st_name);
+			if (name && strcmp(name, "_stext") == 0) {
+				base = sym.st_value;
+				break;
+			}
+		}
+		if (i == n)
+			return;
+	} else if (strcmp(t->secname, ".dynamic") == 0) {
+		/* Shared libraries and PIEs: addresses are relative to
+		   the start of the first mapping. */
+		base = (uint64_t) -1;
+		for (j = 0; j < eh.e_phnum; j++) {
+			Elf64_Phdr ph;
+			if (elf_phdr(f, &eh, j, &ph) == 0 && ph.p_type == PT_LOAD
+			    && ph.p_vaddr < base)
+				base = ph.p_vaddr;
+		}
+		if (base == (uint64_t) -1)
+			base = 0;
+		base &= ~(uint64_t) (getpagesize() - 1);
+	}
+
+	n = symsh.sh_size / symsh.sh_entsize;
+	t->syms = calloc(n ? n : 1, sizeof(struct symbol));
+	if (t->syms == NULL)
+		return;
+	for (i = 0; i < n; i++) {
+		Elf64_Sym sym;
+		const char *name;
+		int type;
+
+		elf_sym(f, &symsh, i, &sym);
+		type = ELF64_ST_TYPE(sym.st_info);
+		if (!(type == STT_FUNC || type == STT_OBJECT
+		      || (type == STT_NOTYPE
+			  && (eh.e_type == ET_REL || is_kernel))))
+			continue;
+		if (sym.st_shndx == SHN_UNDEF
+		    || (sec_index >= 0 && sym.st_shndx != sec_index)
+		    || (is_kernel && type == STT_FUNC && sym.st_shndx == SHN_ABS)
+		    || sym.st_value < base)
+			continue;
+		name = elf_string(f, &strsh, sym.st_name);
+		if (name == NULL || name[0] == '\0')
+			continue;
+		t->syms[t->nsyms].rel = sym.st_value - base;
+		t->syms[t->nsyms].name = name;
+		t->nsyms++;
+	}
+	qsort(t->syms, t->nsyms, sizeof(struct symbol), symbol_cmp);
+}
+
+/* Without a vmlinux, fall back on /proc/kallsyms for the kernel.  The
+   addresses are zero unless we may see them. */
+static void read_kallsyms(struct symtab *t)
+{
+	FILE *fp = fopen("/proc/kallsyms", "r");
+	unsigned long long addr, stext = 0;
+	size_t alloc = 0, strings_len = 0, strings_size = 0, i;
+	size_t *name_off = NULL;
+	char line[512], type, name[256];
+
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len;
+		/* Leave out the modules' symbols. */
+		if (strchr(line, '[')
+		    || sscanf(line, "%llx %c %255s", &addr, &type, name) != 3)
+			continue;
+		if (strcmp(name, "_stext") == 0)
+			stext = addr;
+		if (type != 't' && type != 'T')
+			continue;
+		if (t->nsyms == alloc) {
+			struct symbol *s;
+			size_t *o;
+			alloc = alloc ? 2 * alloc : 65536;
+			s = realloc(t->syms, alloc * sizeof(*s));
+			if (s != NULL)
+				t->syms = s;
+			o = realloc(name_off, alloc * sizeof(*o));
+			if (o != NULL)
+				name_off = o;
+			if (s == NULL || o == NULL)
+				break;
+		}
+		len = strlen(name) + 1;
+		if (strings_len + len > strings_size) {
+			char *s;
+			strings_size = strings_size ? 2 * strings_size : 1 << 20;
+			s = realloc(t->strings, strings_size);
+			if (s == NULL)
+				break;
+			t->strings = s;
+		}
+		memcpy(t->strings + strings_len, name, len);
+		t->syms[t->nsyms].rel = addr;
+		name_off[t->nsyms++] = strings_len;
+		strings_len += len;
+	}
+	fclose(fp);
+
+	if (stext == 0)
+		t->nsyms = 0;
+	for (i = 0; i < t->nsyms; i++) {
+		t->syms[i].rel -= stext;
+		t->syms[i].name = t->strings + name_off[i];
+	}
+	free(name_off);
+	qsort(t->syms, t->nsyms, sizeof(struct symbol), symbol_cmp);
+	/* The few symbols before _stext wrapped around to the end. */
+	while (t->nsyms > 0 && t->syms[t->nsyms - 1].rel > (uint64_t) -1 / 2)
+		t->nsyms--;
+}
+
+/* Finds, or reads, the symbols of section secname of the module at
+   path with the given build-id. */
+static struct symtab *get_symtab(const char *path, const char *secname,
+				 const unsigned char *build_id,
+				 unsigned build_id_len)
+{
+	struct symtab *t;
+	struct elf_file f;
+	int found;
+
+	for (t = symtabs; t; t = t->next)
+		if (t->build_id_len == build_id_len
+		    && memcmp(t->build_id, build_id, build_id_len) == 0
+		    && strcmp(t->secname, secname) == 0
+		    && strcmp(t->path, path) == 0)
+			return t;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->path = strdup(path);
+	t->secname = strdup(secname);
+	if (t->path == NULL || t->secname == NULL) {
+		free(t->path);
+		free(t->secname);
+		free(t);
+		return NULL;
+	}
+	memcpy(t->build_id, build_id, build_id_len);
+	t->build_id_len = build_id_len;
+
+	found = open_elf(path, build_id, build_id_len, &f) == 0;
+	if (!found && build_id_len > 0) {
+		/* Try the separate debuginfo by its build-id. */
+		char debug[PATH_MAX];
+		int n = snprintf(debug, sizeof(debug), "/usr/lib/debug/.build-id/%02x/",
+				 build_id[0]);
+		unsigned i;
+		for (i = 1; i < build_id_len && n < (int) sizeof(debug) - 3; i++)
+			n += snprintf(debug + n, sizeof(debug) - n, "%02x",
+				      build_id[i]);
+		if (n < (int) sizeof(debug) - 7) {
+			strcpy(debug + n, ".debug");
+			found = open_elf(debug, build_id, build_id_len, &f) == 0;
+		}
+	}
+	if (found) {
+		t->map = (void *) f.data;
+		t->map_size = f.size;
+		read_elf_symbols(t, &f);
+	} else if (strcmp(secname, "_stext") == 0)
+		read_kallsyms(t);
+	dbug(2, "%zu symbols for %s %s\n", t->nsyms, path, secname);
+
+	t->next = symtabs;
+	symtabs = t;
+	return t;
+}
+
+/* Appends to cpu's output buffer. */
+static int out_append(int cpu, const char *s, size_t len)
+{
+	if (symbolize_cpu[cpu].out_len + len > symbolize_cpu[cpu].out_size) {
+		size_t size = symbolize_cpu[cpu].out_size;
+		char *out;
+		while (size < symbolize_cpu[cpu].out_len + len)
+			size = size ? 2 * size : 65536;
+		out = realloc(symbolize_cpu[cpu].out, size);
+		if (out == NULL)
+			return -1;
+		symbolize_cpu[cpu].out = out;
+		symbolize_cpu[cpu].out_size = size;
+	}
+	memcpy(symbolize_cpu[cpu].out + symbolize_cpu[cpu].out_len, s, len);
+	symbolize_cpu[cpu].out_len += len;
+	return 0;
+}
+
+/* Formats the address like _stp_snprint_addr() in runtime/sym.c,
+   which never gets here with _STP_SYM_LINENUMBER or _STP_SYM_FILENAME. */
+static int format_addr(char *str, size_t len, int flags, uint64_t address,
+		       const char *name, uint64_t offset, uint64_t size,
+		       const char *modname)
+{
+	const char *exstr, *poststr, *prestr;
+	char hex[24] = "";
+
+	prestr = (flags & _STP_SYM_PRE_SPACE) ? " " : "";
+	exstr = (((flags & _STP_SYM_INEXACT) && (flags & _STP_SYM_SYMBOL))
+		 ? " (inexact)" : "");
+	if (flags & _STP_SYM_POST_SPACE)
+		poststr = " ";
+	else if (flags & _STP_SYM_NEWLINE)
+		poststr = "\n";
+	else
+		poststr = "";
+
+	if (name && name[0] == '.')
+		name++;
+	if (modname && (flags & _STP_SYM_MODULE_BASENAME)) {
+		const char *slash = strrchr(modname, '/');
+		if (slash)
+			modname = slash + 1;
+	}
+	if (modname && !*modname)
+		modname = NULL;
+
+	if (name && (flags & _STP_SYM_SYMBOL)) {
+		if (flags & _STP_SYM_HEX_SYMBOL)
+			snprintf(hex, sizeof(hex), "0x%" PRIx64 " : ", address);
+		if ((flags & _STP_SYM_MODULE) && modname) {
+			if ((flags & _STP_SYM_OFFSET) && (flags & _STP_SYM_SIZE))
+				return snprintf(str, len, "%s%s%s+0x%" PRIx64 "/0x%" PRIx64 " [%s]%s%s",
+						prestr, hex, name, offset, size,
+						modname, exstr, poststr);
+			if (flags & _STP_SYM_OFFSET)
+				return snprintf(str, len, "%s%s%s+0x%" PRIx64 " [%s]%s%s",
+						prestr, hex, name, offset,
+						modname, exstr, poststr);
+			return snprintf(str, len, "%s%s%s [%s]%s%s", prestr, hex,
+					name, modname, exstr, poststr);
+		}
+		if ((flags & _STP_SYM_OFFSET) && (flags & _STP_SYM_SIZE))
+			return snprintf(str, len, "%s%s%s+0x%" PRIx64 "/0x%" PRIx64 "%s%s",
+					prestr, hex, name, offset, size,
+					exstr, poststr);
+		if (flags & _STP_SYM_OFFSET)
+			return snprintf(str, len, "%s%s%s+0x%" PRIx64 "%s%s",
+					prestr, hex, name, offset, exstr, poststr);
+		return snprintf(str, len, "%s%s%s%s%s", prestr, hex, name,
+				exstr, poststr);
+	}
+
+	/* no symbol name */
+	if (modname && (flags & _STP_SYM_MODULE)) {
+		if ((flags & _STP_SYM_OFFSET) && (flags & _STP_SYM_SIZE))
+			return snprintf(str, len, "%s0x%" PRIx64 " [%s+0x%" PRIx64 "/0x%" PRIx64 "]%s%s",
+					prestr, address, modname, offset, size,
+					exstr, poststr);
+		if (flags & _STP_SYM_OFFSET)
+			return snprintf(str, len, "%s0x%" PRIx64 " [%s+0x%" PRIx64 "]%s%s",
+					prestr, address, modname, offset,
+					exstr, poststr);
+		return snprintf(str, len, "%s0x%" PRIx64 " [%s]%s%s", prestr,
+				address, modname, exstr, poststr);
+	}
+	return snprintf(str, len, "%s0x%" PRIx64 "%s%s", prestr, address,
+			exstr, poststr);
+}
+
+/* Turns the complete record at rec into text.  Returns -1 if it turns
+   out not to be a record after all. */
+static int symbolize_one(int cpu, const char *rec, size_t len)
+{
+	struct _stp_symrec h;
+	const char *p = rec + sizeof(h), *end = rec + len;
+	const char *modname, *path, *secname, *name = NULL;
+	const unsigned char *build_id;
+	unsigned build_id_len;
+	uint64_t offset, size = 0;
+	struct symtab *t;
+	char text[2 * PATH_MAX];
+	int n;
+
+	memcpy(&h, rec, sizeof(h));
+	build_id_len = (unsigned char) *p++;
+	build_id = (const unsigned char *) p;
+	p += build_id_len;
+	modname = p;
+	if (p >= end || (p = memchr(p, '\0', end - p)) == NULL)
+		return -1;
+	path = ++p;
+	if (p >= end || (p = memchr(p, '\0', end - p)) == NULL)
+		return -1;
+	secname = ++p;
+	if (p >= end || (p = memchr(p, '\0', end - p)) == NULL
+	    || p + 1 != end)
+		return -1;
+
+	offset = h.rel;
+	pthread_mutex_lock(&symtabs_lock);
+	t = get_symtab(path, secname, build_id, build_id_len);
+	if (t && t->nsyms > 0 && h.rel >= t->syms[0].rel) {
+		/* The last symbol at or before rel, as in sym.c. */
+		size_t begin = 0, limit = t->nsyms;
+		do {
+			size_t mid = (begin + limit) / 2;
+			if (h.rel < t->syms[mid].rel)
+				limit = mid;
+			else
+				begin = mid;
+		} while (begin + 1 < limit);
+		name = t->syms[begin].name;
+		offset = h.rel - t->syms[begin].rel;
+		if (begin + 1 < t->nsyms)
+			size = t->syms[begin + 1].rel - t->syms[begin].rel;
+	}
+	n = format_addr(text, sizeof(text), h.flags, h.addr, name, offset,
+			size, modname);
+	pthread_mutex_unlock(&symtabs_lock);
+
+	if (n < 0)
+		return -1;
+	if (n >= (int) sizeof(text))
+		n = sizeof(text) - 1;
+	return out_append(cpu, text, n) < 0 ? -2 : 0;
+}
+
+/* Scans len bytes of cpu's output at buf for symbol records, and
+   returns in *out the output with the records turned into text.  A
+   record cut off at the end is kept for the next call.  Returns the
+   length of *out, or -1 if out of memory. */
+ssize_t symbolize_records(int cpu, char *buf, size_t len, char **out)
+{
+	char *data = buf, *p, *end;
+	size_t hdr = sizeof(struct _stp_symrec);
+
+	symbolize_cpu[cpu].out_len = 0;
+	if (symbolize_cpu[cpu].carry_len > 0) {
+		char *c = realloc(symbolize_cpu[cpu].carry,
+				  symbolize_cpu[cpu].carry_len + len);
+		if (c == NULL)
+			return -1;
+		memcpy(c + symbolize_cpu[cpu].carry_len, buf, len);
+		symbolize_cpu[cpu].carry = c;
+		data = c;
+		len += symbolize_cpu[cpu].carry_len;
+		symbolize_cpu[cpu].carry_len = 0;
+	}
+
+	p = data;
+	end = data + len;
+	while (p < end) {
+		char *nul = memchr(p, '\0', end - p);
+		size_t avail;
+		uint16_t rec_len;
+		int rc;
+
+		if (nul == NULL) {
+			if (out_append(cpu, p, end - p) < 0)
+				return -1;
+			p = end;
+			break;
+		}
+		if (out_append(cpu, p, nul - p) < 0)
+			return -1;
+		p = nul;
+		avail = end - p;
+
+		/* Not a record after all: pass the NUL through. */
+		if (memcmp(p, STP_SYMREC_MAGIC, avail < 4 ? avail : 4) != 0) {
+			if (out_append(cpu, p, 1) < 0)
+				return -1;
+			p++;
+			continue;
+		}
+		if (avail < hdr + 1)
+			break;
+		memcpy(&rec_len, p + offsetof(struct _stp_symrec, len),
+		       sizeof(rec_len));
+		if (rec_len < hdr + 4) {
+			if (out_append(cpu, p, 1) < 0)
+				return -1;
+			p++;
+			continue;
+		}
+		if (avail < rec_len)
+			break;
+		rc = symbolize_one(cpu, p, rec_len);
+		if (rc == -2)
+			return -1;
+		if (rc < 0) {
+			if (out_append(cpu, p, 1) < 0)
+				return -1;
+			p++;
+			continue;
+		}
+		p += rec_len;
+	}
+
+	/* Keep the start of a record for when the rest comes in. */
+	if (p < end) {
+		size_t rest = end - p;
+		if (data == symbolize_cpu[cpu].carry)
+			memmove(data, p, rest);
+		else {
+			char *c = realloc(symbolize_cpu[cpu].carry, rest);
+			if (c == NULL)
+				return -1;
+			memcpy(c, p, rest);
+			symbolize_cpu[cpu].carry = c;
+		}
+		symbolize_cpu[cpu].carry_len = rest;
+	}
+
+	*out = symbolize_cpu[cpu].out;
+	return symbolize_cpu[cpu].out_len;
+}
+
+/* Hand out what symbolize_records() held back for cpu as the start of
+   a record, as it is, once no more of it is coming. */
+ssize_t symbolize_flush(int cpu, char **out)
+{
+	ssize_t len;
+
+	if (cpu < 0 || cpu >= NR_CPUS)
+		return -1;
+	len = symbolize_cpu[cpu].carry_len;
+	*out = symbolize_cpu[cpu].carry;
+	symbolize_cpu[cpu].carry_len = 0;
+	return len;
+}
+
+void symbolize_cleanup(void)
+{
+	int cpu;
+
+	while (symtabs) {
+		struct symtab *t = symtabs;
+		symtabs = t->next;
+		if (t->map)
+			munmap(t->map, t->map_size);
+		free(t->strings);
+		free(t->syms);
+		free(t->path);
+		free(t->secname);
+		free(t);
+	}
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		free(symbolize_cpu[cpu].carry);
+		free(symbolize_cpu[cpu].out);
+		symbolize_cpu[cpu].carry = symbolize_cpu[cpu].out = NULL;
+		symbolize_cpu[cpu].carry_len = 0;
+		symbolize_cpu[cpu].out_len = symbolize_cpu[cpu].out_size = 0;
+	}
+}
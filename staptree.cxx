@@ -163,7 +163,7 @@ probe_point::component::component (interned_string f,
 
 vardecl::vardecl ():
   arity_tok(0), arity (-1), maxsize(0), init(NULL), synthetic(false), wrap(false),
-  char_ptr_arg(false)
+  percpu(false), char_ptr_arg(false)
 {
 }
 
@@ -555,6 +555,8 @@ void perf_op::print (ostream& o) const
 
 void vardecl::print (ostream& o) const
 {
+  if(percpu)
+    o << "percpu ";
   o << unmangled_name;
   if(wrap)
     o << "%";
@@ -572,6 +574,8 @@ void vardecl::print (ostream& o) const
 
 void vardecl::printsig (ostream& o) const
 {
+  if(percpu)
+    o << "percpu ";
   if (unmangled_name != "")
     o << unmangled_name;
   else
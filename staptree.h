@@ -523,6 +523,8 @@ struct print_format: public expression
   void visit (visitor* u);
 
 private:
+  friend struct parse_cache_reader;
+  friend struct parse_cache_writer;
   interned_string print_format_type;
   print_format(bool stream, bool format, bool delim, bool newline, bool _char, interned_string type):
     print_to_stream(stream), print_with_format(format),
@@ -605,6 +607,7 @@ struct vardecl: public symboldecl
   literal *init; // for global scalars only
   bool synthetic; // for probe locals only, don't init on entry
   bool wrap;
+  bool percpu; // for global arrays only, see translate.cxx
   bool char_ptr_arg; // set in ::emit_common_header(), only used if a formal_arg
 };
 
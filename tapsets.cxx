@@ -842,6 +842,7 @@ struct dwarf_query : public base_query
   virtual void handle_query_module();
   void query_module_dwarf();
   void query_module_symtab();
+  bool scans_cus(string& file_pattern, bool& inlines);
   void query_library (const char *data);
   void query_plt (const char *entry, size_t addr);
 
@@ -1120,10 +1121,34 @@ dwarf_query::query_module_dwarf()
           !startswith(function, "_Z"))
         query_module_functions();
       else
-        dw.iterate_over_cus(&query_cu, this, false);
+        {
+          // Scanning all the CUs for a wildcard is worth doing in parallel.
+          string file_pattern;
+          bool inlines;
+          if (scans_cus(file_pattern, inlines))
+            dw.scan_cus (file_pattern, inlines);
+          dw.iterate_over_cus(&query_cu, this, false);
+        }
     }
 }
 
+
+// Whether query_module_dwarf() goes over all the CUs of a module for a
+// wildcard or a source file, and what it will need from them if so.
+bool
+dwarf_query::scans_cus(string& file_pattern, bool& inlines)
+{
+  if (has_function_num || has_statement_num
+      || (!has_function_str && !has_statement_str))
+    return false;
+  if (!dw.name_has_wildcard(function) && spec_type == function_alone)
+    return false;
+
+  file_pattern = (spec_type != function_alone) ? file.to_string() : "";
+  inlines = !has_call && !has_return && !has_exported;
+  return true;
+}
+
 static void query_func_info (Dwarf_Addr entrypc, func_info & fi,
 							dwarf_query * q);
 
@@ -2546,6 +2571,74 @@ lookup_symbol_address (Dwfl_Module *m, const char* wanted)
 
 
 
+static module_info*
+query_module_info (systemtap_session& s, Dwfl_Module *mod,
+                   const char *name, Dwarf_Addr addr)
+{
+  module_info* mi = s.module_cache->cache[name];
+  if (mi == 0)
+    {
+      mi = s.module_cache->cache[name] = new module_info(name);
+
+      mi->mod = mod;
+      mi->addr = addr;
+
+      const char* debug_filename = "";
+      const char* main_filename = "";
+      (void) dwfl_module_info (mod, NULL, NULL,
+                               NULL, NULL, NULL,
+                               & main_filename,
+                               & debug_filename);
+
+      if (debug_filename || main_filename)
+        {
+          mi->elf_path = debug_filename ?: main_filename;
+        }
+      else if (name == TOK_KERNEL)
+        {
+          mi->dwarf_status = info_absent;
+        }
+    }
+  return mi;
+}
+
+
+// Before query_module goes over the modules of a wildcard probe point,
+// gather what their CUs are going to be scanned for, so that the CUs of
+// all the modules get scanned together.
+struct query_module_scan_data
+{
+  dwarf_query* q;
+  cu_scan_work* work;
+};
+
+static int
+query_module_scan (Dwfl_Module *mod,
+                   void **,
+                   const char *name,
+                   Dwarf_Addr addr,
+                   query_module_scan_data *data)
+{
+  dwarf_query* q = data->q;
+  try
+    {
+      q->dw.focus_on_module(mod, query_module_info(q->sess, mod, name, addr));
+
+      // The same modules query_module skips.
+      if (mod && q->dw.module_name_matches(q->module_val)
+          && (q->dw.module_name != TOK_KERNEL || q->has_kernel))
+        q->dw.scan_cus_prepare(*data->work);
+
+      return pending_interrupts ? DWARF_CB_ABORT : DWARF_CB_OK;
+    }
+  catch (const semantic_error& e)
+    {
+      q->sess.print_error (e);
+      return DWARF_CB_ABORT;
+    }
+}
+
+
 static int
 query_module (Dwfl_Module *mod,
               void **,
@@ -2555,30 +2648,7 @@ query_module (Dwfl_Module *mod,
 {
   try
     {
-      module_info* mi = q->sess.module_cache->cache[name];
-      if (mi == 0)
-        {
-          mi = q->sess.module_cache->cache[name] = new module_info(name);
-
-          mi->mod = mod;
-          mi->addr = addr;
-
-          const char* debug_filename = "";
-          const char* main_filename = "";
-          (void) dwfl_module_info (mod, NULL, NULL,
-                                   NULL, NULL, NULL,
-                                   & main_filename,
-                                   & debug_filename);
-
-          if (debug_filename || main_filename)
-            {
-              mi->elf_path = debug_filename ?: main_filename;
-            }
-          else if (name == TOK_KERNEL)
-            {
-              mi->dwarf_status = info_absent;
-            }
-        }
+      module_info* mi = query_module_info(q->sess, mod, name, addr);
       // OK, enough of that module_info caching business.
 
       q->dw.focus_on_module(mod, mi);
@@ -8439,6 +8509,20 @@ dwarf_builder::build(systemtap_session & sess,
       return;
     }
 
+  // A wildcard module scans the CUs of all its modules up front, with
+  // as many threads as it takes; query_module then finds the results.
+  string file_pattern;
+  bool inlines;
+  if (dw->name_has_wildcard(q.module_val) && sess.pass2_jobs > 1
+      && !q.has_library && !q.has_plt
+      && q.scans_cus(file_pattern, inlines))
+    {
+      cu_scan_work work(file_pattern, inlines);
+      query_module_scan_data data = { &q, &work };
+      dw->iterate_over_modules<query_module_scan_data>(&query_module_scan, &data);
+      dw->scan_cus_run(work);
+    }
+
   dw->iterate_over_modules<base_query>(&query_module, &q);
 
   // We need to update modules_seen with the modules we've visited
@@ -11200,6 +11284,7 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
       if (tpop == 0)
         {
           tpop = s.op_create_auxiliary();
+          tpop->cacheable_p = true;
           per_header_aux[header] = tpop;
 
           // PR9993: Add extra headers to work around undeclared types in individual
@@ -0,0 +1,24 @@
+#include <stdio.h>
+
+__attribute__((noinline)) int
+defer_leaf (int i)
+{
+  return i * 2 + 1;
+}
+
+__attribute__((noinline)) int
+defer_middle (int i)
+{
+  return defer_leaf (i + 1) + 1;
+}
+
+int
+main (void)
+{
+  int i, sum = 0;
+
+  for (i = 0; i < 3; i++)
+    sum += defer_middle (i);
+  printf ("%d\n", sum);
+  return 0;
+}
@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+static inline __attribute__((always_inline)) int
+square (int x)
+{
+  return x * x;
+}
+
+int __attribute__((noinline))
+sum_squares (int n)
+{
+  int i, sum = 0;
+  for (i = 0; i < n; i++)
+    sum += square (i);
+  return sum;
+}
+
+int __attribute__((noinline))
+square_plus_one (int x)
+{
+  return square (x) + 1;
+}
+
+int
+main (int argc, char **argv)
+{
+  printf ("%d %d\n", sum_squares (argc + 3), square_plus_one (argc));
+  return 0;
+}
@@ -0,0 +1,24 @@
+/* Compiled once per CU by dwarf_scan.exp, with a different N each time. */
+
+#define PASTE(a, b) a##b
+#define NAME(a, b) PASTE(a, b)
+
+static inline __attribute__((always_inline)) int
+scan_square (int x)
+{
+  return x * x;
+}
+
+int __attribute__((noinline))
+NAME(scan_func_, N) (int x)
+{
+  return scan_square (x) + N;
+}
+
+#if N == 0
+int
+main (int argc, char **argv)
+{
+  return scan_func_0 (argc) == 0;
+}
+#endif
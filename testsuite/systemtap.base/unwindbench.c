@@ -0,0 +1,34 @@
+#include <stdlib.h>
+
+/* Calls unwindbench_leaf() at the bottom of a chain of DEPTH frames,
+   LOOPS times over, for unwindbench.stp to take backtraces from. */
+
+volatile int sink;
+
+__attribute__((noinline)) void
+unwindbench_leaf (int i)
+{
+  sink += i;
+}
+
+__attribute__((noinline)) void
+unwindbench_down (int depth, int i)
+{
+  if (depth > 0)
+    unwindbench_down (depth - 1, i);
+  else
+    unwindbench_leaf (i);
+  sink++;
+}
+
+int
+main (int argc, char **argv)
+{
+  int depth = argc > 1 ? atoi (argv[1]) : 16;
+  int loops = argc > 2 ? atoi (argv[2]) : 100000;
+  int i;
+
+  for (i = 0; i < loops; i++)
+    unwindbench_down (depth, i);
+  return 0;
+}
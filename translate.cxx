@@ -32,6 +32,7 @@
 #include <cassert>
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
 
 extern "C" {
 #include <dwarf.h>
@@ -65,6 +66,7 @@ struct tmpvar;
 struct aggvar;
 struct mapvar;
 class itervar;
+struct percpu_use_visitor;
 
 // A null-sink output stream, similar to /dev/null
 // (no buffer -> badbit -> quietly suppressed output)
@@ -98,7 +100,8 @@ struct c_unparser: public unparser, public visitor
     session (ss), o (op ?: ss->op), current_probe(0), current_function (0),
     assigned_functioncall (0), assigned_functioncall_retval (0),
     tmpvar_counter (0), label_counter (0), action_counter(0), fc_counter(0),
-    already_checked_action_count(false), vcv_needs_global_locks (*ss) {}
+    already_checked_action_count(false), vcv_needs_global_locks (*ss),
+    percpu_accumulator (0) {}
   ~c_unparser () {}
 
   // The main c_unparser doesn't write declarations as it traverses,
@@ -122,7 +125,8 @@ struct c_unparser: public unparser, public visitor
   void emit_module_refresh ();
   void emit_module_exit ();
   void emit_function (functiondecl* v);
-  void emit_lock_decls (const varuse_collecting_visitor& v);
+  void emit_lock_decls (const varuse_collecting_visitor& v,
+                        const percpu_use_visitor& pv);
   void emit_locks ();
   void emit_probe (derived_probe* v);
   void emit_probe_condition_update(derived_probe* v);
@@ -130,6 +134,9 @@ struct c_unparser: public unparser, public visitor
 
   void emit_compiled_printfs ();
   void emit_compiled_printf_locals ();
+  void emit_binary_printf (const string& name, unsigned id,
+                           const vector<print_format::format_component>& components);
+  void emit_binary_printf_formats ();
   void declare_compiled_printf (bool print_to_stream, const string& format);
   virtual const string& get_compiled_printf (bool print_to_stream,
 					     const string& format);
@@ -137,6 +144,9 @@ struct c_unparser: public unparser, public visitor
   // for use by stats (pmap) foreach
   set<string> aggregations_active;
 
+  // percpu array element being accumulated by the current expr_statement
+  arrayindex* percpu_accumulator;
+
   // values immediately available in foreach_loop iterations
   map<string, string> foreach_loop_values;
   void visit_foreach_loop_value (foreach_loop* s, const string& value="");
@@ -254,9 +264,17 @@ struct c_tmpcounter cxx_final: public c_unparser
   c_unparser* parent;
   set<string> declared_vars;
 
-  c_tmpcounter (c_unparser* p):
-    c_unparser(p->session, &null_o), parent (p)
-  { }
+  // The estimated layout of the locals struct being emitted, as the
+  // size so far of each nested struct (false) or union (true).
+  vector<pair<bool, unsigned> > layout;
+  unsigned string_size;
+
+  // What the locals of each probe, and of the biggest function, take.
+  vector<pair<unsigned, string> > probe_sizes;
+  unsigned function_size;
+  string function_name;
+
+  c_tmpcounter (c_unparser* p);
 
   // When vars are created *and used* (i.e. not overridden tmpvars) they call
   // var_declare(), which will forward to the parent c_unparser for output;
@@ -264,6 +282,12 @@ struct c_tmpcounter cxx_final: public c_unparser
 
   void emit_function (functiondecl* fd);
   void emit_probe (derived_probe* dp);
+  void emit_locals (const vector<vardecl*>& locals, statement* body);
+
+  void layout_begin (bool union_p);
+  void layout_add (unsigned size);
+  unsigned layout_end ();
+  void report_sizes ();
 
   const string& get_compiled_printf (bool print_to_stream,
 				     const string& format) cxx_override;
@@ -554,6 +578,12 @@ public:
   {
     c.c_declare(ty, c_name());
   }
+
+  // Roughly what the declaration takes in the context, for -v.
+  virtual unsigned declared_size(unsigned string_size) const
+  {
+    return ty == pe_string ? string_size : 8;
+  }
 };
 
 ostream & operator<<(ostream & o, var const & v)
@@ -565,7 +595,10 @@ void
 c_tmpcounter::var_declare (string const& name, var const& v)
 {
   if (declared_vars.insert(name).second)
-    v.declare (*parent);
+    {
+      v.declare (*parent);
+      layout_add (v.declared_size (string_size));
+    }
 }
 
 struct stmt_expr
@@ -656,15 +689,16 @@ struct mapvar
   vector<exp_type> index_types;
   int maxsize;
   bool wrap;
+  bool percpu;
   mapvar (c_unparser *u,
           bool local, exp_type ty,
 	  statistic_decl const & sd,
 	  string const & name,
 	  vector<exp_type> const & index_types,
-	  int maxsize, bool wrap)
+	  int maxsize, bool wrap, bool percpu)
     : var (u, local, ty, sd, name),
       index_types (index_types),
-      maxsize (maxsize), wrap(wrap)
+      maxsize (maxsize), wrap(wrap), percpu(percpu)
   {}
 
   static string shortname(exp_type e);
@@ -721,7 +755,7 @@ struct mapvar
 
   bool is_parallel() const
   {
-    return type() == pe_stats;
+    return type() == pe_stats || percpu;
   }
 
   string stat_op_tokens() const
@@ -804,7 +838,7 @@ struct mapvar
     string res = "{ int rc = ";
 
     // impedance matching: empty strings -> NULL
-    if (type() == pe_stats)
+    if (type() == pe_stats || (type() == pe_long && percpu))
       res += (call_prefix("add", indices) + ", " + val.value() + ", " + stat_op_parms() + ")");
     else
       throw SEMANTIC_ERROR(_("adding a value of an unsupported map type"));
@@ -910,6 +944,13 @@ struct mapvar
     else
       return "_stp_map_del (" + value() + ");";
   }
+
+  // Give the map a heap for the partial sorts of foreach ... limit.
+  string sortn_alloc () const
+  {
+    string prefix = is_parallel() ? "_stp_pmap" : "_stp_map";
+    return "if (!rc) rc = " + prefix + "_sortn_alloc (" + value() + ");";
+  }
 };
 
 
@@ -930,6 +971,11 @@ public:
     c.o->newline() << "struct map_node *" << name << ";";
   }
 
+  unsigned declared_size(unsigned) const cxx_override
+  {
+    return 8;
+  }
+
   string start (mapvar const & mv) const
   {
     string res;
@@ -1133,6 +1179,8 @@ c_unparser::emit_common_header ()
 
   // Try to catch a crazy user dude passing in -DMAXNESTING=-1, leading to a [0]-sized
   // locals[] array.
+  ct.report_sizes ();
+
   o->newline() << "#if MAXNESTING < 0";
   o->newline() << "#error \"MAXNESTING must be positive\"";
   o->newline() << "#endif";
@@ -1220,6 +1268,123 @@ c_tmpcounter::get_compiled_printf (bool print_to_stream, const string& format)
   return parent->get_compiled_printf (print_to_stream, format);
 }
 
+// Under --binary-trace, a printf is sent as a record holding its format
+// id and raw arguments, and stap-merge -b formats it offline from the
+// format table written at module startup.  %m/%M read memory that is
+// gone by then, and pre-1.3 %p has rules of its own, so formats using
+// them keep the text path.  So do literals with an embedded NUL, which
+// would cut their format table entry short.
+
+// Record ids are 16 bits; 0 and 0xffff are taken by text and format
+// table records.
+#define BINARY_PRINTF_MAX_ID 0xfffe
+
+static bool
+literal_has_nul (interned_string s)
+{
+  for (unsigned i = 0; i + 1 < s.size(); i++)
+    {
+      if (s[i] != '\\')
+        continue;
+      unsigned value = 0, digits = 0, j = i + 1;
+      if (s[j] == 'x')
+        for (j++; j < s.size() && isxdigit(s[j]); j++, digits++)
+          value = value * 16 + (isdigit(s[j]) ? s[j] - '0' : tolower(s[j]) - 'a' + 10);
+      else
+        for (; j < s.size() && digits < 3 && s[j] >= '0' && s[j] <= '7'; j++, digits++)
+          value = value * 8 + (s[j] - '0');
+      if (digits && (value & 0xff) == 0)
+        return true;
+      i = digits ? j - 1 : j; // skip the whole escape
+    }
+  return false;
+}
+
+static bool
+binary_printf_p (systemtap_session& s,
+                 const vector<print_format::format_component>& components)
+{
+  vector<print_format::format_component>::const_iterator c;
+  for (c = components.begin(); c != components.end(); ++c)
+    switch (c->type)
+      {
+      case print_format::conv_memory:
+      case print_format::conv_memory_hex:
+        return false;
+      case print_format::conv_pointer:
+        if (strverscmp(s.compatible.c_str(), "1.3") < 0)
+          return false;
+        break;
+      case print_format::conv_literal:
+        if (literal_has_nul (c->literal_string))
+          return false;
+        break;
+      default:
+        break;
+      }
+  return true;
+}
+
+// The format table entry of a binary printf, as C string literals.  Each
+// component is a type byte; literals follow it with their text and a NUL,
+// conversions with flags, base, width type, precision type, and the
+// static width and precision as 32-bit little-endian values.
+static string
+binary_printf_descriptor (const vector<print_format::format_component>& components)
+{
+  ostringstream d;
+  vector<print_format::format_component>::const_iterator c;
+  for (c = components.begin(); c != components.end(); ++c)
+    {
+      vector<unsigned char> bytes;
+      switch (c->type)
+        {
+        case print_format::conv_literal:
+          d << "\"L\" \"";
+          for (unsigned i = 0; i < c->literal_string.size(); i++)
+            {
+              char ch = c->literal_string[i];
+              if (ch == '"')
+                d << '\\';
+              d << ch;
+            }
+          d << "\" \"\\0\" ";
+          continue;
+        case print_format::conv_pointer:
+        case print_format::conv_number:
+          bytes.push_back('d');
+          break;
+        case print_format::conv_string:
+          bytes.push_back('s');
+          break;
+        case print_format::conv_char:
+          bytes.push_back('c');
+          break;
+        case print_format::conv_binary:
+          bytes.push_back('b');
+          break;
+        default:
+          assert(false);
+          break;
+        }
+      bytes.push_back(c->flags);
+      bytes.push_back(c->base);
+      bytes.push_back(c->widthtype);
+      bytes.push_back(c->prectype);
+      for (unsigned i = 0; i < 4; i++)
+        bytes.push_back((c->width >> (8 * i)) & 0xff);
+      for (unsigned i = 0; i < 4; i++)
+        bytes.push_back((c->precision >> (8 * i)) & 0xff);
+
+      d << '"';
+      for (unsigned i = 0; i < bytes.size(); i++)
+        d << '\\' << oct << setw(3) << setfill('0') << unsigned(bytes[i]);
+      d << dec << "\" ";
+    }
+  return components.empty() ? "\"\"" : d.str();
+}
+
+
 void
 c_unparser::emit_compiled_printf_locals ()
 {
@@ -1290,6 +1455,7 @@ void
 c_unparser::emit_compiled_printfs ()
 {
   o->newline() << "#ifndef STP_LEGACY_PRINT";
+  unsigned binary_ids = 0;
   map<pair<bool, string>, string>::iterator it;
   for (it = compiled_printfs.begin(); it != compiled_printfs.end(); ++it)
     {
@@ -1301,6 +1467,14 @@ c_unparser::emit_compiled_printfs ()
 
       o->newline();
 
+      if (print_to_stream && session->binary_trace
+          && binary_ids < BINARY_PRINTF_MAX_ID
+          && binary_printf_p (*session, components))
+        {
+          emit_binary_printf (name, ++binary_ids, components);
+          continue;
+        }
+
       // Might be nice to output the format string in a comment, but we'd have
       // to be extra careful about format strings not escaping the comment...
       o->newline() << "static void " << name
@@ -1535,10 +1709,118 @@ c_unparser::emit_compiled_printfs ()
 
       o->newline(-1) << "}";
     }
+  if (session->binary_trace)
+    emit_binary_printf_formats ();
   o->newline() << "#endif // STP_LEGACY_PRINT";
 }
 
 
+void
+c_unparser::emit_binary_printf (const string& name, unsigned id,
+                                const vector<print_format::format_component>& components)
+{
+  o->newline() << "static void " << name
+               << " (struct context* __restrict__ c) {";
+  o->newline(1) << "struct " << name << "_locals * __restrict__ l = "
+                << "& c->printf_locals." << name << ";";
+  o->newline() << "char *str;";
+
+  // Numbers go out as raw int64_t, chars as one byte, and strings with
+  // their terminating NUL; widths and precisions only matter offline.
+  size_t arg_ix = 0;
+  size_t fixed_bytes = 0;
+  vector<size_t> strings;
+  vector<print_format::format_component>::const_iterator c;
+  for (c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        continue;
+      if (c->widthtype == print_format::width_dynamic)
+        arg_ix++, fixed_bytes += 8;
+      if (c->prectype == print_format::prec_dynamic)
+        arg_ix++, fixed_bytes += 8;
+      if (c->type == print_format::conv_string)
+        {
+          strings.push_back(arg_ix);
+          o->newline() << "size_t len" << arg_ix << " = strnlen(l->arg"
+                       << arg_ix << ", MAXSTRINGLEN);";
+          fixed_bytes += 1;
+        }
+      else if (c->type == print_format::conv_char)
+        fixed_bytes += 1;
+      else
+        fixed_bytes += 8;
+      arg_ix++;
+    }
+
+  o->newline() << "int num_bytes = " << fixed_bytes;
+  for (unsigned i = 0; i < strings.size(); i++)
+    o->line() << " + len" << strings[i];
+  o->line() << ";";
+  o->newline() << "str = (char*)_stp_bintrace_reserve(" << id << ", num_bytes);";
+  o->newline() << "if (unlikely(str == NULL))";
+  o->newline(1) << "return;";
+  o->indent(-1);
+
+  arg_ix = 0;
+  for (c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        continue;
+      if (c->widthtype == print_format::width_dynamic)
+        {
+          o->newline() << "memcpy(str, &l->arg" << arg_ix++ << ", 8);";
+          o->newline() << "str += 8;";
+        }
+      if (c->prectype == print_format::prec_dynamic)
+        {
+          o->newline() << "memcpy(str, &l->arg" << arg_ix++ << ", 8);";
+          o->newline() << "str += 8;";
+        }
+      if (c->type == print_format::conv_string)
+        {
+          o->newline() << "memcpy(str, l->arg" << arg_ix << ", len" << arg_ix << ");";
+          o->newline() << "str += len" << arg_ix << ";";
+          o->newline() << "*str++ = '\\0';";
+        }
+      else if (c->type == print_format::conv_char)
+        o->newline() << "*str++ = (char) l->arg" << arg_ix << ";";
+      else
+        {
+          o->newline() << "memcpy(str, &l->arg" << arg_ix << ", 8);";
+          o->newline() << "str += 8;";
+        }
+      arg_ix++;
+    }
+  o->newline(-1) << "}";
+}
+
+
+void
+c_unparser::emit_binary_printf_formats ()
+{
+  unsigned id = 0;
+  o->newline();
+  o->newline() << "static void stp_bintrace_formats (void) {";
+  o->indent(1);
+  map<pair<bool, string>, string>::iterator it;
+  for (it = compiled_printfs.begin(); it != compiled_printfs.end(); ++it)
+    {
+      vector<print_format::format_component> components =
+	print_format::string_to_components(it->first.second);
+      if (!it->first.first || id == BINARY_PRINTF_MAX_ID
+          || !binary_printf_p (*session, components))
+        continue;
+      o->newline() << "{";
+      o->newline(1) << "static const char d[] = "
+                    << binary_printf_descriptor (components) << ";";
+      o->newline() << "_stp_bintrace_format(" << ++id << ", d, sizeof(d) - 1);";
+      o->newline(-1) << "}";
+    }
+  o->newline(-1) << "}";
+}
+
+
 void
 c_unparser::emit_global_param (vardecl *v)
 {
@@ -1627,7 +1909,7 @@ c_unparser::emit_global (vardecl *v)
 
   string type;
   if (v->arity > 0)
-    type = (v->type == pe_stats) ? "PMAP" : "MAP";
+    type = (v->type == pe_stats || v->percpu) ? "PMAP" : "MAP";
   else
     type = c_typename (v->type);
 
@@ -1760,6 +2042,24 @@ c_unparser::emit_kernel_module_exit ()
 }
 
 
+// Collect the arrays that a foreach sorts with a limit.  They get a
+// heap to select just the top entries with (see _stp_map_sortn).
+struct sortn_array_finder: public traversing_visitor
+{
+  set<vardecl*> arrays;
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    symbol *array;
+    hist_op *hist;
+    classify_indexable (s->base, array, hist);
+    if (array && array->referent && s->sort_direction && s->limit)
+      arrays.insert (array->referent);
+    traversing_visitor::visit_foreach_loop (s);
+  }
+};
+
+
 void
 c_unparser::emit_module_init ()
 {
@@ -1922,11 +2222,22 @@ c_unparser::emit_module_init ()
   o->newline(1) << "goto out;";
   o->indent(-1);
 
+  sortn_array_finder sortn;
+  for (unsigned i=0; i<session->probes.size(); i++)
+    session->probes[i]->body->visit (&sortn);
+  for (map<string,functiondecl*>::iterator it = session->functions.begin();
+       it != session->functions.end(); it++)
+    it->second->body->visit (&sortn);
+
   for (unsigned i=0; i<session->globals.size(); i++)
     {
       vardecl* v = session->globals[i];
       if (v->index_types.size() > 0)
-	o->newline() << getmap (v).init();
+        {
+	  o->newline() << getmap (v).init();
+	  if (sortn.arrays.count (v))
+	    o->newline() << getmap (v).sortn_alloc();
+        }
       else if (session->runtime_usermode_p() && v->arity == 0
                && (v->type == pe_long || v->type == pe_string))
 	c_assign(getvar (v).value(), "stp_global_init." + c_globalname(v->name), v->type, "BUG: global initialization", v->tok);
@@ -1974,6 +2285,17 @@ c_unparser::emit_module_init ()
       o->newline() << "#endif";
     }
 
+  // Write out the format table before any probe can emit a binary record.
+  if (session->binary_trace)
+    {
+      o->newline() << "#ifndef STP_LEGACY_PRINT";
+      o->newline() << "preempt_disable();";
+      o->newline() << "stp_bintrace_formats();";
+      o->newline() << "_stp_print_flush();";
+      o->newline() << "preempt_enable();";
+      o->newline() << "#endif";
+    }
+
   // Run all probe registrations.  This actually runs begin probes.
 
   for (unsigned i=0; i<g.size(); i++)
@@ -2313,6 +2635,9 @@ c_unparser::emit_module_exit ()
       o->newline(-3) << "}";
       o->newline() << "_stp_stat_del (g_refresh_timing);";
       o->newline(-1) << "}";
+      o->newline() << "_stp_transport_data_fs_report();";
+      o->newline() << "_stp_sym_cache_report();";
+      o->newline() << "_stp_cfi_cache_report();";
       o->newline() << "#endif"; // STP_TIMING
     }
 
@@ -2433,49 +2758,298 @@ struct max_action_info: public functioncall_traversing_visitor
   void visit_continue_statement (continue_statement *) { add_stmt_count(1); }
 };
 
+c_tmpcounter::c_tmpcounter (c_unparser* p):
+  c_unparser(p->session, &null_o), parent (p),
+  string_size (512), function_size (0)
+{
+  // Follow a -DMAXSTRINGLEN=N, see runtime_defines.h.
+  for (unsigned i = 0; i < session->c_macros.size(); i++)
+    if (startswith (session->c_macros[i], "MAXSTRINGLEN="))
+      string_size = lex_cast<unsigned> (session->c_macros[i].substr(13));
+}
+
 void
-c_tmpcounter::emit_function (functiondecl* fd)
+c_tmpcounter::layout_begin (bool union_p)
 {
-  this->current_probe = 0;
-  this->current_function = fd;
-  this->tmpvar_counter = 0;
-  this->action_counter = 0;
-  this->already_checked_action_count = false;
-  declared_vars.clear();
+  layout.push_back (make_pair (union_p, 0u));
+}
 
-  translator_output *o = parent->o;
+void
+c_tmpcounter::layout_add (unsigned size)
+{
+  if (layout.empty())
+    return;
 
-  // indent the dummy output as if we were already in a block
-  this->o->indent (1);
+  // Assume every member is aligned like an int64_t.
+  size = (size + 7) & ~7u;
+  if (layout.back().first)
+    layout.back().second = max (layout.back().second, size);
+  else
+    layout.back().second += size;
+}
 
-  o->newline() << "struct " << c_funcname (fd->name) << "_locals {";
-  o->indent(1);
+unsigned
+c_tmpcounter::layout_end ()
+{
+  unsigned size = layout.back().second;
+  layout.pop_back ();
+  layout_add (size);
+  return size;
+}
 
-  for (unsigned j=0; j<fd->locals.size(); j++)
+void
+c_tmpcounter::report_sizes ()
+{
+  if (session->verbose < 1 || probe_sizes.empty())
+    return;
+
+  sort (probe_sizes.begin(), probe_sizes.end());
+  if (session->verbose > 1)
+    for (unsigned i = 0; i < probe_sizes.size(); i++)
+      clog << _F("Pass 3: probe %s keeps %u bytes of locals in the context",
+                 probe_sizes[i].second.c_str(), probe_sizes[i].first) << endl;
+
+  clog << _F("Pass 3: largest probe locals: %u bytes (%s)",
+             probe_sizes.back().first, probe_sizes.back().second.c_str());
+  if (function_size)
+    clog << _F(", largest function locals: %u bytes per nesting level (%s)",
+               function_size, function_name.c_str());
+  clog << endl;
+}
+
+// The live ranges of the string locals of a probe or function body,
+// as positions in visiting order.  A local is live from the start of
+// the body up to its last use, unless the body first assigns it in a
+// statement that always runs: then the range starts there.  A use in
+// a loop keeps the local live through the whole loop.  Locals whose
+// ranges are disjoint can share their storage.
+struct local_liveness: public traversing_visitor
+{
+  struct range
+  {
+    unsigned first, last;
+    bool seen;
+    range(): first(0), last(0), seen(false) {}
+  };
+
+  map<vardecl*, range> ranges;
+  unsigned pos;
+  unsigned nested;
+  bool embedded;
+
+  local_liveness(): pos(0), nested(0), embedded(false) {}
+
+  void use (vardecl* v, unsigned first)
+  {
+    map<vardecl*, range>::iterator it = ranges.find (v);
+    if (it == ranges.end())
+      return;
+    if (!it->second.seen)
+      {
+        it->second.first = first;
+        it->second.seen = true;
+      }
+    it->second.last = pos;
+  }
+
+  void end_loop (unsigned start)
+  {
+    unsigned end = ++pos;
+    for (map<vardecl*, range>::iterator it = ranges.begin();
+         it != ranges.end(); ++it)
+      if (it->second.seen && it->second.last > start)
+        {
+          it->second.first = min (it->second.first, start);
+          it->second.last = end;
+        }
+  }
+
+  void visit_symbol (symbol* e)
+  {
+    ++pos;
+    use (e->referent, 0);
+  }
+
+  void visit_expr_statement (expr_statement* s)
+  {
+    unsigned start = ++pos;
+    assignment* a = dynamic_cast<assignment*>(s->value);
+    symbol* sym = a ? dynamic_cast<symbol*>(a->left) : 0;
+    if (nested == 0 && sym && a->op == "=")
+      {
+        // NB: the range starts before the value, so that it overlaps
+        // whatever the value is computed from.
+        a->right->visit (this);
+        ++pos;
+        use (sym->referent, start);
+      }
+    else
+      s->value->visit (this);
+  }
+
+  void visit_if_statement (if_statement* s)
+  {
+    nested++;
+    traversing_visitor::visit_if_statement (s);
+    nested--;
+  }
+
+  void visit_try_block (try_block* s)
+  {
+    nested++;
+    traversing_visitor::visit_try_block (s);
+    nested--;
+  }
+
+  void visit_for_loop (for_loop* s)
+  {
+    unsigned start = ++pos;
+    nested++;
+    traversing_visitor::visit_for_loop (s);
+    nested--;
+    end_loop (start);
+  }
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    unsigned start = ++pos;
+    nested++;
+    traversing_visitor::visit_foreach_loop (s);
+    nested--;
+    end_loop (start);
+  }
+
+  // embedded C may get at any local through STAP_ARG_*
+  void visit_embeddedcode (embeddedcode*) { embedded = true; }
+  void visit_embedded_expr (embedded_expr*) { embedded = true; }
+};
+
+// Declare the given locals, letting string locals with disjoint live
+// ranges share a union.  Every local is still zeroed on entry, which
+// is harmless for a shared one: its range only starts at a plain
+// assignment to it.
+void
+c_tmpcounter::emit_locals (const vector<vardecl*>& locals, statement* body)
+{
+  translator_output *o = parent->o;
+  local_liveness ll;
+
+  if (!session->unoptimized)
+    for (unsigned j=0; j<locals.size(); j++)
+      if (locals[j]->type == pe_string && !locals[j]->synthetic
+          && locals[j]->index_types.empty())
+        ll.ranges[locals[j]];
+  if (ll.ranges.size() > 1)
+    body->visit (&ll);
+  if (ll.embedded)
+    ll.ranges.clear();
+
+  // Greedily put each local, by the start of its range, into the first
+  // slot that is free by then.
+  vector<pair<unsigned, unsigned> > order; // (first, index)
+  for (unsigned j=0; j<locals.size(); j++)
+    if (ll.ranges.count(locals[j]))
+      order.push_back (make_pair (ll.ranges[locals[j]].first, j));
+  sort (order.begin(), order.end());
+
+  vector<unsigned> slot_of (locals.size());
+  vector<unsigned> slot_end;
+  vector<vector<vardecl*> > slots;
+  for (unsigned k=0; k<order.size(); k++)
+    {
+      const local_liveness::range& r = ll.ranges[locals[order[k].second]];
+      unsigned i;
+      for (i=0; i<slots.size(); i++)
+        if (slot_end[i] < r.first)
+          break;
+      if (i == slots.size())
+        {
+          slots.push_back (vector<vardecl*>());
+          slot_end.push_back (0);
+        }
+      slots[i].push_back (locals[order[k].second]);
+      slot_end[i] = r.last;
+      slot_of[order[k].second] = i;
+    }
+
+  vector<bool> slot_done (slots.size());
+  for (unsigned j=0; j<locals.size(); j++)
     {
-      vardecl* v = fd->locals[j];
+      vardecl* v = locals[j];
       try
 	{
-	  if (fd->mangle_oldstyle)
+	  if (ll.ranges.count(v) && slots[slot_of[j]].size() > 1)
 	    {
-	      // PR14524: retain old way of referring to the locals
-	      o->newline() << "union { "
-			   << c_typename (v->type) << " "
-			   << c_localname (v->name) << "; "
-			   << c_typename (v->type) << " "
-			   << c_localname (v->name, true) << "; };";
+	      unsigned i = slot_of[j];
+	      if (slot_done[i])
+		continue;
+	      slot_done[i] = true;
+
+	      string names;
+	      o->newline() << "union {";
+	      for (unsigned k=0; k<slots[i].size(); k++)
+		{
+		  o->line() << " " << c_typename (slots[i][k]->type) << " "
+			    << c_localname (slots[i][k]->name) << ";";
+		  names += (k ? ", " : "") + slots[i][k]->name.to_string();
+		}
+	      o->line() << " };";
+	      if (session->verbose > 2)
+		clog << _F("locals %s share storage in the context",
+			   names.c_str()) << endl;
 	    }
 	  else
-	    {
-	      o->newline() << c_typename (v->type) << " "
-			   << c_localname (v->name) << ";";
-	    }
+	    o->newline() << c_typename (v->type) << " "
+			 << c_localname (v->name) << ";";
+	  layout_add (v->type == pe_string ? string_size : 8);
 	} catch (const semantic_error& e) {
 	  semantic_error e2 (e);
 	  if (e2.tok1 == 0) e2.tok1 = v->tok;
 	  throw e2;
 	}
     }
+}
+
+void
+c_tmpcounter::emit_function (functiondecl* fd)
+{
+  this->current_probe = 0;
+  this->current_function = fd;
+  this->tmpvar_counter = 0;
+  this->action_counter = 0;
+  this->already_checked_action_count = false;
+  declared_vars.clear();
+
+  translator_output *o = parent->o;
+
+  // indent the dummy output as if we were already in a block
+  this->o->indent (1);
+
+  o->newline() << "struct " << c_funcname (fd->name) << "_locals {";
+  o->indent(1);
+  layout_begin (false);
+
+  if (!fd->mangle_oldstyle)
+    emit_locals (fd->locals, fd->body);
+  else
+    for (unsigned j=0; j<fd->locals.size(); j++)
+      {
+	vardecl* v = fd->locals[j];
+	try
+	  {
+	    // PR14524: retain old way of referring to the locals
+	    o->newline() << "union { "
+			 << c_typename (v->type) << " "
+			 << c_localname (v->name) << "; "
+			 << c_typename (v->type) << " "
+			 << c_localname (v->name, true) << "; };";
+	    layout_add (v->type == pe_string ? string_size : 8);
+	  } catch (const semantic_error& e) {
+	    semantic_error e2 (e);
+	    if (e2.tok1 == 0) e2.tok1 = v->tok;
+	    throw e2;
+	  }
+      }
 
   for (unsigned j=0; j<fd->formal_args.size(); j++)
     {
@@ -2503,6 +3077,7 @@ c_tmpcounter::emit_function (functiondecl* fd)
 	      o->newline() << (v->char_ptr_arg ? "const char *" : c_typename (v->type))
 			   << " " << c_localname (v->name) << ";";
 	    }
+	  layout_add (v->type == pe_string && !v->char_ptr_arg ? string_size : 8);
 	} catch (const semantic_error& e) {
 	  semantic_error e2 (e);
 	  if (e2.tok1 == 0) e2.tok1 = v->tok;
@@ -2522,9 +3097,17 @@ c_tmpcounter::emit_function (functiondecl* fd)
 		   fd->unmangled_name.to_string().c_str()) << endl;
       o->newline() << (as_charp ? "char *" : c_typename (fd->type))
 		   << " __retvalue;";
+      layout_add (fd->type == pe_string && !as_charp ? string_size : 8);
     }
   o->newline(-1) << "} " << c_funcname (fd->name) << ";";
 
+  unsigned size = layout_end ();
+  if (size > function_size)
+    {
+      function_size = size;
+      function_name = fd->unmangled_name.to_string();
+    }
+
   // finish dummy indentation
   this->o->indent (-1);
   this->o->assert_0_indent ();
@@ -2690,19 +3273,8 @@ c_tmpcounter::emit_probe (derived_probe* dp)
 
       o->newline() << "struct " << dp->name() << "_locals {";
       o->indent(1);
-      for (unsigned j=0; j<dp->locals.size(); j++)
-	{
-	  vardecl* v = dp->locals[j];
-	  try
-	    {
-	      o->newline() << c_typename (v->type) << " "
-			   << c_localname (v->name) << ";";
-	    } catch (const semantic_error& e) {
-	    semantic_error e2 (e);
-	    if (e2.tok1 == 0) e2.tok1 = v->tok;
-	    throw e2;
-	  }
-	}
+      layout_begin (false);
+      emit_locals (dp->locals, dp->body);
 
       dp->body->visit (this);
 
@@ -2718,6 +3290,9 @@ c_tmpcounter::emit_probe (derived_probe* dp)
 
       o->newline(-1) << "} " << dp->name() << ";";
 
+      probe_sizes.push_back (make_pair (layout_end (),
+                                        dp->sole_location()->str(false)));
+
       // finish dummy indentation
       this->o->indent (-1);
       this->o->assert_0_indent ();
@@ -2728,6 +3303,81 @@ c_tmpcounter::emit_probe (derived_probe* dp)
   this->already_checked_action_count = false;
 }
 
+// Return the percpu array element that an expression statement only
+// accumulates into, as in "x[k]++" or "x[k] += n", or NULL otherwise.
+// Since the result is discarded, such an update can go straight into
+// the current cpu's map, like a "<<<" into a statistic.
+static arrayindex*
+percpu_accumulation (expression* e)
+{
+  interned_string op;
+  expression* operand;
+
+  assignment* a = dynamic_cast<assignment*>(e);
+  unary_expression* u = dynamic_cast<unary_expression*>(e);
+  if (a)
+    {
+      op = a->op;
+      operand = a->left;
+    }
+  else if (u && (dynamic_cast<pre_crement*>(u) || dynamic_cast<post_crement*>(u)))
+    {
+      op = u->op;
+      operand = u->operand;
+    }
+  else
+    return 0;
+
+  if (op != "+=" && op != "-=" && op != "++" && op != "--")
+    return 0;
+
+  arrayindex* ai = dynamic_cast<arrayindex*>(operand);
+  if (!ai)
+    return 0;
+
+  symbol *array;
+  hist_op *hist;
+  classify_indexable (ai->base, array, hist);
+  if (!array || !array->referent || !array->referent->percpu)
+    return 0;
+
+  return ai;
+}
+
+
+// Collect the percpu arrays that are used other than by accumulation
+// statements.  Those uses read or replace values on every cpu, so they
+// need the exclusive lock; pure accumulation only needs a shared one.
+struct percpu_use_visitor: public functioncall_traversing_visitor
+{
+  set<vardecl*> exclusive;
+
+  void visit_expr_statement (expr_statement *s)
+  {
+    arrayindex* ai = percpu_accumulation (s->value);
+    if (!ai)
+      {
+        functioncall_traversing_visitor::visit_expr_statement (s);
+        return;
+      }
+
+    // skip the array itself, but not its indexes or the rvalue
+    for (unsigned i = 0; i < ai->indexes.size(); i++)
+      if (ai->indexes[i])
+        ai->indexes[i]->visit (this);
+    assignment* a = dynamic_cast<assignment*>(s->value);
+    if (a)
+      a->right->visit (this);
+  }
+
+  void visit_symbol (symbol *e)
+  {
+    if (e->referent && e->referent->percpu)
+      exclusive.insert (e->referent);
+  }
+};
+
+
 #define DUPMETHOD_CALL 0
 #define DUPMETHOD_ALIAS 0
 #define DUPMETHOD_RENAME 1
@@ -2790,6 +3440,8 @@ c_unparser::emit_probe (derived_probe* v)
         {
           varuse_collecting_visitor vut(*session);
           v->body->visit (& vut);
+          percpu_use_visitor pv;
+          v->body->visit (& pv);
 
           // also visit any probe conditions which this current probe might
           // evaluate so that read locks are emitted as necessary: e.g. suppose
@@ -2804,9 +3456,10 @@ c_unparser::emit_probe (derived_probe* v)
             {
               assert((*it)->sole_location()->condition != NULL);
               (*it)->sole_location()->condition->visit (& vut);
+              (*it)->sole_location()->condition->visit (& pv);
             }
 
-          emit_lock_decls (vut);
+          emit_lock_decls (vut, pv);
         }
 
       // initialize frame pointer
@@ -2927,7 +3580,8 @@ c_unparser::emit_probe_condition_update(derived_probe* v)
 }
 
 void
-c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
+c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut,
+                            const percpu_use_visitor& pv)
 {
   unsigned numvars = 0;
 
@@ -2962,6 +3616,18 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
           else if (read_p && !write_p) { read_p = false; write_p = true; }
           written_p = vcv_needs_global_locks.read.count(v) > 0;
         }
+      else if (v->percpu)
+        // Likewise, accumulating into a percpu array only touches the
+        // current cpu's map, so it takes a shared lock.  Anything else
+        // sees every cpu's map and needs the exclusive lock.  The shared
+        // side can't go away: it is what keeps an aggregation, delete or
+        // assignment on another cpu from walking or editing this cpu's
+        // hash lists while an accumulation inserts into them.
+        {
+          write_p = pv.exclusive.count(v) > 0;
+          read_p = !write_p;
+          written_p = true;
+        }
       else
         written_p = vcv_needs_global_locks.written.count(v) > 0;
 
@@ -3105,9 +3771,17 @@ void
 c_unparser::emit_map_type_instantiations ()
 {
   set< pair<vector<exp_type>, exp_type> > types;
+  set< pair<vector<exp_type>, exp_type> > percpu_types;
 
   collect_map_index_types(session->globals, types);
 
+  for (unsigned i = 0; i < session->globals.size(); ++i)
+    {
+      vardecl *v = session->globals[i];
+      if (v->percpu && v->arity > 0)
+	percpu_types.insert(make_pair(v->index_types, v->type));
+    }
+
   for (unsigned i = 0; i < session->probes.size(); ++i)
     collect_map_index_types(session->probes[i]->locals, types);
 
@@ -3126,8 +3800,9 @@ c_unparser::emit_map_type_instantiations ()
 	  string ktype = mapvar::key_typename(i->first.at(j));
 	  o->newline() << "#define KEY" << (j+1) << "_TYPE " << ktype;
 	}
-      /* For statistics, flag map-gen to pull in nested pmap-gen too.  */
-      if (i->second == pe_stats)
+      /* For statistics and percpu arrays, flag map-gen to pull in
+         nested pmap-gen too.  */
+      if (i->second == pe_stats || percpu_types.count(*i))
 	o->newline() << "#define MAP_DO_PMAP 1";
       o->newline() << "#include \"map-gen.c\"";
       o->newline() << "#undef MAP_DO_PMAP";
@@ -3647,7 +4322,7 @@ c_unparser::getmap(vardecl *v, token const *tok)
   if (i != session->stat_decls.end())
     sd = i->second;
   return mapvar (this, is_local (v, tok), v->type, sd,
-      v->name, v->index_types, v->maxsize, v->wrap);
+      v->name, v->index_types, v->maxsize, v->wrap, v->percpu);
 }
 
 
@@ -3823,9 +4498,11 @@ c_unparser::visit_null_statement (null_statement *)
 void
 c_unparser::visit_expr_statement (expr_statement *s)
 {
+  percpu_accumulator = percpu_accumulation (s->value);
   o->newline() << "(void) ";
   s->value->visit (this);
   o->line() << ";";
+  percpu_accumulator = 0;
   record_actions(1, s->tok);
 }
 
@@ -3871,6 +4548,7 @@ c_tmpcounter::start_struct_def (std::ostream::pos_type &before,
                << ":" << lex_cast(tok->location.line) << " */";
   o->indent(1);
   after = o->tellp();
+  layout_begin (false);
 }
 
 void
@@ -3879,6 +4557,7 @@ c_tmpcounter::close_struct_def (std::ostream::pos_type before,
 {
   // meant to be used with ::start_struct_def. remove the struct if empty.
   translator_output *o = parent->o;
+  layout_end ();
   o->indent(-1);
   if (after == o->tellp())
     o->seekp(before);
@@ -3895,12 +4574,14 @@ c_tmpcounter::start_compound_statement (const char* tag, statement *s)
                << loc.file->name << ":"
                << lex_cast(loc.line) << " */";
   o->indent(1);
+  layout_begin (true);
 }
 
 void
 c_tmpcounter::close_compound_statement (const char*, statement *)
 {
   translator_output *o = parent->o;
+  layout_end ();
   o->newline(-1) << "};";
 }
 
@@ -4130,7 +4811,7 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
 	      // If the user wanted us to sort by value, we'll sort by
 	      // @count or selected function instead for aggregates.  
 	      // See runtime/map.c
-	      if (s->sort_column == 0)
+	      if (s->sort_column == 0 && mv.type() == pe_stats)
                 switch (s->sort_aggr) {
                 default: case sc_none: case sc_count: sort_column = "SORT_COUNT"; break;
                 case sc_sum: sort_column = "SORT_SUM"; break;
@@ -4144,6 +4825,8 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
 	      o->newline() << "else"; // only sort if aggregation was ok
 	      if (s->limit)
 	        {
+		  // ... and there is something to iterate
+		  o->line() << " if (" << *res_limit << " > 0)";
 		  o->newline(1) << mv.function_keysym("sortn", true) <<" ("
 				<< mv.fetch_existing_aggregate() << ", "
 				<< *res_limit << ", " << sort_column << ", "
@@ -4166,10 +4849,12 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
 	    {
 	      if (s->limit)
 	        {
-		  o->newline() << mv.function_keysym("sortn") <<" ("
+		  o->newline() << "if (" << *res_limit << " > 0)";
+		  o->newline(1) << mv.function_keysym("sortn") <<" ("
 			       << mv.value() << ", "
 			       << *res_limit << ", " << s->sort_column << ", "
 			       << - s->sort_direction << ");";
+		  o->indent(-1);
 		}
 	      else
 	        {
@@ -5490,6 +6175,20 @@ c_unparser_assignment::visit_arrayindex (arrayindex *e)
 	  // o->newline() << lvar << " = " << rvar << ";";
 	  // o->newline() << res << " = " << rvar << ";";
 	}
+      else if (e == parent->percpu_accumulator)
+	{
+	  // The result is discarded, so just add the delta into the
+	  // current cpu's map of the percpu array, without looking at
+	  // the other cpus.  See percpu_accumulation().
+	  mapvar mvar = parent->getmap (array->referent, e->tok);
+	  o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
+	  if (op == "--" || op == "-=")
+	    o->newline() << lvar << " = -(" << rvar << ");";
+	  else
+	    o->newline() << lvar << " = " << rvar << ";";
+	  o->newline() << mvar.add (idx, lvar) << ";";
+	  res = lvar;
+	}
       else
 	{
 	  mapvar mvar = parent->getmap (array->referent, e->tok);
@@ -6058,6 +6757,14 @@ c_unparser::visit_hist_op (hist_op*)
 
 typedef map<Dwarf_Addr,const char*> addrmap_t; // NB: plain map, sorted by address
 
+// An entry of a module's precomputed line table, see dump_line_tables()
+struct line_table_entry
+{
+  Dwarf_Addr addr;
+  unsigned line; // 0 for a gap
+  unsigned file;
+};
+
 struct unwindsym_dump_context
 {
   systemtap_session& session;
@@ -6088,8 +6795,13 @@ struct unwindsym_dump_context
   Dwarf_Addr eh_frame_hdr_addr;
   void *debug_line;
   size_t debug_line_len;
+  vector<line_table_entry> lines; // instead of debug_line, if not empty
+  vector<string> line_files;
 
   set<string> undone_unwindsym_modules;
+
+  // With --split-module, the files that the modules' tables go into.
+  vector<translator_output*> symbol_outputs;
 };
 
 static bool need_byte_swap_for_target (const unsigned char e_ident[])
@@ -6503,6 +7215,15 @@ static void find_debug_frame_offset (Dwfl_Module *m,
     }
 }
 
+static bool
+line_table_row_less (const pair<line_table_entry, bool>& a,
+                     const pair<line_table_entry, bool>& b)
+{
+  if (a.first.addr != b.first.addr)
+    return a.first.addr < b.first.addr;
+  return a.second && !b.second;
+}
+
 static int
 dump_line_tables_check (void *data, size_t data_len)
 {
@@ -6576,9 +7297,99 @@ dump_line_tables_check (void *data, size_t data_len)
   return DWARF_CB_OK;
 }
 
+// Fill c->lines and c->line_files from the module's line number
+// programs.  Each entry covers the addresses up to the next one, so
+// only the rows that start a new line are kept, and sequence ends
+// become gaps.  Gives up if the table doesn't fit the budget.
+static bool
+dump_line_table (Dwfl_Module *m, unwindsym_dump_context *c,
+                 const char *modname)
+{
+  vector<pair<line_table_entry, bool> > rows; // entry, end of sequence
+  map<string, unsigned> files;
+  Dwarf_Die *cu = NULL;
+  Dwarf_Addr bias;
+
+  while ((cu = dwfl_module_nextcu (m, cu, &bias)) != NULL)
+    {
+      Dwarf_Lines *lines;
+      size_t nlines;
+      if (dwarf_getsrclines (cu, &lines, &nlines) != 0)
+        continue;
+
+      for (size_t i = 0; i < nlines; i++)
+        {
+          Dwarf_Line *line = dwarf_onesrcline (lines, i);
+          line_table_entry e;
+          int lineno;
+          bool end;
+          if (line == NULL
+              || dwarf_lineaddr (line, &e.addr) != 0
+              || dwarf_lineno (line, &lineno) != 0
+              || dwarf_lineendsequence (line, &end) != 0)
+            continue;
+
+          e.line = (end || lineno < 0) ? 0 : lineno;
+          e.file = 0;
+          const char *src = dwarf_linesrc (line, NULL, NULL);
+          if (e.line && src)
+            e.file = files.insert (make_pair (string (src),
+                                              files.size ())).first->second;
+          else
+            e.line = 0;
+          rows.push_back (make_pair (e, end));
+        }
+    }
+
+  // By address, with the ends of sequences before the rows that start
+  // others at the same address.  Of several rows at one address, the
+  // last one counts, like in the line number program.
+  stable_sort (rows.begin (), rows.end (), line_table_row_less);
+
+  vector<line_table_entry>& table = c->lines;
+  for (size_t i = 0; i < rows.size (); i++)
+    {
+      const line_table_entry& e = rows[i].first;
+      if (i + 1 < rows.size () && rows[i + 1].first.addr == e.addr)
+        continue;
+      if (table.empty () ? e.line == 0
+          : (table.back ().line == e.line && table.back ().file == e.file))
+        continue;
+      table.push_back (e);
+    }
+
+  c->line_files.resize (files.size ());
+  for (map<string, unsigned>::const_iterator it = files.begin ();
+       it != files.end (); ++it)
+    c->line_files[it->second] = it->first;
+
+  size_t size = table.size () * 3 * sizeof (uint32_t);
+  for (size_t i = 0; i < c->line_files.size (); i++)
+    size += c->line_files[i].size () + 1 + sizeof (void *);
+
+  if (table.empty ()
+      || table.back ().addr - table.front ().addr > 0xffffffffUL
+      || size > c->session.line_table_budget * 1024UL)
+    {
+      if (c->session.verbose > 1 && !table.empty ())
+        clog << _F("Pass 3: keeping .debug_line of %s, its line table "
+                   "does not fit in %u KiB", modname,
+                   c->session.line_table_budget) << endl;
+      c->lines.clear ();
+      c->line_files.clear ();
+      return false;
+    }
+
+  if (c->session.verbose > 2)
+    clog << _F("Pass 3: line table of %s has %u entries for %u files",
+               modname, (unsigned) table.size (),
+               (unsigned) c->line_files.size ()) << endl;
+  return true;
+}
+
 static void
 dump_line_tables (Dwfl_Module *m, unwindsym_dump_context *c,
-                  const char *, Dwarf_Addr)
+                  const char *modname, Dwarf_Addr)
 {
   Elf* elf;
   Elf_Scn* scn = NULL;
@@ -6616,6 +7427,20 @@ dump_line_tables (Dwfl_Module *m, unwindsym_dump_context *c,
   // kernel addresses if there is no unwind data
   if (c->debug_line_len > 0 && !c->session.need_unwind)
     find_debug_frame_offset (m, c);
+
+  // Rather than have the runtime run the line number programs on every
+  // lookup, give it their rows sorted by address to binary search.
+  // Not for ET_REL modules though: libdwfl relocates their rows to its
+  // own layout of the sections, starting at 0x10000 and with .init.text
+  // after .text, which doesn't match the section-relative addresses the
+  // runtime looks up.  Those keep their .debug_line.
+  if (c->debug_line_len > 0 && c->session.line_table_budget > 0
+      && ehdr->e_type != ET_REL
+      && dump_line_table (m, c, modname))
+    {
+      c->debug_line = NULL;
+      c->debug_line_len = 0;
+    }
 }
 
 /* Some architectures create special local symbols that are not
@@ -6873,6 +7698,52 @@ dump_unwind_tables (Dwfl_Module *m,
   return DWARF_CB_OK;
 }
 
+// The tables of large modules, such as the kernel's symbols, can be
+// most of the C source to compile.  With --split-module, each module's
+// go into a new file, or the smallest one once there are as many as
+// asked for, which kbuild compiles in parallel with the main one.  Only
+// the module's struct _stp_module is then visible to the main file.
+static void
+select_symbol_output (unwindsym_dump_context *c)
+{
+  systemtap_session& s = c->session;
+  if (s.split_module == 0 || s.runtime_usermode_p())
+    return;
+
+  translator_output *best;
+  if (c->symbol_outputs.size() < s.split_module)
+    {
+      // They need nothing of the runtime but the types of sym.h.
+      best = s.op_create_auxiliary();
+      best->cacheable_p = true;
+      best->line() << "#define STP_SYMBOL_DATA 1";
+      if (s.need_unwind)
+        best->newline() << "#define STP_NEED_UNWIND_DATA 1";
+      if (s.need_lines)
+        best->newline() << "#define STP_NEED_LINE_DATA 1";
+      best->newline() << "#include <linux/types.h>";
+      best->newline() << "#include \"linux/unwind_arch.h\"";
+      best->newline() << "#include \"sym.h\"";
+      best->newline();
+      best->assert_0_indent();
+      c->symbol_outputs.push_back (best);
+    }
+  else
+    {
+      best = c->symbol_outputs[0];
+      for (unsigned i = 1; i < c->symbol_outputs.size(); i++)
+        if (c->symbol_outputs[i]->tellp() < best->tellp())
+          best = c->symbol_outputs[i];
+    }
+  c->output.rdbuf (best->line().rdbuf());
+}
+
+static const char *
+symbol_module_storage (unwindsym_dump_context *c)
+{
+  return c->symbol_outputs.empty() ? "static " : "";
+}
+
 static void
 dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
 			 const string& modname, unsigned modindex,
@@ -6942,6 +7813,8 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   void *debug_line = c->debug_line;
   size_t debug_line_len = c->debug_line_len;
 
+  select_symbol_output (c);
+
   dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
 			   "debug_frame", debug_frame, debug_len);
 
@@ -6954,6 +7827,28 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
 			   "debug_line", debug_line, debug_line_len);
 
+  if (!c->lines.empty())
+    {
+      Dwarf_Addr line_base = c->lines[0].addr;
+      c->output << "#if defined(STP_NEED_LINE_DATA)\n";
+      c->output << "static const char * const _stp_module_" << stpmod_idx
+		<< "_line_files[] = {\n";
+      for (size_t i = 0; i < c->line_files.size(); i++)
+	c->output << "  " << lex_cast_qstring (c->line_files[i]) << ",\n";
+      c->output << "};\n";
+      c->output << "static const struct _stp_line _stp_module_" << stpmod_idx
+		<< "_lines[] = {\n  ";
+      for (size_t i = 0; i < c->lines.size(); i++)
+	{
+	  c->output << "{" << c->lines[i].addr - line_base << ","
+		    << c->lines[i].line << "," << c->lines[i].file << "},";
+	  if ((i + 1) % 8 == 0)
+	    c->output << "\n  ";
+	}
+      c->output << "};\n";
+      c->output << "#endif /* STP_NEED_LINE_DATA */\n";
+    }
+
   if (c->session.need_unwind && debug_frame == NULL && eh_frame == NULL)
     {
       // There would be only a small benefit to warning.  A user
@@ -6965,7 +7860,7 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 				  + ", " + dwfl_errmsg (-1));
     }
 
-  if (c->session.need_lines && debug_line == NULL)
+  if (c->session.need_lines && debug_line == NULL && c->lines.empty())
     {
       if (c->session.verbose > 2)
         c->session.print_warning ("No debug line data for " + modname + ", " +
@@ -7097,7 +7992,8 @@ dump_unwindsym_cxt (Dwfl_Module *m,
         mainname = lex_cast_qstring (modname);
     }
 
-  c->output << "static struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
+  c->output << symbol_module_storage (c)
+            << "struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
   c->output << ".name = " << mainname.c_str() << ",\n";
   c->output << ".path = " << lex_cast_qstring (path_remove_sysroot(c->session,mainpath)) << ",\n";
   c->output << ".eh_frame_addr = 0x" << hex << eh_addr << dec << ", \n";
@@ -7161,6 +8057,16 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   if (debug_line != NULL)
     c->output << "#endif /* STP_NEED_LINE_DATA */\n";
 
+  if (!c->lines.empty())
+    {
+      c->output << "#if defined(STP_NEED_LINE_DATA)\n";
+      c->output << ".lines = _stp_module_" << stpmod_idx << "_lines,\n";
+      c->output << ".line_files = _stp_module_" << stpmod_idx << "_line_files,\n";
+      c->output << ".num_lines = " << c->lines.size() << ",\n";
+      c->output << ".line_base = 0x" << hex << c->lines[0].addr << dec << "UL,\n";
+      c->output << "#endif /* STP_NEED_LINE_DATA */\n";
+    }
+
   c->output << ".sections = _stp_module_" << stpmod_idx << "_sections" << ",\n";
   c->output << ".num_sections = sizeof(_stp_module_" << stpmod_idx << "_sections)/"
             << "sizeof(struct _stp_section),\n";
@@ -7223,6 +8129,8 @@ static void dump_kallsyms(unwindsym_dump_context *c)
   Dwarf_Addr end = 0;
   Dwarf_Addr prev = 0;
 
+  select_symbol_output (c);
+
   c->output << "static struct _stp_symbol "
             << "_stp_module_" << stpmod_idx << "_symbols_" << 0 << "[] = {\n";
 
@@ -7263,7 +8171,8 @@ static void dump_kallsyms(unwindsym_dump_context *c)
             << ".num_symbols = " << size << ",\n";
   c->output << "},\n";
   c->output << "};\n";
-  c->output << "static struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
+  c->output << symbol_module_storage (c)
+            << "struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
   c->output << ".name = " << lex_cast_qstring("kernel") << ",\n";
   c->output << ".sections = _stp_module_" << stpmod_idx << "_sections" << ",\n";
   c->output << ".num_sections = sizeof(_stp_module_" << stpmod_idx << "_sections)/"
@@ -7340,6 +8249,8 @@ dump_unwindsyms (Dwfl_Module *m,
 
   c->debug_line = NULL;
   c->debug_line_len = 0;
+  c->lines.clear();
+  c->line_files.clear();
   if (res == DWARF_CB_OK && c->session.need_lines)
     // we dont set res = dump_line_tables() because unwindsym stuff should still
     // get dumped to the output even if gathering debug_line data fails
@@ -7502,7 +8413,10 @@ emit_symbol_data (systemtap_session& s)
 				 0, /* eh_frame_hdr_addr */
 				 NULL, /* debug_line */
 				 0, /* debug_line_len */
-				 s.unwindsym_modules };
+				 vector<line_table_entry>(), /* lines */
+				 vector<string>(), /* line_files */
+				 s.unwindsym_modules,
+				 vector<translator_output*>() };
 
   // Micro optimization, mainly to speed up tiny regression tests
   // using just begin probe.
@@ -7570,6 +8484,8 @@ emit_symbol_data (systemtap_session& s)
   if (ctx.undone_unwindsym_modules.find("kernel") != ctx.undone_unwindsym_modules.end())
     dump_kallsyms(&ctx);
 
+  // The rest goes into stap-symbols.h again.
+  ctx.output.rdbuf (kallsyms_out.rdbuf ());
   emit_symbol_data_done (&ctx, s);
 }
 
@@ -7616,6 +8532,9 @@ emit_symbol_data_done (unwindsym_dump_context *ctx, systemtap_session& s)
   // Print out a definition of the runtime's _stp_modules[] globals.
   ctx->output << "\n";
   self_unwind_declarations(ctx);
+  if (! ctx->symbol_outputs.empty())
+    for (unsigned i=0; i<ctx->stp_module_index; i++)
+      ctx->output << "extern struct _stp_module _stp_module_" << i << ";\n";
    ctx->output << "static struct _stp_module *_stp_modules [] = {\n";
   for (unsigned i=0; i<ctx->stp_module_index; i++)
     {
@@ -7806,6 +8725,12 @@ translate_pass (systemtap_session& s)
       if (s.bulk_mode)
 	  s.op->newline() << "#define STP_BULKMODE";
 
+      if (s.binary_trace)
+	  s.op->newline() << "#define STP_BINARY_TRACE 1";
+
+      if (s.defer_symbols)
+	  s.op->newline() << "#define STP_DEFER_SYMBOLS 1";
+
       if (s.timing || s.monitor)
 	s.op->newline() << "#define STP_TIMING";
 
@@ -7815,6 +8740,15 @@ translate_pass (systemtap_session& s)
       if (s.need_lines)
         s.op->newline() << "#define STP_NEED_LINE_DATA 1";
 
+      // Only lay out the per-cpu variance state if @variance is used.
+      for (map<interned_string, statistic_decl>::const_iterator i = s.stat_decls.begin();
+           i != s.stat_decls.end(); ++i)
+        if (i->second.stat_ops & STAT_OP_VARIANCE)
+          {
+            s.op->newline() << "#define STP_NEED_STAT_VARIANCE 1";
+            break;
+          }
+
       // Emit the total number of probes (not regarding merged probe handlers)
       s.op->newline() << "#define STP_PROBE_COUNT " << s.probes.size();
 
@@ -15,7 +15,7 @@
 using namespace std;
 
 translator_output::translator_output (ostream& f):
-  buf(0), o2 (0), o (f), tablevel (0), trailer_p(false)
+  buf(0), o2 (0), o (f), tablevel (0), trailer_p(false), cacheable_p(false)
 {
 }
 
@@ -26,7 +26,8 @@ translator_output::translator_output (const string& filename, size_t bufsize):
   o (*o2),
   tablevel (0),
   filename (filename),
-  trailer_p (false)
+  trailer_p (false),
+  cacheable_p (false)
 {
   o2->rdbuf()->pubsetbuf(buf, bufsize);
 }
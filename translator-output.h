@@ -26,6 +26,7 @@ class translator_output
 public:
   std::string filename;
   bool trailer_p; // is this file to be linked before or after main generated source file
+  bool cacheable_p; // does its object only depend on its contents and the build flags
 
   translator_output (std::ostream& file);
   translator_output (const std::string& filename, size_t bufsize = 8192);